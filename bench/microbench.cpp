@@ -0,0 +1,312 @@
+// Microbenchmarks of the editor's core routines, run with
+// `make microbench`.
+//
+// The editor is one translation unit, so this file includes it
+// whole with its `main` left out and drives the global state `E`
+// directly. Every benchmark runs over each generated input and
+// prints one JSON object per line:
+//
+//     {"bench":"update_row","input":"short","ops":...,"ns_per_op":...,"mb_per_s":...}
+//
+// `ns_per_op` is the median over repeated passes. Pass a substring
+// as the only argument to run just the matching benchmarks.
+
+#define HED_NO_MAIN
+#include "../src/main.cpp"
+
+// A benchmark runs passes until at least this much time was spent.
+const i64 BENCH_MIN_NS = 200*1000*1000LL;
+const int BENCH_MIN_PASSES = 5;
+
+struct BenchPass {
+    u64 ops;
+    u64 bytes;
+    // Time spent restoring state between operations, which is
+    // subtracted from the pass.
+    i64 untimed_ns;
+};
+
+typedef void (*BenchFn)(BenchPass* pass);
+
+struct Bench {
+    const char* name;
+    BenchFn run;
+};
+
+struct BenchInput {
+    const char* name;
+    std::vector<std::string> rows;
+};
+
+i64 bench_now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Deterministic, so results are comparable between runs.
+u32 bench_seed = 1;
+u32 bench_rand(u32 n) {
+    bench_seed = bench_seed*1103515245 + 12345;
+    return (bench_seed >> 16) % n;
+}
+
+std::string bench_word() {
+    std::string w;
+    int len = 2 + bench_rand(8);
+    for (int i = 0; i < len; i++) w += 'a' + bench_rand(26);
+    return w;
+}
+
+// Short code-like lines indented with spaces.
+void gen_short(std::vector<std::string>* rows) {
+    for (int i = 0; i < 20000; i++) {
+        std::string row(4 * bench_rand(4), ' ');
+        int words = bench_rand(6);
+        for (int w = 0; w < words; w++) row += bench_word() + ' ';
+        rows->push_back(row);
+    }
+}
+
+void gen_long(std::vector<std::string>* rows) {
+    for (int i = 0; i < 500; i++) {
+        std::string row;
+        while (row.size() < 4000) row += bench_word() + ' ';
+        rows->push_back(row);
+    }
+}
+
+// Tab indentation plus tabs between columns.
+void gen_tabs(std::vector<std::string>* rows) {
+    for (int i = 0; i < 20000; i++) {
+        std::string row(1 + bench_rand(6), '\t');
+        int cols = 1 + bench_rand(5);
+        for (int c = 0; c < cols; c++) row += bench_word() + std::string(1 + bench_rand(2), '\t');
+        rows->push_back(row);
+    }
+}
+
+// C with keywords, types, numbers, strings and comments.
+void gen_keywords(std::vector<std::string>* rows) {
+    std::vector<std::string> words;
+    for (int i = 0; C_KEYWORDS[i] != ""; i++) words.push_back(C_KEYWORDS[i]);
+    for (int i = 0; C_TYPES[i] != ""; i++) words.push_back(C_TYPES[i]);
+    for (int i = 0; C_CONSTS[i] != ""; i++) words.push_back(C_CONSTS[i]);
+    for (int i = 0; i < 20000; i++) {
+        std::string row(4 * bench_rand(3), ' ');
+        int n = 3 + bench_rand(8);
+        for (int w = 0; w < n; w++) {
+            switch (bench_rand(6)) {
+                case 0: row += fmt::format("{} ", bench_rand(100000)); break;
+                case 1: row += "\"" + bench_word() + "\" "; break;
+                case 2: row += bench_word() + ' '; break;
+                default: row += words[bench_rand(words.size())] + ' ';
+            }
+        }
+        if (bench_rand(4) == 0) row += "// " + bench_word();
+        rows->push_back(row);
+    }
+}
+
+u64 buffer_bytes() {
+    u64 n = 0;
+    for (int i = 0; i < E.numrows(); i++) n += E.rows[i]->len() + 1;
+    return n;
+}
+
+void bench_update_row(BenchPass* pass) {
+    // Every row stale, as after an edit: tab expansion, a highlight
+    // cache hit, the row hash and the modified-row bookkeeping.
+    // Lexing is measured on its own.
+    E.layout_gen++;
+    for (int i = 0; i < E.numrows(); i++) update_row(E.rows[i]);
+    pass->ops = E.numrows();
+    pass->bytes = buffer_bytes();
+}
+
+void bench_update_row_syntax(BenchPass* pass) {
+    for (int i = 0; i < E.numrows(); i++) update_row_syntax(E.rows[i]);
+    pass->ops = E.numrows();
+    pass->bytes = buffer_bytes();
+}
+
+// The lexer alone, without the highlight cache in front of it.
+void bench_lex_row_syntax(BenchPass* pass) {
+    std::vector<u8> hl;
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = E.rows[i];
+        hl.resize(row_text(row)->rlen);
+        lex_row_syntax(row_text(row)->rdata.data(), row_text(row)->rlen, hl.data());
+    }
+    pass->ops = E.numrows();
+    pass->bytes = buffer_bytes();
+}
+
+void bench_cx_rx(BenchPass* pass) {
+    volatile int sink = 0;
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = E.rows[i];
+        sink += row_cx_to_rx(row, row->len());
+        sink += row_rx_to_cx(row, row_text(row)->rlen);
+    }
+    pass->ops = 2*E.numrows();
+    pass->bytes = 2*buffer_bytes();
+}
+
+void bench_search(BenchPass* pass) {
+    // No match, so every row is scanned.
+    E.set_cpos(0, 0);
+    E.rx = 0;
+    search_text_forward("qqzzqq", false);
+    pass->ops = E.numrows();
+    pass->bytes = buffer_bytes();
+}
+
+void bench_draw_rows(BenchPass* pass) {
+    E.screenrows = 50;
+    E.screencols = 200;
+    pass->ops = 0;
+    pass->bytes = 0;
+    for (int y = 0; y < E.numrows(); y += E.screenrows) {
+        E.rowoff = y;
+        E.abuf.clear();
+        draw_rows();
+        pass->ops++;
+        pass->bytes += E.abuf.size();
+    }
+    E.rowoff = 0;
+}
+
+// Same as draw_rows, with a few decorations on every row.
+void bench_draw_rows_decorated(BenchPass* pass) {
+    i64 t0 = bench_now_ns();
+    std::vector<Decoration> ds;
+    for (int y = 0; y < E.numrows(); y++) {
+        int len = E.rows[y]->len();
+        add_decoration(&ds, DECO_DIAGNOSTIC, y, len/4, y, len/2);
+        add_decoration(&ds, DECO_SEARCH, y, len/3, y, len/3 + 4);
+    }
+    set_decorations(DECO_DIAGNOSTIC, ds);
+    // Build the index outside the timed part.
+    std::vector<Decoration> first;
+    decorations_on_row(0, &first);
+    pass->untimed_ns += bench_now_ns() - t0;
+
+    bench_draw_rows(pass);
+
+    t0 = bench_now_ns();
+    clear_decorations(DECO_DIAGNOSTIC);
+    pass->untimed_ns += bench_now_ns() - t0;
+}
+
+void bench_rows_to_string(BenchPass* pass) {
+    std::string s = rows_to_string();
+    pass->ops = 1;
+    pass->bytes = s.size();
+}
+
+void bench_insert_delete_row(BenchPass* pass) {
+    int mid = E.numrows() / 2;
+    for (int i = 0; i < 1000; i++) {
+        insert_row(mid, "    int inserted = 0;");
+        delete_row(mid);
+    }
+    pass->ops = 2000;
+    pass->bytes = 0;
+}
+
+void bench_cut_region(BenchPass* pass) {
+    pass->ops = 0;
+    pass->bytes = 0;
+    int step = E.numrows() / 100;
+    if (step < 1) step = 1;
+    std::vector<std::string> saved;
+    for (int y = 0; y + 3 < E.numrows(); y += step) {
+        // From the middle of row y to the middle of row y+3.
+        set_named_mark(REGION_MARK, E.rows[y]->len() / 2, y);
+        E.set_cpos(E.rows[y+3]->len() / 2, y+3);
+        i64 t0 = bench_now_ns();
+        saved.clear();
+        for (int i = 0; i < 4; i++) saved.push_back(row_text(E.rows[y+i])->data);
+        pass->untimed_ns += bench_now_ns() - t0;
+
+        do_cut_cursor_mark_region(false);
+
+        t0 = bench_now_ns();
+        replace_rows(y, 1, saved, false);
+        pass->untimed_ns += bench_now_ns() - t0;
+        pass->ops++;
+    }
+}
+
+Bench BENCHES[] = {
+    { "update_row", bench_update_row },
+    { "update_row_syntax", bench_update_row_syntax },
+    { "lex_row_syntax", bench_lex_row_syntax },
+    { "row_cx_rx", bench_cx_rx },
+    { "search_text_forward", bench_search },
+    { "draw_rows", bench_draw_rows },
+    { "draw_rows_decorated", bench_draw_rows_decorated },
+    { "rows_to_string", bench_rows_to_string },
+    { "insert_delete_row", bench_insert_delete_row },
+    { "cut_cursor_mark_region", bench_cut_region },
+};
+#define NUM_BENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+void bench_load(const BenchInput& input) {
+    close_file();
+    insert_rows(0, input.rows);
+    E.syn = &HLDB[0];
+    for (int i = 0; i < E.numrows(); i++) render_row(E.rows[i]);
+    forget_modified_rows();
+}
+
+void bench_run(const Bench& b, const BenchInput& input) {
+    bench_load(input);
+    std::vector<double> ns_per_op;
+    u64 ops = 0, bytes = 0;
+    i64 total = 0;
+    while (total < BENCH_MIN_NS || (int)ns_per_op.size() < BENCH_MIN_PASSES) {
+        BenchPass pass = { 0, 0, 0 };
+        i64 t0 = bench_now_ns();
+        b.run(&pass);
+        i64 ns = bench_now_ns() - t0 - pass.untimed_ns;
+        total += ns;
+        ops = pass.ops;
+        bytes = pass.bytes;
+        ns_per_op.push_back(pass.ops ? (double)ns / pass.ops : 0);
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    double median = ns_per_op[ns_per_op.size()/2];
+    double mb_per_s = median > 0 && ops ? (bytes / (double)ops) / median * 1e9 / (1024*1024) : 0;
+    fputs(fmt::format(
+        "{{\"bench\":\"{}\",\"input\":\"{}\",\"ops\":{},\"passes\":{},\"ns_per_op\":{:.1f},\"min_ns_per_op\":{:.1f},\"mb_per_s\":{:.1f}}}\n",
+        b.name, input.name, ops, ns_per_op.size(), median, ns_per_op[0], mb_per_s).c_str(), stdout);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    const char* filter = argc >= 2 ? argv[1] : "";
+
+    init_editor_state();
+    // Don't let the user's config change what is measured.
+    init_options(&E.global_opts);
+    E.opts = E.global_opts;
+    E.cmdline.clear();
+
+    BenchInput inputs[4];
+    inputs[0].name = "short";
+    gen_short(&inputs[0].rows);
+    inputs[1].name = "long";
+    gen_long(&inputs[1].rows);
+    inputs[2].name = "tabs";
+    gen_tabs(&inputs[2].rows);
+    inputs[3].name = "keywords";
+    gen_keywords(&inputs[3].rows);
+
+    for (usize b = 0; b < NUM_BENCHES; b++) {
+        if (!strstr(BENCHES[b].name, filter)) continue;
+        for (int i = 0; i < 4; i++) bench_run(BENCHES[b], inputs[i]);
+    }
+    return 0;
+}
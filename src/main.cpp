@@ -4,8 +4,28 @@
 #include <cstdlib>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <dirent.h>
 #include <cerrno>
 #include <cstdint>
+#include <climits>
+#include <cstddef>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -29,8 +49,21 @@ typedef int32_t i32;
 typedef int64_t i64;
 typedef ssize_t isize;
 
-const int TAB_STOP = 4;
 const int NUM_FORCE_QUIT_PRESS = 2;
+// Resize signals arriving within this window are merged into one relayout.
+const int RESIZE_SETTLE_MS = 20;
+// Screen rows taken by the build pane, including its title line.
+const int BUILD_PANE_ROWS = 10;
+// Upper bound on build output consumed per wakeup, so a chatty
+// build can't starve keyboard input.
+const usize BUILD_READ_BUDGET = 256*1024;
+// Time a killed build gets to exit on SIGTERM before it is sent
+// SIGKILL.
+const int BUILD_KILL_GRACE_MS = 500;
+// How long a prefix of a longer binding waits for the next key.
+const int KEYMAP_TIMEOUT_MS = 500;
+// Entries kept per history (commands, searches).
+const int HISTORY_MAX = 500;
 
 // if set, outputs a `key.txt` file with keystokes and copy paste info.
 #undef DBGLOG
@@ -69,6 +102,17 @@ enum EditorAction {
     SAVE_FILE,
     REPEAT_SEARCH_FORWARD,
     REPEAT_SEARCH_BACKWARD,
+    JUMP_NEXT_ERROR,
+    JUMP_PREV_ERROR,
+    JUMP_BACK,
+    JUMP_FORWARD,
+    TOGGLE_BOOKMARK,
+    NEXT_BOOKMARK,
+    PREV_BOOKMARK,
+    UNDO,
+    REDO,
+    // Bound to keys that should be swallowed silently.
+    NOP,
 
     CUT_CURSOR_MARK_REGION,
     INSERT_NEWLINE,
@@ -78,8 +122,15 @@ enum EditorAction {
     DELETE_LEFT_CHAR,
     PASTE_FROM_CLIPBOARD,
     OPEN_LINE_BELOW_CURSOR,
+    INDENT_ROW,
+    OUTDENT_ROW,
+    REINDENT_ROW,
+    INDENT_CURSOR_MARK_REGION,
+    OUTDENT_CURSOR_MARK_REGION,
+    REINDENT_CURSOR_MARK_REGION,
 
     AUTOINDENT_JUST_AFTER_NEWLINE,
+    REPLACE_ROWS,
 };
 
 enum EditorKey {
@@ -97,7 +148,14 @@ enum EditorKey {
     ALT_ARROW_UP,
     ALT_ARROW_DOWN,
 
+    // Not a key: one past the last special key.
+    SPECIAL_KEY_END,
+
     UNKNOWN_KEY = -1,
+    // Not a key: the input was only replies to terminal queries.
+    NO_KEY = -2,
+    // Not a key: mouse input, in `MOUSE.events`.
+    MOUSE_INPUT = -3,
 };
 
 #define EDSYN_HLT_NUMBER (1<<0)
@@ -111,6 +169,9 @@ struct EditorSyntax {
     std::string* consts;
     std::string singleline_comment_start;
     int flags;
+    // Characters that open/close an indented block when they end/start a row.
+    std::string indent_open;
+    std::string indent_close;
 };
 
 std::string C_EXTS[] = {"c", "h", "cpp", ""};
@@ -178,7 +239,9 @@ EditorSyntax HLDB[] = {
         C_TYPES,
         C_CONSTS,
         "//",
-        EDSYN_HLT_NUMBER | EDSYN_HLT_STRING
+        EDSYN_HLT_NUMBER | EDSYN_HLT_STRING,
+        "{",
+        "}",
     },
 };
 #define NUM_HLDBS (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -214,59 +277,309 @@ struct UndoInfo {
     EditorAction type;
     std::string data;
     int x, y;
+    // REPLACE_ROWS only: the rows starting at `y` before and after.
+    std::vector<std::string> before, after;
 };
 
-struct EditorRow {
+// Node of the undo tree, see UNDO.
+struct UndoNode {
+    // Takes the buffer from the parent's state to this node's.
+    UndoInfo change;
+    // Index into `E.undo_nodes`, -1 for the root.
+    int parent;
+    // Child that redo moves to: the one made or visited last, -1 if
+    // none.
+    int redo_child;
+    int depth;
+    // Order the changes were made in.
+    u64 seq;
+    // now_us() when the change was made.
+    i64 time;
+    // Memory held by `change`.
+    usize bytes;
+};
+
+enum LineEnding {
+    EOL_LF,
+    EOL_CRLF,
+    EOL_CR,
+};
+
+inline const char* eol_to_str(LineEnding eol) {
+    switch (eol) {
+        case EOL_CRLF: return "\r\n";
+        case EOL_CR: return "\r";
+        default: return "\n";
+    }
+}
+
+inline const char* eol_name(LineEnding eol) {
+    switch (eol) {
+        case EOL_CRLF: return "crlf";
+        case EOL_CR: return "cr";
+        default: return "lf";
+    }
+}
+
+// How the file looked on disk, so that saving writes it back
+// byte-for-byte apart from the edits.
+struct FileFormat {
+    // Terminator given to new rows: the most common one in the file.
+    LineEnding eol;
+    bool bom;
+    // Whether the last row was terminated.
+    bool final_newline;
+    const char* encoding;
+};
+
+struct EditorRow;
+
+// Rows are also linked into an implicit treap ordered by position.
+// Every node carries the hash of its subtree's rows in order, so
+// the hash of the whole buffer is kept up to date in O(log n) per
+// row change, insertion or deletion.
+struct RowHashNode {
+    EditorRow* left;
+    EditorRow* right;
+    EditorRow* parent;
+    u32 prio;
+    int size;
+    // Hash of this row's `data`.
+    u64 hash;
+    // Polynomial hash of the subtree: sum(hash_i * HASH_BASE^i).
+    u64 subhash;
+    // HASH_BASE^size, needed to shift a right sibling's hash.
+    u64 pw;
+};
+
+// Pending change to the positions in a marker subtree: if `set`,
+// every position becomes (y, x); then (dy, dx) is added.
+struct MarkerShift {
+    bool set;
+    int y, x;
+    int dy, dx;
+};
+
+#define MARKER_MARK (1<<0)
+#define MARKER_BOOKMARK (1<<1)
+#define MARKER_JUMP (1<<2)
+// Position kept by another feature.
+#define MARKER_ANCHOR (1<<3)
+
+// Node of the treap of markers ordered by position, see MARKERS.
+struct Marker {
+    Marker* left;
+    Marker* right;
+    Marker* parent;
+    u32 prio;
+    // MARKER_* bit of this marker, and the bits found in its subtree.
+    int kind;
+    int kinds;
+    int y, x;
+    // Shift already applied to this node but not to its children.
+    MarkerShift lazy;
+};
+
+// Kinds of decorations, lowest priority first: where backgrounds
+// overlap, the later kind's is drawn.
+enum DecorationKind {
+    DECO_REGION,
+    DECO_DIAGNOSTIC,
+    DECO_BRACKET,
+    DECO_SEARCH,
+    NUM_DECO_KINDS,
+};
+
+// Text drawn differently from its syntax highlighting, from (x0, y0)
+// up to but not including (x1, y1), in buffer columns.
+struct Decoration {
+    int y0, x0, y1, x1;
+    DecorationKind kind;
+};
+
+// Decorations of a buffer, see DECORATIONS.
+struct DecorationIndex {
+    std::vector<Decoration> by_kind[NUM_DECO_KINDS];
+    // All of `by_kind` sorted by `y0`, read as a balanced tree whose
+    // root is the middle element. `max_y1[i]` is the last row
+    // reached by the subtree rooted at `i`.
+    std::vector<Decoration> items;
+    std::vector<int> max_y1;
+    // `items` needs rebuilding from `by_kind`.
+    bool stale;
+    // Diagnostics need recomputing: the build output or file changed.
+    bool diag_stale;
+    std::string diag_path;
+    // Start and end of each diagnostic shown, as MARKER_ANCHOR
+    // markers so the underline follows edits.
+    std::vector<Marker*> diag_anchors;
+};
+
+struct QuickfixEntry {
+    std::string path;
+    int line, col;
+    // Index into `BuildPane::lines` of the diagnostic.
+    int pane_line;
+};
+
+struct BuildPane {
+    bool open;
+    // -1 when no build is running.
+    pid_t pid;
+    int fd;
+    int exit_status;
+    std::string cmd;
+    std::vector<std::string> lines;
+    // Output after the last newline; parsed once it is complete.
+    std::string partial;
+    std::vector<QuickfixEntry> qf;
+    // Selected quickfix entry, -1 if none.
+    int qf_idx;
+};
+
+struct History {
+    std::vector<std::string> entries;
+    // Entry shown while browsing, -1 when not browsing.
+    int pos;
+    // What was typed before browsing started.
+    std::string pending;
+};
+
+struct Completion {
+    std::vector<std::string> matches;
+    int idx;
+    // Where the completed word starts in the command line.
+    usize start;
+    // Command line as left by the last completion; if it was edited
+    // since, completion starts over.
+    std::string shown;
+};
+
+// Runtime options, see SETTINGS.
+struct Options {
+    int tabstop;
+    // Columns per indent level; 0 means `tabstop`.
+    int shiftwidth;
+    bool expandtab;
+    // Strip trailing whitespace from changed rows on save.
+    bool trimws;
+    // Read options from modelines in opened files.
+    bool modeline;
+    // Guess expandtab and shiftwidth from opened files.
+    bool detectindent;
+    // Share one copy of the text between identical rows.
+    bool intern;
+    // Megabytes of row text kept uncompressed before rows away from
+    // the screen are compressed; 0 never compresses.
+    int coldbudget;
+    // Print the memory report to stderr on exit.
+    bool memreport;
+};
+
+struct HlLine;
+struct ColdBlock;
+struct EditorRow;
+struct RowText;
+
+RowText* row_text(EditorRow* row);
+
+// Text of a row and what is computed from it. With the `intern`
+// option, rows with the same text share one, see ROW TEXT.
+struct RowText {
+    // Rows using this text. A text used by more than one row is
+    // never changed: `row_text_mut` copies it first.
+    int refs;
+    // Listed in `E.interned` under `hash`.
+    bool interned;
+    u64 hash;
     std::string data;
     std::string rdata;
     int rlen;
+    // Highlighting of `rdata`, owned by `hl_line` and shared with
+    // every row with the same text, see HIGHLIGHT CACHE.
     u8* hl;
+    HlLine* hl_line;
+    // Value of `E.layout_gen` when `rdata`, `hl` and `indent` were
+    // computed.
+    u64 layout_gen;
+    // Width of the leading whitespace in columns, -1 if the row is
+    // blank. Read through `row_indent`.
+    int indent;
+    // Set while `data` is also kept compressed as entry `block_idx`
+    // of `block`. While the block is cold, `data` and `rdata` are
+    // empty; `row_text` brings them back. See COLD ROWS.
+    ColdBlock* block;
+    int block_idx;
+    // Sizes of `data` and `rdata` as counted in MEM_TEXT and
+    // MEM_RENDER.
+    usize data_bytes;
+    usize rdata_bytes;
+};
 
-    int len() {
-        return (int)data.size();
-    }
+struct EditorRow {
+    RowText* text;
+    // Value of `E.edit_gen` when this row was last changed.
+    u64 gen;
+    // Index in `E.modified_rows` while `gen > E.save_gen`.
+    int modified_idx;
+    RowHashNode hn;
+    // Terminator this row had on disk; kept per row so files with
+    // mixed line endings round-trip exactly.
+    LineEnding eol;
+
+    int len();
 };
 
-int row_cx_to_rx(EditorRow* row, int cx) {
-    if (!row) return 0;
-    int rx = 0;
-    for (int i = 0; i < cx; i++) {
-        if (row->data[i] == '\t') {
-            rx += (TAB_STOP-1) - (rx%TAB_STOP);
-        }
-        rx++;
-    }
-    return rx;
-}
+// Texts of consecutive rows compressed together, see COLD ROWS.
+struct ColdBlock {
+    // LZ4 block of the `data` of `texts`, one after another.
+    std::string packed;
+    usize raw_size;
+    // NULL where a text was changed or freed since it was packed.
+    std::vector<RowText*> texts;
+    std::vector<u32> lens;
+    int live;
+    // The texts hold their data.
+    bool resident;
+    // `ColdStore::clock` when last read.
+    u64 last_use;
+};
 
-int row_rx_to_cx(EditorRow* row, int rx) {
-    if (!row) return 0;
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->len(); cx++) {
-        if (row->data[cx] == '\t') {
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
-        }
-        cur_rx++;
-        if (cur_rx > rx) return cx;
-    }
-    return cx;
+// The length of a compressed text is kept with its block, so it is
+// answered without decompressing.
+inline int EditorRow::len() {
+    if (text->block && !text->block->resident) return text->block->lens[text->block_idx];
+    return (int)text->data.size();
 }
 
+struct ColdStore {
+    std::vector<ColdBlock*> blocks;
+    u64 clock;
+    // Row the packer continues from.
+    int scan;
+    u64 loads;
+};
+
+int row_cx_to_rx(EditorRow* row, int cx);
+int row_rx_to_cx(EditorRow* row, int rx);
+
 struct EditorConfig {
     int screenrows;
     int screencols;
     int cx, cy, rx, tx;
-    int mx, my;
     int rowoff;
     int coloff;
     EditorMode mode;
     std::string path;
-    bool dirty;
+    FileFormat fmt;
     int cmdx, cmdoff;
-    int hltsx, hltsy, hltex, hltey;
     EditorSyntax* syn;
-    bool indent_as_spaces;
+    // Options of this buffer, and the defaults for files opened later.
+    Options opts;
+    Options global_opts;
+    // Bumped when an option that changes how rows are rendered
+    // changes; rows with an older `layout_gen` are stale.
+    u64 layout_gen;
 
     termios ogtermios;
     std::string abuf;
@@ -274,13 +587,55 @@ struct EditorConfig {
     std::string cmdline;
     time_t cmdline_msg_time;
     CmdlineStyle cmdline_style;
-    std::vector<UndoInfo> undos;
-    // Index of `UndoInfo` that will be applied
-    // if undo action called.
-    int undo_pos;
+    // Every change made to this file, ordered by `seq`. The first
+    // node is the root: the state the file was opened in.
+    std::vector<UndoNode> undo_nodes;
+    // Node whose state the buffer is in.
+    int undo_cur;
+    u64 undo_seq;
+    usize undo_bytes;
+    // Bumped on every row change. Rows with `gen > save_gen` were
+    // changed since the last load/save and are listed in
+    // `modified_rows`, so save-time work can skip untouched rows.
+    u64 edit_gen;
+    u64 save_gen;
+    std::vector<EditorRow*> modified_rows;
+    // Root of the markers of this file.
+    Marker* markers;
+    // Named marks 'a'..'z', NULL until set.
+    Marker* marks[26];
+    // Positions jumped away from, oldest first. `jump_pos` is the
+    // entry last jumped to with jump-back/forward, or `jumps.size()`
+    // when not browsing the list.
+    std::vector<Marker*> jumps;
+    int jump_pos;
+    // The region from the mark to the cursor is shown from when the
+    // mark is set until the next edit, made at `edit_gen` == `region_gen`.
+    bool region_shown;
+    u64 region_gen;
+    DecorationIndex decos;
+    EditorRow* hash_root;
+    // Texts shared between rows, by hash of their data.
+    std::unordered_map<u64, RowText*> interned;
+    ColdStore cold;
+    // Content hash and row count at last load/save. If not valid
+    // (no file, or path changed), the buffer is always dirty.
+    bool saved_hash_valid;
+    u64 saved_hash;
+    int saved_numrows;
     int quit_times;
+    // Set by anything that changes what is on screen; the main loop
+    // only builds a frame when this is set.
+    bool redraw;
     std::string search_default;
+    History cmd_history;
+    History search_history;
+    Completion compl_state;
     clipboard_c* cb;
+    BuildPane build;
+    // Running headless (`--batch`): no terminal, no highlighting,
+    // no undo history.
+    bool batch;
 
     std::ofstream keylog;
 
@@ -292,6 +647,17 @@ struct EditorConfig {
         return (int)rows.size()-1;
     }
 
+    int pane_rows() {
+        if (!build.open) return 0;
+        int max = screenrows/2;
+        return BUILD_PANE_ROWS < max ? BUILD_PANE_ROWS : max;
+    }
+
+    // Screen rows available for the file.
+    int textrows() {
+        return screenrows - pane_rows();
+    }
+
     int cmdline_len() {
         return (int)cmdline.size();
     }
@@ -310,7 +676,7 @@ struct EditorConfig {
     char get_char(int cx, int cy) {
         if (cy >= numrows()) return '\0';
         if (cx == get_row_at(cy)->len()) return '\n';
-        return get_row_at(cy)->data[cx];
+        return row_text(get_row_at(cy))->data[cx];
     }
 
     char get_char_at_cpos() {
@@ -332,19 +698,23 @@ struct EditorConfig {
         return false;
     }
 
-    void reset_hlt() {
-        hltsx = 0;
-        hltsy = 0;
-        hltex = 0;
-        hltey = 0;
-    }
-
     int numundos() {
-        return (int)undos.size();
+        return (int)undo_nodes.size() - 1;
     }
 
+    // The change that undo would revert.
     UndoInfo* lastundo() {
-        return &undos.data()[undos.size()-1];
+        return &undo_nodes[undo_cur].change;
+    }
+
+    u64 content_hash() {
+        return hash_root ? hash_root->hn.subhash : 0;
+    }
+
+    bool is_dirty() {
+        return !saved_hash_valid
+            || saved_numrows != numrows()
+            || saved_hash != content_hash();
     }
 
     void dbglog(const std::string& str) {
@@ -361,10 +731,96 @@ struct EditorConfig {
 };
 EditorConfig E;
 
+// What the terminal can do, see TERMINAL.
+struct TermCaps {
+    // Cache key: $TERM, plus $TERM_PROGRAM where set. Empty until
+    // `term_load`.
+    std::string key;
+    // Sequences taken from terminfo.
+    std::string smcup, rmcup, el, cpr;
+    int colors;
+    // Repeat the previous character (REP), move the cursor right
+    // (CUF).
+    bool rep, cuf;
+    // Synchronized output, DECSET 2026.
+    bool sync;
+    // XTVERSION reply: the terminal's name and version.
+    std::string version;
+    bool from_cache;
+    // Queries sent and not answered yet.
+    bool querying;
+};
+
+// What every terminal since xterm understands.
+const TermCaps TERM_DEFAULTS = {
+    "", "\x1b[?1049h", "\x1b[?1049l", "\x1b[K", "\x1b[6n", 256, false, false, false, "", false, false,
+};
+TermCaps TC = TERM_DEFAULTS;
+
+// One SGR mouse report, see MOUSE.
+struct MouseEvent {
+    // Button and modifier bits as reported.
+    int b;
+    // 0-based screen cell.
+    int x, y;
+    bool release;
+};
+
+struct MouseState {
+    // Reports read together, handled as one input.
+    std::vector<MouseEvent> events;
+    // Where the left button went down, in buffer coordinates, and
+    // whether it has moved since.
+    bool pressed, dragging;
+    int press_cx, press_cy;
+    // Input read but not handled yet: the keys after the first one
+    // of a read, what followed the reports in the same read, or, if
+    // `partial`, the start of a report whose end has not arrived.
+    std::string pending;
+    bool partial;
+};
+MouseState MOUSE;
+
+int row_cx_to_rx(EditorRow* row, int cx) {
+    if (!row) return 0;
+    int rx = 0;
+    for (int i = 0; i < cx; i++) {
+        if (row_text(row)->data[i] == '\t') {
+            rx += (E.opts.tabstop-1) - (rx%E.opts.tabstop);
+        }
+        rx++;
+    }
+    return rx;
+}
+
+int row_rx_to_cx(EditorRow* row, int rx) {
+    if (!row) return 0;
+    int cur_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->len(); cx++) {
+        if (row_text(row)->data[cx] == '\t') {
+            cur_rx += (E.opts.tabstop - 1) - (cur_rx % E.opts.tabstop);
+        }
+        cur_rx++;
+        if (cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+void out_finish();
+void term_load();
+
+// Button presses, motion while a button is held, SGR encoding.
+const char* MOUSE_ON = "\x1b[?1000h\x1b[?1002h\x1b[?1006h";
+const char* MOUSE_OFF = "\x1b[?1006l\x1b[?1002l\x1b[?1000l";
+
 void disable_raw_mode() {
-    write(STDOUT_FILENO, "\x1b[?1049l", 8);
+    if (E.batch) return;
+    out_finish();
+    write(STDOUT_FILENO, MOUSE_OFF, strlen(MOUSE_OFF));
+    write(STDOUT_FILENO, TC.rmcup.data(), TC.rmcup.size());
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.ogtermios) == -1) {
         perror("tcsetattr");
         exit(1);
@@ -392,7 +848,9 @@ namespace core {
 }
 
 void enable_raw_mode() {
-    write(STDOUT_FILENO, "\x1b[?1049h", 8);
+    term_load();
+    write(STDOUT_FILENO, TC.smcup.data(), TC.smcup.size());
+    write(STDOUT_FILENO, MOUSE_ON, strlen(MOUSE_ON));
     if (tcgetattr(STDIN_FILENO, &E.ogtermios) == -1)
         core::error_exit_from("tcgetattr");
 
@@ -412,13 +870,385 @@ void enable_raw_mode() {
         core::error_exit_from("tcsetattr");
 }
 
+// ============= EVENT LOOP ==============
+
+typedef void (*EventFdHandler)(int fd);
+typedef void (*EventTimerHandler)();
+
+struct EventWatch {
+    int fd;
+    // POLLIN or POLLOUT.
+    short events;
+    EventFdHandler handler;
+};
+
+struct EventTimer {
+    i64 due;
+    EventTimerHandler handler;
+};
+
+struct EventLoop {
+    std::vector<EventWatch> watches;
+    std::vector<EventTimer> timers;
+    // Self-pipe: signal handlers write a byte here so the
+    // signal is seen by `poll` like any other input.
+    int sigpipe[2];
+};
+EventLoop EL;
+
+i64 now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void ev_watch(int fd, EventFdHandler handler, short events = POLLIN) {
+    for (usize i = 0; i < EL.watches.size(); i++) {
+        if (EL.watches[i].fd == fd) {
+            EL.watches[i].events = events;
+            EL.watches[i].handler = handler;
+            return;
+        }
+    }
+    EL.watches.push_back({ fd, events, handler });
+}
+
+void ev_unwatch(int fd) {
+    for (usize i = 0; i < EL.watches.size(); i++) {
+        if (EL.watches[i].fd == fd) {
+            EL.watches.erase(EL.watches.begin() + i);
+            return;
+        }
+    }
+}
+
+// Timers are one-shot and keyed by handler: setting a timer
+// that is already pending pushes its deadline back, which is
+// what we want for debouncing.
+void ev_set_timer(EventTimerHandler handler, int ms) {
+    i64 due = now_ms() + ms;
+    for (usize i = 0; i < EL.timers.size(); i++) {
+        if (EL.timers[i].handler == handler) {
+            EL.timers[i].due = due;
+            return;
+        }
+    }
+    EL.timers.push_back({ due, handler });
+}
+
+void ev_cancel_timer(EventTimerHandler handler) {
+    for (usize i = 0; i < EL.timers.size(); i++) {
+        if (EL.timers[i].handler == handler) {
+            EL.timers.erase(EL.timers.begin() + i);
+            return;
+        }
+    }
+}
+
+void set_fd_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        core::error_exit_from("fcntl");
+}
+
+void ev_init() {
+    if (pipe(EL.sigpipe) == -1) core::error_exit_from("pipe");
+    set_fd_nonblocking(EL.sigpipe[0]);
+    set_fd_nonblocking(EL.sigpipe[1]);
+    fcntl(EL.sigpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(EL.sigpipe[1], F_SETFD, FD_CLOEXEC);
+}
+
+// Waits for at least one fd to become ready or a timer to
+// expire, and dispatches everything that is ready.
+void ev_run_once() {
+    std::vector<pollfd> fds;
+    for (usize i = 0; i < EL.watches.size(); i++) {
+        pollfd p;
+        p.fd = EL.watches[i].fd;
+        p.events = EL.watches[i].events;
+        p.revents = 0;
+        fds.push_back(p);
+    }
+
+    int timeout = -1;
+    if (EL.timers.size() != 0) {
+        i64 now = now_ms();
+        i64 nearest = EL.timers[0].due;
+        for (usize i = 1; i < EL.timers.size(); i++) {
+            if (EL.timers[i].due < nearest) nearest = EL.timers[i].due;
+        }
+        timeout = nearest > now ? (int)(nearest - now) : 0;
+    }
+
+    int n = poll(fds.data(), fds.size(), timeout);
+    if (n == -1 && errno != EINTR) core::error_exit_from("poll");
+
+    for (usize i = 0; n > 0 && i < fds.size(); i++) {
+        if (!(fds[i].revents & (fds[i].events | POLLHUP | POLLERR))) continue;
+        // A previous handler may have removed this watch.
+        for (usize w = 0; w < EL.watches.size(); w++) {
+            if (EL.watches[w].fd == fds[i].fd) {
+                EL.watches[w].handler(fds[i].fd);
+                break;
+            }
+        }
+    }
+
+    i64 now = now_ms();
+    for (usize i = 0; i < EL.timers.size();) {
+        if (EL.timers[i].due <= now) {
+            EventTimerHandler handler = EL.timers[i].handler;
+            EL.timers.erase(EL.timers.begin() + i);
+            handler();
+            i = 0;
+        } else i++;
+    }
+}
+
+// ============= TRACE ==============
+
+// `trace start` records a timeline of spans around the editor's
+// major operations until `trace stop [path]` writes them as Chrome
+// trace-event JSON, viewable in chrome://tracing or Perfetto.
+//
+// A span is opened with TRACE_SCOPE("name") (a string literal) and
+// closed when the scope ends. While tracing is off that costs one
+// load and branch. Each thread records into its own ring buffer,
+// so recording takes no lock; when a buffer is full the oldest
+// events are overwritten.
+
+// Events kept per thread.
+const usize TRACE_BUFFER_EVENTS = 256*1024;
+
+struct TraceEvent {
+    const char* name;
+    i64 ts_us;
+    i64 dur_us;
+    // Size of the work (bytes, rows), -1 if not given.
+    i64 arg;
+};
+
+struct TraceBuffer {
+    u32 tid;
+    std::vector<TraceEvent> events;
+    // Total events recorded; the last TRACE_BUFFER_EVENTS are kept.
+    u64 count;
+};
+
+struct Tracer {
+    std::atomic<bool> enabled;
+    i64 start_us;
+    // Guards `buffers`, which threads append to on their first span.
+    std::mutex lock;
+    std::vector<TraceBuffer*> buffers;
+};
+Tracer TRACER;
+thread_local TraceBuffer* trace_buffer = NULL;
+
+i64 now_us() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (i64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void trace_record(const char* name, i64 start, i64 dur, i64 arg) {
+    if (!trace_buffer) {
+        trace_buffer = new TraceBuffer();
+        trace_buffer->tid = (u32)syscall(SYS_gettid);
+        trace_buffer->count = 0;
+        std::lock_guard<std::mutex> guard(TRACER.lock);
+        TRACER.buffers.push_back(trace_buffer);
+    }
+    TraceBuffer* b = trace_buffer;
+    if (b->events.size() < TRACE_BUFFER_EVENTS) b->events.resize(TRACE_BUFFER_EVENTS);
+    TraceEvent* e = &b->events[b->count % TRACE_BUFFER_EVENTS];
+    e->name = name;
+    e->ts_us = start;
+    e->dur_us = dur;
+    e->arg = arg;
+    b->count++;
+}
+
+struct TraceSpan {
+    const char* name;
+    // -1 if tracing was off when the span was opened.
+    i64 start;
+    i64 arg;
+
+    TraceSpan(const char* name)
+        : name(name), start(TRACER.enabled.load(std::memory_order_relaxed) ? now_us() : -1), arg(-1) {}
+
+    ~TraceSpan() {
+        if (start >= 0) trace_record(name, start, now_us() - start, arg);
+    }
+};
+
+#define TRACE_SCOPE(name) TraceSpan trace_span(name)
+// Attaches a size to the innermost TRACE_SCOPE.
+#define TRACE_ARG(n) (trace_span.arg = (i64)(n))
+
+const char* trace_start() {
+    if (TRACER.enabled) return "already tracing";
+    std::lock_guard<std::mutex> guard(TRACER.lock);
+    for (usize i = 0; i < TRACER.buffers.size(); i++) TRACER.buffers[i]->count = 0;
+    TRACER.start_us = now_us();
+    TRACER.enabled = true;
+    return NULL;
+}
+
+// Stops tracing and writes what was recorded to `path`. Sets
+// `*nevents` to the number of events written. Returns an error
+// message, or NULL.
+const char* trace_stop(const std::string& path, u64* nevents) {
+    if (!TRACER.enabled) return "not tracing";
+    TRACER.enabled = false;
+
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) return "cannot write trace";
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+    int pid = getpid();
+    fputs(fmt::format("{{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":{},\"args\":{{\"name\":\"hed\"}}}}", pid).c_str(), f);
+
+    *nevents = 0;
+    std::lock_guard<std::mutex> guard(TRACER.lock);
+    for (usize i = 0; i < TRACER.buffers.size(); i++) {
+        TraceBuffer* b = TRACER.buffers[i];
+        u64 first = b->count > TRACE_BUFFER_EVENTS ? b->count - TRACE_BUFFER_EVENTS : 0;
+        for (u64 n = first; n < b->count; n++) {
+            TraceEvent* e = &b->events[n % TRACE_BUFFER_EVENTS];
+            std::string args = e->arg >= 0 ? fmt::format(",\"args\":{{\"n\":{}}}", e->arg) : "";
+            fputs(fmt::format(",\n{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":{},\"tid\":{}{}}}",
+                e->name, e->ts_us - TRACER.start_us, e->dur_us, pid, b->tid, args).c_str(), f);
+        }
+        *nevents += b->count - first;
+        b->count = 0;
+    }
+    fputs("\n]}\n", f);
+    if (ferror(f) | fclose(f)) return "cannot write trace";
+    return NULL;
+}
+
+int term_take_replies(char* buf, int n);
+
+// Longest mouse report taken as one; anything longer is not a
+// report.
+const int MOUSE_REPORT_MAX = 32;
+
+// Reads the SGR mouse reports (`ESC [ < b ; x ; y M`, or `m` on
+// release) at the start of `buf` into `MOUSE.events`. Returns how
+// many there were, with the bytes they took in `used`. `partial` is
+// set if the input ends inside a report.
+int parse_mouse_reports(const char* buf, int n, int* used, bool* partial) {
+    MOUSE.events.clear();
+    *partial = false;
+    int i = 0;
+    while (i + 3 <= n && !memcmp(buf + i, "\x1b[<", 3)) {
+        int v[3] = { 0, 0, 0 };
+        int k = 0, j = i + 3;
+        for (; j < n && j - i < MOUSE_REPORT_MAX; j++) {
+            if (isdigit(buf[j])) v[k] = v[k]*10 + (buf[j] - '0');
+            else if (buf[j] == ';' && k < 2) k++;
+            else break;
+        }
+        if (j == n) {
+            *partial = true;
+            break;
+        }
+        if ((buf[j] != 'M' && buf[j] != 'm') || k != 2) break;
+        MOUSE.events.push_back({ v[0], v[1] - 1, v[2] - 1, buf[j] == 'm' });
+        i = j + 1;
+    }
+    *used = i;
+    return MOUSE.events.size();
+}
+
+// Keys read together with others or with mouse reports are still
+// to be handled.
+bool input_pending() {
+    return MOUSE.pending != "" && !MOUSE.partial;
+}
+
+// Decodes the key at the start of `buf`, setting `used` to the
+// bytes it takes: one character, an escape sequence or Alt with a
+// character. A UTF-8 character is taken whole, as UNKNOWN_KEY.
+int decode_key(const char* buf, int n, int* used) {
+    *used = 1;
+    if (buf[0] != '\x1b') {
+        if ((u8)buf[0] < 0x80) return buf[0];
+        while (*used < n && ((u8)buf[*used] & 0xc0) == 0x80) (*used)++;
+        return UNKNOWN_KEY;
+    }
+    if (n == 1 || buf[1] == '\x1b') return '\x1b';
+    if (buf[1] != '[' && buf[1] != 'O') {
+        *used = 2;
+        switch (buf[1]) {
+            case 'm': return ALT_M;
+            case 's': return ALT_S;
+        }
+        return UNKNOWN_KEY;
+    }
+    if (buf[1] == 'O') {
+        *used = std::min(n, 3);
+        return UNKNOWN_KEY;
+    }
+    // CSI: parameters, then a final byte in @..~.
+    int i = 2;
+    while (i < n && (buf[i] < 0x40 || buf[i] > 0x7e)) i++;
+    *used = std::min(n, i+1);
+    std::string seq(buf + 2, *used - 2);
+    if (seq == "A") return ARROW_UP;
+    if (seq == "B") return ARROW_DOWN;
+    if (seq == "C") return ARROW_RIGHT;
+    if (seq == "D") return ARROW_LEFT;
+    if (seq == "1;3A") return ALT_ARROW_UP;
+    if (seq == "1;3B") return ALT_ARROW_DOWN;
+    if (seq == "1;3C") return ALT_ARROW_RIGHT;
+    if (seq == "1;3D") return ALT_ARROW_LEFT;
+    return UNKNOWN_KEY;
+}
+
 int read_key() {
-    char buf[64];
-    int nread;
-    while ((nread = read(STDIN_FILENO, buf, 64)) == 0);
-    if (nread == -1 && errno != EAGAIN) core::error_exit_from("read");
+    TRACE_SCOPE("read_key");
+    // Large enough for a burst of mouse reports, which are handled
+    // together.
+    char buf[1024];
+    int nread = MOUSE.pending.size();
+    memcpy(buf, MOUSE.pending.data(), nread);
+    MOUSE.pending.clear();
+    if (nread == 0 || MOUSE.partial) {
+        int n;
+        while ((n = read(STDIN_FILENO, buf + nread, sizeof(buf) - nread)) == 0);
+        if (n == -1 && errno != EAGAIN) core::error_exit_from("read");
+        if (n > 0 || nread == 0) nread += n;
+    }
+    MOUSE.partial = false;
+    if (nread > 0) {
+        nread = term_take_replies(buf, nread);
+        if (nread == 0) return NO_KEY;
+
+        // Reports, and what was read with them, are handled one
+        // after the other.
+        const char* report = (const char*)memmem(buf, nread, "\x1b[<", 3);
+        if (report && report != buf) {
+            MOUSE.pending.assign(report, buf + nread - report);
+            nread = report - buf;
+        } else if (report) {
+            int used;
+            int n = parse_mouse_reports(buf, nread, &used, &MOUSE.partial);
+            if (n || MOUSE.partial) {
+                MOUSE.pending.assign(buf + used, nread - used);
+                return n ? MOUSE_INPUT : NO_KEY;
+            }
+        }
+    }
 
-    for (int i = 0; i < nread; i++) {
+    if (nread <= 0) return NO_KEY;
+    int used;
+    int key = decode_key(buf, nread, &used);
+    MOUSE.pending.insert(0, buf + used, nread - used);
+
+    for (int i = 0; i < used; i++) {
         switch (buf[i]) {
             case '\x1b':    E.dbglog("[esc]"); break;
             case BACKSPACE: E.dbglog("[bksp]"); break;
@@ -430,47 +1260,12 @@ int read_key() {
         E.dbglog(' ');
     }
     E.dbglog('\n');
-
-    if (buf[0] == '\x1b' && nread == 1) {
-        return '\x1b';
-    } else if (nread > 1) {
-        if (buf[1] == '[') {
-            switch (buf[2]) {
-                case 'A': return ARROW_UP;
-                case 'B': return ARROW_DOWN;
-                case 'C': return ARROW_RIGHT;
-                case 'D': return ARROW_LEFT;
-                case '1': {
-                    switch (buf[3]) {
-                        case ';': {
-                            switch (buf[4]) {
-                                case '3': {
-                                    switch (buf[5]) {
-                                        case 'A': return ALT_ARROW_UP;
-                                        case 'B': return ALT_ARROW_DOWN;
-                                        case 'C': return ALT_ARROW_RIGHT;
-                                        case 'D': return ALT_ARROW_LEFT;
-                                    }
-                                } break;
-                            }
-                        } break;
-                    }
-                } break;
-            }
-        } else {
-            switch (buf[1]) {
-                case 'm': return ALT_M;
-                case 's': return ALT_S;
-            }
-        }
-    } else if (nread == 1) {
-        return buf[0];
-    }
-    return UNKNOWN_KEY;
+    return key;
 }
 
 int get_cursor_position(int* rows, int* cols) {
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
+    out_finish();
+    if (write(STDOUT_FILENO, TC.cpr.data(), TC.cpr.size()) != (ssize_t)TC.cpr.size()) return -1;
 
     char buf[32];
     u32 i = 0;
@@ -489,6 +1284,7 @@ int get_cursor_position(int* rows, int* cols) {
 int get_window_size(int* rows, int* cols) {
     winsize ws;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        out_finish();
         if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
         return get_cursor_position(rows, cols);
     } else {
@@ -507,6 +1303,16 @@ bool str_startswith(const std::string& str, const std::string& startswith) {
     return str.rfind(startswith, 0) == 0;
 }
 
+const char* WHITESPACE = " \t\n\r\f\v";
+
+void str_trim_leading_ws(std::string& s) {
+    s.erase(0, s.find_first_not_of(WHITESPACE));
+}
+
+void str_trim_trailing_ws(std::string& s) {
+    s.erase(s.find_last_not_of(WHITESPACE)+1);
+}
+
 bool is_char_printable(int c) {
     return c >= 32 && c <= 126;
 }
@@ -515,13 +1321,13 @@ bool is_char_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-bool match_syn_word(std::string* wordlist, EditorRow* row, int* i, EditorHighlight hl) {
+bool match_syn_word(std::string* wordlist, const char* rdata, u8* hls, int* i, EditorHighlight hl) {
     bool found = false;
     for (int j = 0; wordlist[j] != ""; j++) {
         int klen = wordlist[j].size();
-        if (!strncmp(&row->rdata[*i], wordlist[j].c_str(), klen) &&
-            is_char_separator(row->rdata[*i+klen])) {
-            memset(&row->hl[*i], hl, klen);
+        if (!strncmp(&rdata[*i], wordlist[j].c_str(), klen) &&
+            is_char_separator(rdata[*i+klen])) {
+            memset(&hls[*i], hl, klen);
             *i += klen;
             found = true;
             break;
@@ -530,10 +1336,10 @@ bool match_syn_word(std::string* wordlist, EditorRow* row, int* i, EditorHighlig
     return found;
 }
 
-void update_row_syntax(EditorRow* row) {
-    int rlen = row->rlen;
-    row->hl = (u8*)realloc(row->hl, rlen);
-    memset(row->hl, HL_NORMAL, rlen);
+// Highlights `rlen` rendered characters at `rdata`, which must be
+// followed by a '\0', into `hl`.
+void lex_row_syntax(const char* rdata, int rlen, u8* hl) {
+    memset(hl, HL_NORMAL, rlen);
 
     if (E.syn == NULL) return;
 
@@ -548,21 +1354,21 @@ void update_row_syntax(EditorRow* row) {
     int i = 0;
 
     while (i < rlen) {
-        char c = row->rdata[i];
-        EditorHighlight prev_hl = (i > 0) ? (EditorHighlight)row->hl[i-1] : HL_NORMAL;
+        char c = rdata[i];
+        EditorHighlight prev_hl = (i > 0) ? (EditorHighlight)hl[i-1] : HL_NORMAL;
 
         if (scs.size() && !which_string) {
-            if (!strncmp(&row->rdata[i], scs.c_str(), scs.size())) {
-                memset(&row->hl[i], HL_COMMENT, rlen-i);
+            if (!strncmp(&rdata[i], scs.c_str(), scs.size())) {
+                memset(&hl[i], HL_COMMENT, rlen-i);
                 break;
             }
         }
 
         if (E.syn->flags & EDSYN_HLT_STRING) {
             if (which_string) {
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 if (c == '\\' && i+1 < rlen) {
-                    row->hl[i+1] = HL_STRING;
+                    hl[i+1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -573,7 +1379,7 @@ void update_row_syntax(EditorRow* row) {
             } else {
                 if ((c == '"' || c == '\'')) {
                     which_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
@@ -582,7 +1388,7 @@ void update_row_syntax(EditorRow* row) {
 
         if (E.syn->flags & EDSYN_HLT_NUMBER) {
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = false;
                 continue;
@@ -590,11 +1396,11 @@ void update_row_syntax(EditorRow* row) {
         }
 
         if (prev_sep) {
-            bool found = match_syn_word(keywords, row, &i, HL_KEYWORD);
+            bool found = match_syn_word(keywords, rdata, hl, &i, HL_KEYWORD);
             if (!found) {
-                found = match_syn_word(types, row, &i, HL_TYPE);
+                found = match_syn_word(types, rdata, hl, &i, HL_TYPE);
                 if (!found) {
-                    found = match_syn_word(consts, row, &i, HL_CONST);
+                    found = match_syn_word(consts, rdata, hl, &i, HL_CONST);
                 }
             }
 
@@ -609,772 +1415,3404 @@ void update_row_syntax(EditorRow* row) {
     }
 }
 
-void update_row(EditorRow* row) {
-    row->rdata.reserve(row->len());
-    row->rdata.clear();
-    for (int i = 0; i < row->len(); i++) {
-        if (row->data[i] == '\t') {
-            row->rdata.push_back(' ');
-            while (row->rdata.size() % TAB_STOP != 0) {
-                row->rdata.push_back(' ');
-            }
-        } else {
-            row->rdata.push_back(row->data[i]);
-        }
-    }
+// ============= OUTPUT ==============
+
+// Frames are written to the terminal without blocking. A frame the
+// terminal can't take at once is finished from the event loop when
+// it becomes writable again, and no new frame is built until then:
+// the next one is built from the state at that point, so frames the
+// terminal had no time for are skipped rather than queued, and input
+// keeps being handled meanwhile. Frames are never cut short, which
+// would leave an escape sequence half-written.
+
+struct Output {
+    // Our own descriptor for the terminal: stdout's file description
+    // is usually shared with stdin, which must stay blocking.
+    int fd;
+    // The frame being written, from `off` on.
+    std::string frame;
+    usize off;
+    u64 frames, partial_writes;
+    // Keys handled while a frame was still being written.
+    u64 keys_behind;
+};
 
-    // Compute size before adding '\0'
-    row->rlen = row->rdata.size();
-    row->rdata.push_back('\0');
-    E.dirty = true;
+Output OUT = { -1, "", 0, 0, 0, 0 };
 
-    update_row_syntax(row);
+void out_init() {
+    const char* tty = ttyname(STDOUT_FILENO);
+    OUT.fd = tty ? open(tty, O_WRONLY | O_NOCTTY) : -1;
+    if (OUT.fd == -1) {
+        // Not a terminal: plain blocking writes.
+        OUT.fd = STDOUT_FILENO;
+        return;
+    }
+    set_fd_nonblocking(OUT.fd);
+    fcntl(OUT.fd, F_SETFD, FD_CLOEXEC);
 }
 
-EditorRow* insert_row(int at, const std::string& data) {
-    if (at < 0 || at > E.numrows()) return NULL;
-    EditorRow* row = new EditorRow();
-    row->data = data;
-    row->hl = NULL;
-    E.rows.insert(E.rows.begin() + at, row);
-    update_row(row);
-    return row;
+// True while a frame has not been fully written.
+bool out_busy() {
+    return OUT.off < OUT.frame.size();
 }
 
-void free_row(EditorRow* row) {
-    free(row->hl);
-    delete row;
+void on_output_writable(int fd);
+
+void out_flush() {
+    TRACE_SCOPE("write_frame");
+    TRACE_ARG(OUT.frame.size() - OUT.off);
+    while (out_busy()) {
+        ssize_t n = write(OUT.fd, OUT.frame.data() + OUT.off, OUT.frame.size() - OUT.off);
+        if (n > 0) {
+            OUT.off += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            OUT.partial_writes++;
+            ev_watch(OUT.fd, on_output_writable, POLLOUT);
+            return;
+        } else {
+            core::error_exit_from("write");
+        }
+    }
+    ev_unwatch(OUT.fd);
 }
 
-std::string delete_row(int at) {
-        if (at < 0 || at >= E.numrows()) return "";
-    EditorRow* row = E.get_row_at(at);
-    std::string rowdata = row->data;
-    free_row(row);
-    E.rows.erase(E.rows.begin() + at);
-    E.dirty = true;
-    return rowdata;
+void on_output_writable(int fd) {
+    out_flush();
 }
 
-void row_insert_char(EditorRow* row, int at, int c) {
-    if (at < 0 || at > row->len()) at = row->len();
-    row->data.insert(at, 1, c);
-    update_row(row);
+// Writes `*frame`, taking its contents. Only called once the
+// previous frame is written, see `main`.
+void out_submit(std::string* frame) {
+    std::swap(OUT.frame, *frame);
+    OUT.off = 0;
+    OUT.frames++;
+    out_flush();
 }
 
-void row_insert_string(EditorRow* row, int at, const std::string& str) {
-    if (at < 0 || at > row->len()) at = row->len();
-    row->data.insert(at, str);
-    update_row(row);
+// Writes what is left of the frame, blocking, so that what is
+// written to the terminal next doesn't land inside an escape
+// sequence.
+void out_finish() {
+    if (!out_busy()) return;
+    int flags = fcntl(OUT.fd, F_GETFL, 0);
+    fcntl(OUT.fd, F_SETFL, flags & ~O_NONBLOCK);
+    out_flush();
+    fcntl(OUT.fd, F_SETFL, flags);
 }
 
-std::string row_delete_range(EditorRow* row, int at, int len) {
-    if (at < 0 || at+len > row->len() || len == 0) return "";
-    std::string copy = row->data.substr(at, len);
-    row->data.erase(at, len);
-    update_row(row);
-    return copy;
+// ============= TERMINAL ==============
+
+// Escape sequences come from the terminal's terminfo entry, read
+// directly from the compiled file, where they differ from the
+// defaults everything speaks. What terminfo can't tell is asked of
+// the terminal itself once the editor runs: XTVERSION for its name,
+// DECRQM for synchronized output, and DA1, which every terminal
+// answers, to know when the replies are in. Replies come in with
+// the keys and are taken out by `read_key`; nothing waits for them.
+// The result is cached per TERM, so later starts neither read
+// terminfo nor query. `terminal detect` starts over.
+
+const int TERM_QUERY_TIMEOUT_MS = 1000;
+// Shortest run of one character worth drawing with REP or CUF.
+const int TERM_MIN_RUN = 8;
+
+// Indices into a terminfo entry, as in <term.h>.
+const int TI_MAX_COLORS = 13;
+const int TI_CLR_EOL = 6;
+const int TI_ENTER_CA_MODE = 28;
+const int TI_EXIT_CA_MODE = 40;
+const int TI_PARM_RIGHT_CURSOR = 112;
+const int TI_REPEAT_CHAR = 121;
+const int TI_USER7 = 294;
+
+std::string TERMINFO_DIRS[] = {
+    "/etc/terminfo",
+    "/lib/terminfo",
+    "/usr/share/terminfo",
+    "/usr/lib/terminfo",
+    "",
+};
+
+struct Terminfo {
+    std::vector<int> nums;
+    // Absent strings are empty.
+    std::vector<std::string> strs;
+    // Extended capabilities (tmux's `Sync`, `RGB`, ...) by name.
+    std::unordered_map<std::string, std::string> ext;
+};
+
+std::string terminfo_file(const std::string& term) {
+    std::vector<std::string> dirs;
+    const char* env = getenv("TERMINFO");
+    if (env && *env) dirs.push_back(env);
+    const char* home = getenv("HOME");
+    if (home && *home) dirs.push_back(std::string(home) + "/.terminfo");
+    env = getenv("TERMINFO_DIRS");
+    if (env && *env) {
+        std::istringstream list(env);
+        std::string dir;
+        while (std::getline(list, dir, ':')) dirs.push_back(dir != "" ? dir : "/usr/share/terminfo");
+    }
+    for (int i = 0; TERMINFO_DIRS[i] != ""; i++) dirs.push_back(TERMINFO_DIRS[i]);
+
+    for (usize i = 0; i < dirs.size(); i++) {
+        // Linux puts `xterm` under `x/`, macOS under `78/`.
+        std::string subdirs[] = { std::string(1, term[0]), fmt::format("{:02x}", (u8)term[0]) };
+        for (int k = 0; k < 2; k++) {
+            std::ifstream f(dirs[i] + "/" + subdirs[k] + "/" + term, std::ios::binary);
+            if (f) return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        }
+    }
+    return "";
 }
 
-void row_append_string(EditorRow* row, const std::string& str) {
-    row->data += str;
-    update_row(row);
+int terminfo_short(const std::string& d, usize at) {
+    if (at + 2 > d.size()) return -1;
+    return (i16)((u8)d[at] | (u8)d[at+1] << 8);
 }
 
-int row_get_indent_col(EditorRow* row) {
-    int indent = 0;
-    for (int i = 0; i < row->len(); i++) {
-        if (row->data[i] == '\t') {
-            indent += TAB_STOP;
-        } else if (row->data[i] == ' ') {
-            indent++;
-        } else break;
+int terminfo_int(const std::string& d, usize at, int width) {
+    if (width == 2) return terminfo_short(d, at);
+    if (at + 4 > d.size()) return -1;
+    return (i32)((u8)d[at] | (u8)d[at+1] << 8 | (u8)d[at+2] << 16 | (u32)(u8)d[at+3] << 24);
+}
+
+// The string at `off` in the table at `table`, "" if absent.
+std::string terminfo_str(const std::string& d, usize table, usize size, int off) {
+    if (off < 0 || (usize)off >= size || table + off >= d.size()) return "";
+    return std::string(d.c_str() + table + off, strnlen(d.c_str() + table + off, size - off));
+}
+
+// Parses a compiled entry, see term(5). False if it is malformed.
+bool terminfo_parse(const std::string& d, Terminfo* ti) {
+    int magic = terminfo_short(d, 0);
+    int width = magic == 0432 ? 2 : magic == 01036 ? 4 : 0;
+    if (!width) return false;
+    int names = terminfo_short(d, 2), nbools = terminfo_short(d, 4);
+    int nnums = terminfo_short(d, 6), nstrs = terminfo_short(d, 8);
+    int table_size = terminfo_short(d, 10);
+    if (names < 0 || nbools < 0 || nnums < 0 || nstrs < 0 || table_size < 0) return false;
+
+    usize at = 12 + names + nbools;
+    at += at & 1;
+    for (int i = 0; i < nnums; i++) ti->nums.push_back(terminfo_int(d, at + i*width, width));
+    at += nnums * width;
+    usize table = at + nstrs*2;
+    if (table + table_size > d.size()) return false;
+    for (int i = 0; i < nstrs; i++) ti->strs.push_back(terminfo_str(d, table, table_size, terminfo_short(d, at + i*2)));
+    at = table + table_size;
+    at += at & 1;
+
+    // Extended capabilities: booleans, numbers and strings, then
+    // the offsets of the string values and of all their names. The
+    // names follow the values in the table.
+    int ebools = terminfo_short(d, at), enums = terminfo_short(d, at+2), estrs = terminfo_short(d, at+4);
+    int etable_size = terminfo_short(d, at+8);
+    if (ebools < 0 || enums < 0 || estrs < 0 || etable_size < 0) return true;
+    usize ebool_at = at + 10;
+    usize enum_at = ebool_at + ebools + ((ebools & 1) ? 1 : 0);
+    usize eoff_at = enum_at + enums*width;
+    int nnames = ebools + enums + estrs;
+    usize etable = eoff_at + (estrs + nnames)*2;
+    if (etable + etable_size > d.size()) return true;
+    usize names_at = 0;
+    std::vector<std::string> values;
+    for (int i = 0; i < estrs; i++) {
+        int off = terminfo_short(d, eoff_at + i*2);
+        values.push_back(terminfo_str(d, etable, etable_size, off));
+        if (off >= 0) names_at = std::max(names_at, off + values.back().size() + 1);
+    }
+    for (int i = 0; i < nnames; i++) {
+        int off = terminfo_short(d, eoff_at + (estrs + i)*2);
+        if (off < 0) continue;
+        std::string name = terminfo_str(d, etable + names_at, etable_size - names_at, off);
+        if (i < ebools) {
+            if (d[ebool_at + i] == 1) ti->ext[name] = "1";
+        } else if (i < ebools + enums) {
+            int v = terminfo_int(d, enum_at + (i - ebools)*width, width);
+            if (v >= 0) ti->ext[name] = std::to_string(v);
+        } else if (values[i - ebools - enums] != "") {
+            ti->ext[name] = values[i - ebools - enums];
+        }
     }
-    return indent;
+    return true;
 }
 
-template<typename... Args>
-void set_cmdline_msg_info(const std::string& fmt, Args... args) {
-    if (E.mode != COMMAND && E.mode != SEARCH) {
-        E.cmdline = fmt::format(fmt, args...);
-        E.cmdline_msg_time = time(NULL);
-        E.cmdline_style = NONE;
+// `s` without the padding delays, such as `$<3>`, that only
+// matter to hardware terminals.
+std::string terminfo_unpad(const std::string& s) {
+    std::string out;
+    for (usize i = 0; i < s.size(); i++) {
+        usize end;
+        if (s[i] == '$' && i+1 < s.size() && s[i+1] == '<' && (end = s.find('>', i)) != std::string::npos) {
+            i = end;
+        } else {
+            out += s[i];
+        }
     }
+    return out;
 }
 
-template<typename... Args>
-void set_cmdline_msg_error(const std::string& fmt, Args... args) {
-    if (E.mode != COMMAND && E.mode != SEARCH) {
-        E.cmdline = fmt::format(fmt, args...);
-        E.cmdline_msg_time = time(NULL);
-        E.cmdline_style = ERROR;
+bool terminfo_load(const std::string& term) {
+    Terminfo ti;
+    if (term == "" || !terminfo_parse(terminfo_file(term), &ti)) return false;
+    ti.nums.resize(TI_MAX_COLORS + 1, -1);
+    ti.strs.resize(TI_USER7 + 1);
+    for (usize i = 0; i < ti.strs.size(); i++) ti.strs[i] = terminfo_unpad(ti.strs[i]);
+    if (ti.nums[TI_MAX_COLORS] > 0) TC.colors = ti.nums[TI_MAX_COLORS];
+    // Terminals that set COLORTERM do 24-bit color whatever TERM
+    // says; many run with TERM=xterm.
+    const char* colorterm = getenv("COLORTERM");
+    if ((colorterm && *colorterm) || ti.ext.count("RGB") || ti.ext.count("Tc")) TC.colors = std::max(TC.colors, 256);
+    if (ti.strs[TI_CLR_EOL] != "") TC.el = ti.strs[TI_CLR_EOL];
+    // No alternate screen is a valid answer.
+    TC.smcup = ti.strs[TI_ENTER_CA_MODE];
+    TC.rmcup = ti.strs[TI_EXIT_CA_MODE];
+    if (ti.strs[TI_USER7] != "") TC.cpr = ti.strs[TI_USER7];
+    TC.rep = ti.strs[TI_REPEAT_CHAR] != "";
+    TC.cuf = ti.strs[TI_PARM_RIGHT_CURSOR] != "";
+    TC.sync = ti.ext.count("Sync") != 0;
+    return true;
+}
+
+std::string term_cache_path() {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/hed/terminal/" + TC.key;
+    const char* home = getenv("HOME");
+    if (home && *home) return std::string(home) + "/.cache/hed/terminal/" + TC.key;
+    return "";
+}
+
+// Sequences are cached written out, with ESC as \E.
+std::string term_escape(const std::string& s) {
+    std::string out;
+    for (usize i = 0; i < s.size(); i++) {
+        if (s[i] == '\x1b') out += "\\E";
+        else if (s[i] == '\\') out += "\\\\";
+        else if ((u8)s[i] < 32) out += fmt::format("\\x{:02x}", (u8)s[i]);
+        else out += s[i];
     }
+    return out;
 }
 
-std::string rows_to_string() {
-    std::string res;
-    for (int i = 0; i < E.numrows(); i++) {
-        res.append(E.get_row_at(i)->data);
-        res.append("\n");
+std::string term_unescape(const std::string& s) {
+    std::string out;
+    for (usize i = 0; i < s.size(); i++) {
+        if (s[i] != '\\' || i+1 == s.size()) {
+            out += s[i];
+        } else if (s[i+1] == 'E') {
+            out += '\x1b';
+            i++;
+        } else if (s[i+1] == 'x' && i+3 < s.size()) {
+            out += (char)strtol(s.substr(i+2, 2).c_str(), NULL, 16);
+            i += 3;
+        } else {
+            out += s[++i];
+        }
     }
-    return res;
+    return out;
 }
 
-void _find_synhlt_with_ext() {
-    E.syn = NULL;
-    if (E.path == "") return;
-    usize idx = E.path.find('.');
-    if (idx == std::string::npos) return;
-    std::string ext = E.path.substr(idx+1);
-    if (ext == "") return;
+void mkdir_parents(const std::string& path);
+
+void term_cache_save() {
+    std::string path = term_cache_path();
+    if (path == "") return;
+    mkdir_parents(path);
+    std::ofstream f(path);
+    f << "colors " << TC.colors << '\n';
+    f << "rep " << TC.rep << '\n';
+    f << "cuf " << TC.cuf << '\n';
+    f << "sync " << TC.sync << '\n';
+    f << "smcup " << term_escape(TC.smcup) << '\n';
+    f << "rmcup " << term_escape(TC.rmcup) << '\n';
+    f << "el " << term_escape(TC.el) << '\n';
+    f << "cpr " << term_escape(TC.cpr) << '\n';
+    f << "version " << term_escape(TC.version) << '\n';
+}
 
-    for (usize i = 0; i < NUM_HLDBS; i++) {
-        EditorSyntax* s = &HLDB[i];
-        int e = 0;
-        std::string need = s->extmatch[e];
-        while (need != "") {
-            if (need == ext) {
-                E.syn = s;
-                return;
-            }
-            e++;
-            need = s->extmatch[e];
-        }
+bool term_cache_load() {
+    std::string path = term_cache_path();
+    std::ifstream f(path);
+    if (path == "" || !f) return false;
+    std::string line;
+    while (std::getline(f, line)) {
+        usize sp = line.find(' ');
+        if (sp == std::string::npos) continue;
+        std::string name = line.substr(0, sp), value = term_unescape(line.substr(sp+1));
+        if (name == "colors") TC.colors = atoi(value.c_str());
+        else if (name == "rep") TC.rep = value == "1";
+        else if (name == "cuf") TC.cuf = value == "1";
+        else if (name == "sync") TC.sync = value == "1";
+        else if (name == "smcup") TC.smcup = value;
+        else if (name == "rmcup") TC.rmcup = value;
+        else if (name == "el") TC.el = value;
+        else if (name == "cpr") TC.cpr = value;
+        else if (name == "version") TC.version = value;
     }
+    return true;
 }
 
-void update_synhlt_from_ext() {
-    _find_synhlt_with_ext();
-    for (int r = 0; r < E.numrows(); r++) {
-        update_row_syntax(E.get_row_at(r));
+// Called before the terminal is set up.
+void term_load() {
+    TC = TERM_DEFAULTS;
+    const char* term = getenv("TERM");
+    const char* program = getenv("TERM_PROGRAM");
+    TC.key = term && *term ? term : "unknown";
+    if (program && *program) TC.key += std::string("@") + program;
+    // Keep the key usable as a file name.
+    for (usize i = 0; i < TC.key.size(); i++) {
+        if (TC.key[i] == '/') TC.key[i] = '_';
     }
+    TC.from_cache = term_cache_load();
+    if (!TC.from_cache && term) terminfo_load(term);
 }
 
-void scroll_to(int x, int y) {
-    if (y < E.rowoff) {
-        E.rowoff = y;
+void term_query_done() {
+    if (!TC.querying) return;
+    TC.querying = false;
+    ev_cancel_timer(term_query_done);
+    term_cache_save();
+    E.redraw = true;
+}
+
+void term_query() {
+    if (TC.key == "" || TC.from_cache) return;
+    const char* q = "\x1b[>0q\x1b[?2026$p\x1b[c";
+    // Not inside a frame still being written.
+    out_finish();
+    if (write(STDOUT_FILENO, q, strlen(q)) != (ssize_t)strlen(q)) return;
+    TC.querying = true;
+    ev_set_timer(term_query_done, TERM_QUERY_TIMEOUT_MS);
+}
+
+// Length of the reply to one of our queries at the start of `p`, 0
+// if there is none. Replies are recognized even after the timeout,
+// so a late one is never taken for keys.
+int term_reply(const char* p, int n) {
+    if (n >= 4 && !memcmp(p, "\x1bP>|", 4)) {
+        // XTVERSION: DCS > | text ST
+        for (int i = 4; i+1 < n; i++) {
+            if (p[i] == '\x1b' && p[i+1] == '\\') {
+                if (TC.version == "") TC.version = std::string(p+4, i-4);
+                return i+2;
+            }
+        }
+        return 0;
     }
-    if (y >= E.rowoff + (E.screenrows-5)) {
-        E.rowoff = y - (E.screenrows-5) + 1;
+    if (n < 4 || memcmp(p, "\x1b[?", 3) != 0) return 0;
+    int i = 3;
+    while (i < n && (isdigit(p[i]) || p[i] == ';' || p[i] == '$')) i++;
+    if (i == n) return 0;
+    std::string params(p+3, i-3);
+    if (p[i] == 'c') {
+        // DA1, sent last, so every other reply is in.
+        term_query_done();
+        return i+1;
     }
-    if (x < E.coloff) {
-        E.coloff = x;
+    if (p[i] == 'y' && str_startswith(params, "2026;")) {
+        // DECRQM: 1 or 2 if the mode is known and can be changed.
+        int mode = atoi(params.c_str() + 5);
+        if (mode == 1 || mode == 2) TC.sync = true;
+        return i+1;
     }
-    if (x >= E.coloff + (E.screencols-5)) {
-        E.coloff = x - (E.screencols-5) + 1;
+    return 0;
+}
+
+// Takes the replies to terminal queries out of `buf`, returning
+// what is left.
+int term_take_replies(char* buf, int n) {
+    int out = 0;
+    for (int i = 0; i < n;) {
+        int len = buf[i] == '\x1b' ? term_reply(buf + i, n - i) : 0;
+        if (len) {
+            i += len;
+        } else {
+            buf[out++] = buf[i++];
+        }
     }
+    return out;
 }
 
-void scroll_cmdline() {
-    if (E.cmdx < E.cmdoff) {
-        E.cmdoff = E.cmdx;
+// `c` `n` times, with REP where that is shorter.
+void ewrite_repeat(char c, int n) {
+    if (n <= 0) return;
+    if (TC.rep && n >= TERM_MIN_RUN) {
+        E.abuf += c;
+        E.abuf += fmt::format("\x1b[{}b", n-1);
+    } else {
+        E.abuf.append(n, c);
     }
-    if (E.cmdx >= E.cmdoff + (E.screencols-1)) {
-        E.cmdoff = E.cmdx - (E.screencols-1) + 1;
+}
+
+// A color of the 256-color palette as SGR parameters, the nearest
+// of the 8 (or 16) basic colors on terminals without it.
+std::string sgr_color(int color, bool bg) {
+    if (TC.colors >= 256) return fmt::format("{};5;{}", bg ? 48 : 38, color);
+    int r, g, b;
+    if (color < 16) {
+        return fmt::format("{}", (bg ? 40 : 30) + color % 8 + (color >= 8 && TC.colors >= 16 ? 60 : 0));
+    } else if (color < 232) {
+        int c = color - 16;
+        int levels[] = { 0, 95, 135, 175, 215, 255 };
+        r = levels[c / 36], g = levels[c / 6 % 6], b = levels[c % 6];
+    } else {
+        r = g = b = 8 + (color - 232) * 10;
+    }
+    int basic[16][3] = {
+        { 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 },
+        { 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+        { 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 },
+        { 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 },
+    };
+    int best = 0, best_d = INT_MAX;
+    for (int i = 0; i < (TC.colors >= 16 ? 16 : 8); i++) {
+        int dr = r - basic[i][0], dg = g - basic[i][1], db = b - basic[i][2];
+        int d = dr*dr + dg*dg + db*db;
+        if (d < best_d) {
+            best = i;
+            best_d = d;
+        }
     }
+    return fmt::format("{}", (bg ? 40 : 30) + best % 8 + (best >= 8 ? 60 : 0));
 }
 
-void push_undoinfo(EditorAction type, std::string data) {
-    while (E.undo_pos != E.numundos()-1) E.undos.pop_back();
+// ============= MEMORY ==============
+
+// Live bytes and allocations by subsystem, shown by `mem` and, with
+// the `memreport` option, on exit. What is allocated per row, line or
+// marker is counted as it comes and goes; the few large containers
+// are measured when a report is made. Sizes are of the contents, not
+// of what the allocator rounds them up to.
+
+enum MemCategory {
+    MEM_ROWS,
+    MEM_TEXT,
+    MEM_RENDER,
+    MEM_HIGHLIGHT,
+    MEM_COLD,
+    MEM_MARKERS,
+    MEM_CLIPBOARD,
+    // Measured.
+    MEM_INDEX,
+    MEM_TABLES,
+    MEM_UNDO,
+    MEM_DECORATIONS,
+    MEM_FRAME,
+    MEM_BUILD,
+    MEM_HISTORY,
+    NUM_MEM_CATEGORIES,
+};
+
+const char* MEM_NAMES[NUM_MEM_CATEGORIES] = {
+    "rows",
+    "row text",
+    "rendered text",
+    "highlighting",
+    "compressed rows",
+    "markers",
+    "clipboard",
+    "row index",
+    "cache tables",
+    "undo",
+    "decorations",
+    "frame buffer",
+    "build output",
+    "history",
+};
+
+struct MemCounter {
+    i64 bytes;
+    i64 allocs;
+};
+
+MemCounter MEM[NUM_MEM_CATEGORIES];
 
-    E.undos.push_back({
-        .type = type,
-        .data = data,
-        .x = E.cx,
-        .y = E.cy,
-    });
-    E.undo_pos = E.numundos()-1;
+void mem_alloc(MemCategory c, usize bytes) {
+    MEM[c].bytes += bytes;
+    MEM[c].allocs++;
 }
 
-const char* WHITESPACE = " \t\n\r\f\v";
+void mem_free(MemCategory c, usize bytes) {
+    MEM[c].bytes -= bytes;
+    MEM[c].allocs--;
+}
 
-void str_trim_leading_ws(std::string& s) {
-    s.erase(0, s.find_first_not_of(WHITESPACE));
+void mem_set(MemCategory c, usize bytes, usize allocs) {
+    MEM[c].bytes = bytes;
+    MEM[c].allocs = allocs;
 }
 
-void str_trim_trailing_ws(std::string& s) {
-    s.erase(s.find_last_not_of(WHITESPACE)+1);
+// Moves `*counted`, the size of a buffer as last counted, to `now`.
+// An empty buffer is not an allocation.
+void mem_track(MemCategory c, usize* counted, usize now) {
+    MEM[c].bytes += (i64)now - (i64)*counted;
+    if (!*counted && now) MEM[c].allocs++;
+    if (*counted && !now) MEM[c].allocs--;
+    *counted = now;
 }
 
-void file_trim_trailing_ws() {
-    for (int i = 0; i < E.numrows(); i++) {
-        str_trim_trailing_ws(E.get_row_at(i)->data);
-    }
+// Bytes of an unordered_map's nodes and buckets.
+template <typename K, typename V>
+usize mem_of_map(const std::unordered_map<K, V>& m) {
+    return m.size() * (sizeof(std::pair<K, V>) + 2*sizeof(void*)) + m.bucket_count() * sizeof(void*);
 }
 
-void set_path(const std::string& path) {
-    E.path = path;
-    update_synhlt_from_ext();
+usize mem_of_lines(const std::vector<std::string>& lines) {
+    usize n = lines.capacity() * sizeof(std::string);
+    for (usize i = 0; i < lines.size(); i++) n += lines[i].size();
+    return n;
 }
 
-void open_file(const std::string& path) {
-    std::ifstream f(path);
-    std::string line;
+template <typename T>
+usize mem_of_vector(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
 
-    if (!f) core::error_exit_with_msg("file not found");
-    while (std::getline(f, line)) {
-        insert_row(E.numrows(), line);
-    }
-    set_path(path);
-    E.dirty = false;
+struct HlCache;
+extern HlCache HLC;
+usize hl_cache_table_bytes();
+
+void mem_measure() {
+    mem_set(MEM_INDEX, mem_of_vector(E.rows) + mem_of_vector(E.modified_rows), 2);
+    mem_set(MEM_TABLES, hl_cache_table_bytes() + mem_of_map(E.interned), 3);
+
+    // `undo_bytes` counts every node but the root, with the rows
+    // kept by whole-range changes; add the root and the spare
+    // capacity.
+    usize undo = E.undo_bytes + (E.undo_nodes.capacity() - E.undo_nodes.size() + 1)*sizeof(UndoNode);
+    mem_set(MEM_UNDO, undo, E.undo_nodes.size());
+
+    usize decos = mem_of_vector(E.decos.items);
+    for (int k = 0; k < NUM_DECO_KINDS; k++) decos += mem_of_vector(E.decos.by_kind[k]);
+    mem_set(MEM_DECORATIONS, decos, E.decos.items.size());
+
+    // Kept at their largest between frames.
+    mem_set(MEM_FRAME, E.abuf.capacity() + OUT.frame.capacity(), 2);
+    mem_set(MEM_BUILD, mem_of_lines(E.build.lines) + E.build.partial.size() +
+        mem_of_vector(E.build.qf), E.build.lines.size());
+    mem_set(MEM_HISTORY, mem_of_lines(E.cmd_history.entries) + mem_of_lines(E.search_history.entries),
+        E.cmd_history.entries.size() + E.search_history.entries.size());
 }
 
-void search_text_forward(const std::string& query, bool set_cursor_on_match) {
-    if (query == "") {
-        E.reset_hlt();
-        return;
-    }
-    bool found = false;
+std::string mem_size(i64 bytes) {
+    if (bytes >= 1 << 20) return fmt::format("{:.1f} MB", bytes / (1024.0*1024));
+    if (bytes >= 1 << 10) return fmt::format("{:.1f} KB", bytes / 1024.0);
+    return fmt::format("{} B", bytes);
+}
 
-    for (int i = E.cy; i < E.numrows(); i++) {
-        EditorRow* row = E.rows[i];
-        usize match = row->rdata.find(query, (i == E.cy) ? E.rx+1 : 0);
-        if (match != std::string::npos) {
-            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
-            E.hltsy = i;
-            E.hltsx = match;
-            E.hltey = i;
-            E.hltex = match + query.size();
-            scroll_to(match + query.size(), i);
-            found = true;
-            break;
-        }
-    }
+void interned_savings(usize* rows, usize* saved);
 
-    if (!found) {
-        set_cmdline_msg_error("search reached EOF");
-        E.reset_hlt();
+std::string mem_report() {
+    mem_measure();
+    std::string out = fmt::format("{:<16} {:>12} {:>12}\n", "category", "bytes", "allocations");
+    i64 bytes = 0, allocs = 0;
+    for (int c = 0; c < NUM_MEM_CATEGORIES; c++) {
+        out += fmt::format("{:<16} {:>12} {:>12}\n", MEM_NAMES[c], MEM[c].bytes, MEM[c].allocs);
+        bytes += MEM[c].bytes;
+        allocs += MEM[c].allocs;
     }
+    out += fmt::format("{:<16} {:>12} {:>12}\n", "total", bytes, allocs);
+    usize rows, saved;
+    interned_savings(&rows, &saved);
+    out += fmt::format("\nshared text: {} rows share {} texts, {} bytes saved\n", rows, E.interned.size(), saved);
+    return out;
 }
 
-void search_text_backward(const std::string& query, bool set_cursor_on_match) {
-    if (query == "") {
-        E.reset_hlt();
-        return;
-    }
-    bool found = false;
+void mem_report_at_exit() {
+    if (E.global_opts.memreport) fputs(mem_report().c_str(), stderr);
+}
 
-    for (int i = E.cy; i >= 0; i--) {
-        // If at beginning of line, then skip current line
-        if (i == E.cy && E.cx == 0) continue;
-        EditorRow* row = E.rows[i];
-        usize match = row->rdata.rfind(query, (i == E.cy) ? E.rx-1 : std::string::npos);
-        if (match != std::string::npos) {
-            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
-            E.hltsy = i;
-            E.hltsx = match;
-            E.hltey = i;
-            E.hltex = match + query.size();
-            scroll_to(match + query.size(), i);
-            found = true;
-            break;
-        }
+// ============= HIGHLIGHT CACHE ==============
+
+// Rows with the same rendered text under the same syntax highlight
+// the same way (the lexer keeps no state across rows), so their
+// highlighting is computed once and shared. Lines are looked up by a
+// hash of the text. A collision only miscolors a row.
+
+// Most lines kept in the cache. Lines still used by rows outlive
+// their eviction.
+const usize HL_CACHE_MAX = 1 << 16;
+
+struct HlLine {
+    u64 key;
+    // Rows using this line, plus one while it is cached.
+    int refs;
+    int len;
+    u8* hl;
+};
+
+struct HlCache {
+    std::unordered_map<u64, HlLine*> lines;
+    // Cached keys, oldest first.
+    std::deque<u64> order;
+    u64 hits, misses, evictions;
+};
+
+HlCache HLC;
+
+u64 hash_bytes(const char* data, usize len);
+
+void hl_line_release(HlLine* line) {
+    if (line && --line->refs == 0) {
+        mem_free(MEM_HIGHLIGHT, sizeof(HlLine) + line->len);
+        free(line);
     }
+}
 
-    if (!found) {
-        set_cmdline_msg_error("search reached BOF");
-        E.reset_hlt();
+usize hl_cache_table_bytes() {
+    return mem_of_map(HLC.lines) + HLC.order.size() * sizeof(u64);
+}
+
+HlLine* hl_line_lookup(const char* rdata, int rlen) {
+    u64 key = hash_bytes(rdata, rlen) ^ ((u64)(uintptr_t)E.syn * 0x9e3779b97f4a7c15ULL);
+    std::unordered_map<u64, HlLine*>::iterator it = HLC.lines.find(key);
+    if (it != HLC.lines.end() && it->second->len == rlen) {
+        HLC.hits++;
+        it->second->refs++;
+        return it->second;
+    }
+    HLC.misses++;
+    HlLine* line = (HlLine*)malloc(sizeof(HlLine) + rlen);
+    mem_alloc(MEM_HIGHLIGHT, sizeof(HlLine) + rlen);
+    line->key = key;
+    line->refs = 1;
+    line->len = rlen;
+    line->hl = (u8*)(line + 1);
+    lex_row_syntax(rdata, rlen, line->hl);
+    if (it != HLC.lines.end()) return line;
+
+    if (HLC.order.size() == HL_CACHE_MAX) {
+        std::unordered_map<u64, HlLine*>::iterator old = HLC.lines.find(HLC.order.front());
+        hl_line_release(old->second);
+        HLC.lines.erase(old);
+        HLC.order.pop_front();
+        HLC.evictions++;
     }
+    HLC.lines[key] = line;
+    HLC.order.push_back(key);
+    line->refs++;
+    return line;
 }
 
-// =========== high level ==============
-void ewrite(const std::string& str) {
-    E.abuf.append(str);
+void update_row_syntax(EditorRow* row) {
+    RowText* t = row_text(row);
+    HlLine* line = hl_line_lookup(t->rdata.data(), t->rlen);
+    hl_line_release(t->hl_line);
+    t->hl_line = line;
+    t->hl = line->hl;
 }
 
-void ewrite_char(char c) {
-    E.abuf += c;
+// ============= MARKERS ==============
+
+// Positions that follow the text as it is edited: the mark, named
+// marks, bookmarks, the jump list and anchors kept by other
+// features. An edit is reported once, as the position range it
+// moves; that range is split off the treap, tagged with a
+// MarkerShift and merged back, so it costs O(log n) however many
+// markers it moves. Inserting text exactly at a marker leaves the
+// marker before it.
+
+u32 hash_tree_prio();
+
+MarkerShift shift_by(int dy, int dx) {
+    MarkerShift s = { false, 0, 0, dy, dx };
+    return s;
 }
 
-void ewrite_cstr_with_len(const char* str, usize len) {
-    E.abuf.append(str, len);
+MarkerShift shift_to(int y, int x) {
+    MarkerShift s = { true, y, x, 0, 0 };
+    return s;
 }
 
-void ewrite_with_len(const std::string& str, usize len) {
-    E.abuf.append(str, 0, len);
+bool pos_before(int y1, int x1, int y2, int x2) {
+    return y1 < y2 || (y1 == y2 && x1 < x2);
 }
 
-void insert_empty_row_if_file_empty() {
-    if (E.numrows() == 0) {
-        insert_row(E.numrows(), "");
+void marker_apply(Marker* t, const MarkerShift& s) {
+    if (!t) return;
+    if (s.set) {
+        t->y = s.y;
+        t->x = s.x;
+        t->lazy = s;
+    } else {
+        t->lazy.dy += s.dy;
+        t->lazy.dx += s.dx;
     }
+    t->y += s.dy;
+    t->x += s.dx;
 }
 
-void delete_empty_row_if_file_empty() {
-    EditorRow* row = E.get_row_at(E.cy);
-    if (E.numrows() == 1 && row->len() == 0) {
-        delete_row(0);
+void marker_push(Marker* t) {
+    if (!t->lazy.set && t->lazy.dy == 0 && t->lazy.dx == 0) return;
+    marker_apply(t->left, t->lazy);
+    marker_apply(t->right, t->lazy);
+    t->lazy = shift_by(0, 0);
+}
+
+void marker_pull(Marker* t) {
+    t->kinds = t->kind;
+    if (t->left) {
+        t->left->parent = t;
+        t->kinds |= t->left->kinds;
+    }
+    if (t->right) {
+        t->right->parent = t;
+        t->kinds |= t->right->kinds;
     }
 }
 
-void update_cx_when_cy_changed() {
-    if (E.numrows() != 0) {
-        // We calculate E.cx from E.rx and update it
-        // instead of directly updating E.rx
-        // because E.rx is calculated on
-        // every refresh (throwing the prev value away).
-        // So we "choose" a E.cx which
-        // will be converted to the needed E.rx in the
-        // refresh stage.
-        E.cx = row_rx_to_cx(E.get_row_at(E.cy), E.tx > E.rx ? E.tx : E.rx);
+// Splits `t` into the markers before (y, x) and the rest.
+void marker_split(Marker* t, int y, int x, Marker** a, Marker** b) {
+    if (!t) {
+        *a = NULL;
+        *b = NULL;
+        return;
+    }
+    marker_push(t);
+    if (pos_before(t->y, t->x, y, x)) {
+        marker_split(t->right, y, x, &t->right, b);
+        *a = t;
+    } else {
+        marker_split(t->left, y, x, a, &t->left);
+        *b = t;
     }
+    marker_pull(t);
 }
 
-void copy_to_clipboard(const std::string& text) {
-    E.dbglog("[start]");
-    E.dbglog(text);
-    E.dbglog("[end]");
+Marker* marker_merge(Marker* a, Marker* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->prio > b->prio) {
+        marker_push(a);
+        a->right = marker_merge(a->right, b);
+        marker_pull(a);
+        return a;
+    } else {
+        marker_push(b);
+        b->left = marker_merge(a, b->left);
+        marker_pull(b);
+        return b;
+    }
+}
 
-    clipboard_set_text_ex(E.cb, text.c_str(), text.size(), LCB_CLIPBOARD);
+void set_marker_root(Marker* t) {
+    E.markers = t;
+    if (t) t->parent = NULL;
 }
 
-// ============= ACTIONS ==============
+// Applies `s` to the markers from (y0, x0) up to, not including,
+// (y1, x1).
+void shift_markers(int y0, int x0, int y1, int x1, const MarkerShift& s) {
+    if (!E.markers) return;
+    Marker *a, *mid, *b;
+    marker_split(E.markers, y0, x0, &a, &mid);
+    marker_split(mid, y1, x1, &mid, &b);
+    marker_apply(mid, s);
+    set_marker_root(marker_merge(marker_merge(a, mid), b));
+}
 
-void do_cursor_up() {
-    if (E.cy != 0) E.cy--;
-    update_cx_when_cy_changed();
+// Applies the shifts still pending above `m`, so that its position
+// is current.
+void marker_settle(Marker* m) {
+    if (!m->parent) return;
+    marker_settle(m->parent);
+    marker_push(m->parent);
 }
 
-void do_cursor_down() {
-    if (E.cy < E.lastrow_idx()) E.cy++;
-    update_cx_when_cy_changed();
+void marker_link(Marker* m) {
+    m->left = NULL;
+    m->right = NULL;
+    m->parent = NULL;
+    marker_pull(m);
+    Marker *a, *b;
+    marker_split(E.markers, m->y, m->x, &a, &b);
+    set_marker_root(marker_merge(marker_merge(a, m), b));
 }
 
-void do_cursor_left() {
-    if (E.cx != 0) E.set_cpos(E.cx-1, E.cy);
-    else if (E.cy > 0) {
-        E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
+void marker_unlink(Marker* m) {
+    marker_settle(m);
+    marker_push(m);
+    Marker* t = marker_merge(m->left, m->right);
+    Marker* p = m->parent;
+    if (!p) {
+        set_marker_root(t);
+        return;
     }
+    if (p->left == m) p->left = t;
+    else p->right = t;
+    if (t) t->parent = p;
+    for (; p; p = p->parent) marker_pull(p);
 }
 
-void do_cursor_right() {
-    EditorRow* row = E.get_row_at(E.cy);
-    if (E.cx < row->len()) E.set_cpos(E.cx+1, E.cy);
-    else if (E.cy != (E.lastrow_idx()) && E.cx == row->len()) {
-        E.set_cpos(0, E.cy+1);
-    }
+Marker* marker_new(int kind, int x, int y) {
+    Marker* m = new Marker();
+    mem_alloc(MEM_MARKERS, sizeof(Marker));
+    m->prio = hash_tree_prio();
+    m->kind = kind;
+    m->y = y;
+    m->x = x;
+    m->lazy = shift_by(0, 0);
+    marker_link(m);
+    return m;
 }
 
-void do_cursor_line_begin() {
-    E.set_cpos(0, E.cy);
+void marker_free(Marker* m) {
+    marker_unlink(m);
+    mem_free(MEM_MARKERS, sizeof(Marker));
+    delete m;
 }
 
-void do_cursor_line_end() {
-    EditorRow* row = E.get_row_at(E.cy);
-    if (row) E.set_cpos(row->len(), E.cy);
+void marker_move(Marker* m, int x, int y) {
+    marker_unlink(m);
+    m->y = y;
+    m->x = x;
+    marker_link(m);
 }
 
-void change_mode(EditorMode mode) {
-    E.mode = mode;
-    E.cmdline = "";
-    E.cmdline_style = NONE;
-    E.cmdx = 0;
-    E.cmdoff = 0;
+// Position of `m`, clamped to the buffer: rows rewritten in place,
+// as by `replace_rows`, can leave a marker past the end of its row.
+void marker_get(Marker* m, int* x, int* y) {
+    marker_settle(m);
+    *y = m->y;
+    *x = m->x;
+    if (*y > E.lastrow_idx()) *y = E.lastrow_idx();
+    if (*y < 0) *y = 0;
+    EditorRow* row = E.get_row_at(*y);
+    int len = row ? row->len() : 0;
+    if (*x > len) *x = len;
+    if (*x < 0) *x = 0;
 }
 
-void do_change_mode_to_normal() {
-    change_mode(NORMAL);
+// First marker with a bit of `kind` at or after (y, x).
+Marker* marker_find_next(Marker* t, int kind, int y, int x) {
+    if (!t || !(t->kinds & kind)) return NULL;
+    marker_push(t);
+    if (pos_before(t->y, t->x, y, x)) return marker_find_next(t->right, kind, y, x);
+    Marker* m = marker_find_next(t->left, kind, y, x);
+    if (m) return m;
+    if (t->kind & kind) return t;
+    return marker_find_next(t->right, kind, y, x);
 }
 
-void do_change_mode_to_insert() {
-    change_mode(INSERT);
+// Last marker with a bit of `kind` before (y, x).
+Marker* marker_find_prev(Marker* t, int kind, int y, int x) {
+    if (!t || !(t->kinds & kind)) return NULL;
+    marker_push(t);
+    if (!pos_before(t->y, t->x, y, x)) return marker_find_prev(t->left, kind, y, x);
+    Marker* m = marker_find_prev(t->right, kind, y, x);
+    if (m) return m;
+    if (t->kind & kind) return t;
+    return marker_find_prev(t->left, kind, y, x);
 }
 
-void do_change_mode_to_command() {
-    change_mode(COMMAND);
+void marker_free_tree(Marker* t) {
+    if (!t) return;
+    marker_free_tree(t->left);
+    marker_free_tree(t->right);
+    mem_free(MEM_MARKERS, sizeof(Marker));
+    delete t;
 }
 
-void do_change_mode_to_search() {
-    change_mode(SEARCH);
+// Edits, reported by the row primitives before the rows change.
+
+void markers_insert_cols(int y, int x, int n) {
+    shift_markers(y, x+1, y+1, 0, shift_by(0, n));
 }
 
-void do_set_mark() {
-    E.mx = E.cx;
-    E.my = E.cy;
+void markers_delete_cols(int y, int x, int n) {
+    shift_markers(y, x, y, x+n, shift_to(y, x));
+    shift_markers(y, x+n, y+1, 0, shift_by(0, -n));
 }
 
-void do_cut_cursor_mark_region(bool hist) {
-    int startx, starty, endx, endy;
-    if (E.my < E.cy) {
-        starty = E.my;
-        endy = E.cy;
-        startx = E.mx;
-        endx = E.cx;
-    } else if (E.cy < E.my) {
-        starty = E.cy;
-        endy = E.my;
-        startx = E.cx;
-        endx = E.mx;
-    } else {
-        starty = E.cy;
-        endy = E.cy;
-        if (E.cx < E.mx) {
-            startx = E.cx;
-            endx = E.mx;
-        } else if (E.mx < E.cx) {
-            startx = E.mx;
-            endx = E.cx;
-        } else return;
-    }
-
-    std::string copy;
-    if (startx == 0 && starty == 0 && endy == E.lastrow_idx() && endx == E.get_row_at(E.lastrow_idx())->len()) {
-        int numrows = E.numrows();
-        for (int i = 0; i < numrows; i++) {
-            if (i != 0) copy += '\n';
-            copy += delete_row(0);
-        }
-    } else if (starty == endy) {
-        copy += row_delete_range(E.get_row_at(starty), startx, endx-startx);
-    } else {
-        EditorRow* startrow = E.get_row_at(starty);
-        EditorRow* endrow = E.get_row_at(endy);
-        bool startrow_deleted = false;
+void markers_insert_rows(int y, int n) {
+    // Nothing can be anchored past the last row.
+    if (y >= E.numrows()) return;
+    shift_markers(y, 0, INT_MAX, 0, shift_by(n, 0));
+}
 
-        if (startx == 0) {
-            copy += delete_row(starty);
-            startrow_deleted = true;
-        } else {
-            copy += row_delete_range(startrow, startx, startrow->len()-startx);
-        }
+void markers_delete_rows(int y, int n) {
+    shift_markers(y, 0, y+n, 0, shift_to(y, 0));
+    shift_markers(y+n, 0, INT_MAX, 0, shift_by(-n, 0));
+}
 
-        for (int i = starty+1; i < endy; i++) {
-            copy += '\n';
-            copy += delete_row(startrow_deleted ? starty : starty+1);
-        }
+// Named mark that regions run to from the cursor.
+const char REGION_MARK = 'm';
 
-        copy += '\n';
-        if (startrow_deleted) {
-            copy += row_delete_range(endrow, 0, endx);
-        } else {
-            row_append_string(
-                startrow,
-                row_delete_range(endrow, endx, endrow->len()-endx));
-            copy += delete_row(starty+1);
-        }
-    }
+bool valid_mark_name(char c) {
+    return c >= 'a' && c <= 'z';
+}
 
-    E.set_cpos(startx, starty);
-    copy_to_clipboard(copy);
-    if (hist) push_undoinfo(CUT_CURSOR_MARK_REGION, copy);
+void set_named_mark(char c, int x, int y) {
+    Marker*& m = E.marks[c - 'a'];
+    if (m) marker_move(m, x, y);
+    else m = marker_new(MARKER_MARK, x, y);
 }
 
-void do_cursor_forward_word() {
-    while (!isalpha(E.get_char_at_cpos()) && !E.is_cpos_at_end())
-        do_cursor_right();
-    if (!E.is_cpos_at_end()) {
-        while (isalpha(E.get_char_at_cpos())) do_cursor_right();
-    }
+// False if mark `c` was never set in this file.
+bool get_named_mark(char c, int* x, int* y) {
+    Marker* m = E.marks[c - 'a'];
+    if (!m) return false;
+    marker_get(m, x, y);
+    return true;
 }
 
-void do_cursor_backward_word() {
-    if (E.cx == 0 && E.cy == 0) return;
-    while (!(isalpha(E.get_char_at_lpos()) || E.get_char_at_lpos() == '\0'))
-        do_cursor_left();
-    while (isalpha(E.get_char_at_lpos())) {
-        do_cursor_left();
-    }
+void get_region_mark(int* x, int* y) {
+    get_named_mark(REGION_MARK, x, y);
 }
 
-void do_cursor_first_row() {
-    E.cy = 0;
-    update_cx_when_cy_changed();
+// Drops every marker, as when a file is closed. The region mark
+// starts out at the start of the file.
+void reset_markers() {
+    marker_free_tree(E.markers);
+    E.markers = NULL;
+    E.decos.diag_anchors.clear();
+    for (int i = 0; i < 26; i++) E.marks[i] = NULL;
+    E.jumps.clear();
+    E.jump_pos = 0;
+    set_named_mark(REGION_MARK, 0, 0);
+    E.region_shown = false;
 }
 
-void do_cursor_last_row() {
-    E.cy = E.lastrow_idx();
-    update_cx_when_cy_changed();
+// ============= DECORATIONS ==============
+
+// Search matches, the region, diagnostics and matching brackets are
+// decorations: spans drawn over the syntax highlighting. They are
+// kept per kind and merged into one interval index, so drawing a
+// row asks for the decorations touching it once instead of checking
+// every kind at every character.
+
+EditorRow* row_layout(EditorRow* row);
+bool same_file(const std::string& a, const std::string& b);
+
+bool same_decoration(const Decoration& a, const Decoration& b) {
+    return a.y0 == b.y0 && a.x0 == b.x0 && a.y1 == b.y1 && a.x1 == b.x1;
 }
 
-bool is_row_only_ws(EditorRow* row) {
-    if (row->len() == 0) return true;
-    for (int i = 0; i < row->len(); i++) {
-        char c = row->data[i];
-        if (c != '\t' && c != ' ') {
-            return false;
-        }
+// Replaces the decorations of `kind`. The index is only rebuilt if
+// they changed, so sources recomputed every frame stay cheap.
+void set_decorations(DecorationKind kind, const std::vector<Decoration>& ds) {
+    std::vector<Decoration>& cur = E.decos.by_kind[kind];
+    if (cur.size() == ds.size()) {
+        usize i = 0;
+        while (i < ds.size() && same_decoration(cur[i], ds[i])) i++;
+        if (i == ds.size()) return;
     }
-    return true;
+    cur = ds;
+    E.decos.stale = true;
 }
 
-void do_cursor_next_para() {
-    if (E.cy == E.lastrow_idx()) return;
-    E.cy++;
+void clear_decorations(DecorationKind kind) {
+    set_decorations(kind, std::vector<Decoration>());
+}
 
-    while (E.cy != E.lastrow_idx() && is_row_only_ws(E.get_row_at(E.cy))) {
-        E.cy++;
-    }
+void add_decoration(std::vector<Decoration>* ds, DecorationKind kind, int y0, int x0, int y1, int x1) {
+    Decoration d = { y0, x0, y1, x1, kind };
+    ds->push_back(d);
+}
 
-    while (E.cy != E.lastrow_idx() && !is_row_only_ws(E.get_row_at(E.cy))) {
-        E.cy++;
-    }
-    update_cx_when_cy_changed();
+void reset_decorations() {
+    for (int k = 0; k < NUM_DECO_KINDS; k++) E.decos.by_kind[k].clear();
+    E.decos.stale = true;
+    E.decos.diag_stale = true;
 }
 
-void do_cursor_prev_para() {
-    if (E.cy == 0) return;
-    E.cy--;
+bool deco_before(const Decoration& a, const Decoration& b) {
+    return a.y0 < b.y0;
+}
 
-    while (E.cy != 0 && is_row_only_ws(E.get_row_at(E.cy))) {
-        E.cy--;
-    }
+int build_deco_index(int lo, int hi) {
+    if (lo >= hi) return -1;
+    int mid = (lo + hi) / 2;
+    int m = E.decos.items[mid].y1;
+    m = std::max(m, build_deco_index(lo, mid));
+    m = std::max(m, build_deco_index(mid+1, hi));
+    E.decos.max_y1[mid] = m;
+    return m;
+}
 
-    while (E.cy != 0 && !is_row_only_ws(E.get_row_at(E.cy))) {
-        E.cy--;
+void collect_decorations(int lo, int hi, int y, std::vector<Decoration>* out) {
+    if (lo >= hi) return;
+    int mid = (lo + hi) / 2;
+    const Decoration& d = E.decos.items[mid];
+    if (E.decos.max_y1[mid] < y) return;
+    collect_decorations(lo, mid, y, out);
+    // Everything from here on starts after `y`.
+    if (d.y0 > y) return;
+    if (d.y1 >= y) out->push_back(d);
+    collect_decorations(mid+1, hi, y, out);
+}
+
+// Appends the decorations touching row `y` to `out`.
+void decorations_on_row(int y, std::vector<Decoration>* out) {
+    DecorationIndex& di = E.decos;
+    if (di.stale) {
+        di.items.clear();
+        for (int k = 0; k < NUM_DECO_KINDS; k++) {
+            di.items.insert(di.items.end(), di.by_kind[k].begin(), di.by_kind[k].end());
+        }
+        std::stable_sort(di.items.begin(), di.items.end(), deco_before);
+        di.max_y1.assign(di.items.size(), 0);
+        build_deco_index(0, di.items.size());
+        di.stale = false;
     }
-    update_cx_when_cy_changed();
+    collect_decorations(0, di.items.size(), y, out);
 }
 
-void do_insert_char(bool hist, int c);
+void set_search_match(int y, int rx0, int rx1) {
+    EditorRow* row = E.rows[y];
+    std::vector<Decoration> ds;
+    add_decoration(&ds, DECO_SEARCH, y, row_rx_to_cx(row, rx0), y, row_rx_to_cx(row, rx1));
+    set_decorations(DECO_SEARCH, ds);
+}
 
-void do_insert_indent(bool hist) {
-    if (E.indent_as_spaces) {
-        int spaces = ((TAB_STOP-1) - (E.rx%TAB_STOP)) + 1;
-        for (int i = 0; i < spaces; i++) do_insert_char(hist, ' ');
+void clear_search_match() {
+    clear_decorations(DECO_SEARCH);
+}
+
+void update_region_decoration() {
+    std::vector<Decoration> ds;
+    if (E.region_shown && E.region_gen == E.edit_gen) {
+        int mx, my;
+        get_region_mark(&mx, &my);
+        if (my < E.cy || (my == E.cy && mx < E.cx)) add_decoration(&ds, DECO_REGION, my, mx, E.cy, E.cx);
+        else add_decoration(&ds, DECO_REGION, E.cy, E.cx, my, mx);
     } else {
-        do_insert_char(hist, '\t');
+        E.region_shown = false;
     }
+    set_decorations(DECO_REGION, ds);
 }
 
-void autoindent_just_after_newline(bool hist) {
-    if (E.cx != 0) return;
-    int target_indent = 0;
-    bool found_indent = false;
-
-    int cy = E.cy-1;
-    for (int i = cy; i >= 0; i--) {
-        EditorRow* row = E.get_row_at(i);
-        if (row->len() == 0) continue;
-        int cx = row->len();
-
-        for (; cx >= 0; cx--) {
-            if (row->data[cx] != '\t' && row->data[cx] != ' ') {
-                target_indent = row_get_indent_col(row);
-                found_indent = true;
-                break;
+// Underlines the start of each diagnostic of the build in this file:
+// the word at its column, or the whole row if it has no column. The
+// spans are anchored when the build reports them and then follow the
+// text; one whose text was deleted is no longer shown.
+void update_diagnostic_decorations() {
+    DecorationIndex& di = E.decos;
+    if (di.diag_stale || di.diag_path != E.path) {
+        di.diag_stale = false;
+        di.diag_path = E.path;
+        for (usize i = 0; i < di.diag_anchors.size(); i++) marker_free(di.diag_anchors[i]);
+        di.diag_anchors.clear();
+        for (usize i = 0; i < E.build.qf.size() && E.path != ""; i++) {
+            const QuickfixEntry& qf = E.build.qf[i];
+            int y = qf.line - 1;
+            if (y < 0 || y >= E.numrows() || !same_file(qf.path, E.path)) continue;
+            const std::string& data = row_text(E.rows[y])->data;
+            int x0 = 0, x1 = data.size();
+            if (qf.col > 0 && qf.col-1 < (int)data.size()) {
+                x0 = x1 = qf.col - 1;
+                while (x1 < (int)data.size() && !is_char_separator(data[x1])) x1++;
+                if (x1 == x0) x1++;
             }
+            di.diag_anchors.push_back(marker_new(MARKER_ANCHOR, x0, y));
+            di.diag_anchors.push_back(marker_new(MARKER_ANCHOR, x1, y));
         }
-
-        if (found_indent) break;
     }
+    std::vector<Decoration> ds;
+    for (usize i = 0; i+1 < di.diag_anchors.size(); i += 2) {
+        int x0, y0, x1, y1;
+        marker_get(di.diag_anchors[i], &x0, &y0);
+        marker_get(di.diag_anchors[i+1], &x1, &y1);
+        if (pos_before(y0, x0, y1, x1)) add_decoration(&ds, DECO_DIAGNOSTIC, y0, x0, y1, x1);
+    }
+    set_decorations(DECO_DIAGNOSTIC, ds);
+}
 
-    if (found_indent) {
-        int ts_multiple = target_indent / TAB_STOP;
-        int ts_leftover = target_indent % TAB_STOP;
-
-        for (int i = 0; i < ts_multiple; i++) {
-            if (E.indent_as_spaces) {
-                for (int i = 0; i < TAB_STOP; i++) {
-                    do_insert_char(false, ' ');
+// Shows the bracket under the cursor and its match, if the match is
+// on screen. Brackets in strings and comments are skipped.
+void update_bracket_decorations() {
+    std::vector<Decoration> ds;
+    const char* open = "([{";
+    const char* close = ")]}";
+    EditorRow* row = E.get_row_at(E.cy);
+    char c = row && E.cx < row->len() ? row_text(row)->data[E.cx] : '\0';
+    const char* o = c ? strchr(open, c) : NULL;
+    const char* cl = c ? strchr(close, c) : NULL;
+    if (row && (o || cl)) {
+        row_layout(row);
+        int rx = row_cx_to_rx(row, E.cx);
+        bool quoted = row_text(row)->hl[rx] == HL_STRING || row_text(row)->hl[rx] == HL_COMMENT;
+        char want = o ? close[o - open] : open[cl - close];
+        int dir = o ? 1 : -1;
+        int depth = 0;
+        int last = std::min(E.rowoff + E.textrows(), E.numrows()) - 1;
+        for (int y = E.cy; !quoted && y >= E.rowoff && y <= last; y += dir) {
+            EditorRow* r = row_layout(E.rows[y]);
+            int i = y == E.cy ? rx : (dir > 0 ? 0 : row_text(r)->rlen - 1);
+            for (; i >= 0 && i < row_text(r)->rlen; i += dir) {
+                if (row_text(r)->hl[i] == HL_STRING || row_text(r)->hl[i] == HL_COMMENT) continue;
+                if (row_text(r)->rdata[i] == c) depth++;
+                else if (row_text(r)->rdata[i] == want && --depth == 0) {
+                    int x = row_rx_to_cx(r, i);
+                    add_decoration(&ds, DECO_BRACKET, E.cy, E.cx, E.cy, E.cx+1);
+                    add_decoration(&ds, DECO_BRACKET, y, x, y, x+1);
+                    break;
                 }
-            } else {
-                do_insert_char(false, '\t');
             }
-        }
-
-        for (int i = 0; i < ts_leftover; i++) {
-            do_insert_char(false, ' ');
-        }
-
-        if (target_indent != 0 && hist) {
-            push_undoinfo(AUTOINDENT_JUST_AFTER_NEWLINE, "");
+            if (!ds.empty()) break;
         }
     }
+    set_decorations(DECO_BRACKET, ds);
 }
 
-void do_insert_newline(bool hist, bool autoindent) {
-    if (hist) push_undoinfo(INSERT_NEWLINE, std::string(1, '\n'));
-    insert_empty_row_if_file_empty();
-
-    if (E.cx == 0) {
-        insert_row(E.cy, "");
-    } else {
-        EditorRow* row = E.get_row_at(E.cy);
-        insert_row(E.cy+1, row->data.substr(E.cx, row->len()-E.cx));
-        row->data = row->data.substr(0, E.cx);
-        update_row(row);
-    }
-    E.set_cpos(0, E.cy+1);
-    if (autoindent) autoindent_just_after_newline(hist);
+// Brings the decorations that follow the cursor and build up to date
+// before a frame is drawn.
+void update_decorations() {
+    update_region_decoration();
+    update_diagnostic_decorations();
+    update_bracket_decorations();
 }
 
-void do_insert_char(bool hist, int c) {
-    if (hist) push_undoinfo(INSERT_CHAR, std::string(1, c));
-    if (c == '\n') {
-        // We do not autoindent because this code
-        // can be called by other functions such
-        // as the paste code.
-        do_insert_newline(hist, false);
-        return;
-    }
+// ============= ROW TEXT ==============
 
-    insert_empty_row_if_file_empty();
+// With `intern` set, rows read or inserted get their text from
+// `E.interned`, so a line repeated a million times in a log is
+// stored and rendered once. Edits go through `row_text_mut`, which
+// gives the row a private copy first.
 
-    row_insert_char(E.get_row_at(E.cy), E.cx, c);
-    E.set_cpos(E.cx+1, E.cy);
+void text_account(RowText* t) {
+    mem_track(MEM_TEXT, &t->data_bytes, t->data.size());
+    mem_track(MEM_RENDER, &t->rdata_bytes, t->rdata.size());
 }
 
-void do_delete_left_char(bool hist) {
-    if (E.cx == 0 && E.cy == 0) return;
-    EditorRow* row = E.get_row_at(E.cy);
+void cold_load(ColdBlock* b);
+void cold_detach(RowText* t);
 
-    if (E.cx > 0) {
-        char c = row->data[E.cx-1];
-        row_delete_range(row, E.cx-1, 1);
-        E.set_cpos(E.cx-1, E.cy);
-        if (hist) push_undoinfo(DELETE_LEFT_CHAR, std::string(1, c));
-    } else {
-        E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
-        if (hist) push_undoinfo(DELETE_LEFT_CHAR, std::string(1, '\n'));
-        row_append_string(E.get_row_at(E.cy), row->data);
-        delete_row(E.cy+1);
+// `t`, with its data brought back if it was compressed.
+RowText* text_resident(RowText* t) {
+    if (t->block) {
+        if (!t->block->resident) cold_load(t->block);
+        t->block->last_use = ++E.cold.clock;
     }
+    return t;
+}
 
-    delete_empty_row_if_file_empty();
+// The text of `row`. Everything reading a row's text goes through
+// this, as the text may be compressed.
+RowText* row_text(EditorRow* row) {
+    return text_resident(row->text);
 }
 
-void do_delete_current_char(bool hist) {
-    EditorRow* row = E.get_row_at(E.cy);
-    if (!row) return;
+RowText* row_text_new(const char* data, usize len) {
+    RowText* t = new RowText();
+    t->refs = 1;
+    t->interned = false;
+    t->hash = 0;
+    t->data.assign(data, len);
+    t->rlen = 0;
+    t->hl = NULL;
+    t->hl_line = NULL;
+    t->layout_gen = 0;
+    t->indent = -1;
+    t->block = NULL;
+    t->block_idx = 0;
+    t->data_bytes = 0;
+    t->rdata_bytes = 0;
+    mem_alloc(MEM_ROWS, sizeof(RowText));
+    text_account(t);
+    return t;
+}
 
-    if (E.cx == row->len()) {
-        if (E.cy < E.lastrow_idx()) {
-            if (hist) push_undoinfo(DELETE_CURRENT_CHAR, std::string(1, '\n'));
-            row_append_string(row, E.get_row_at(E.cy+1)->data);
-            delete_row(E.cy+1);
+// Text for a new row holding `data`, shared with identical rows if
+// interning is on.
+RowText* row_text_get(const char* data, usize len) {
+    if (!E.global_opts.intern) return row_text_new(data, len);
+    u64 hash = hash_bytes(data, len);
+    std::unordered_map<u64, RowText*>::iterator it = E.interned.find(hash);
+    if (it != E.interned.end()) {
+        RowText* t = text_resident(it->second);
+        if (t->data.size() != len || memcmp(t->data.data(), data, len) != 0) {
+            // Hash collision; keep this one to itself.
+            return row_text_new(data, len);
         }
-    } else {
-        if (hist) push_undoinfo(DELETE_CURRENT_CHAR, std::string(1, row->data[E.cx]));
-        row_delete_range(row, E.cx, 1);
+        t->refs++;
+        return t;
     }
+    RowText* t = row_text_new(data, len);
+    t->interned = true;
+    t->hash = hash;
+    E.interned[hash] = t;
+    return t;
+}
 
-    delete_empty_row_if_file_empty();
+void row_text_release(RowText* t) {
+    if (--t->refs > 0) return;
+    if (t->interned) E.interned.erase(t->hash);
+    cold_detach(t);
+    hl_line_release(t->hl_line);
+    mem_track(MEM_TEXT, &t->data_bytes, 0);
+    mem_track(MEM_RENDER, &t->rdata_bytes, 0);
+    mem_free(MEM_ROWS, sizeof(RowText));
+    delete t;
 }
 
-void do_paste_from_clipboard(bool hist) {
-    const char* text_c = clipboard_text_ex(E.cb, NULL, LCB_CLIPBOARD);
-    if (!text_c) {
-        set_cmdline_msg_error("nothing to paste");
-        return;
+void row_set_text(EditorRow* row, const std::string& data) {
+    RowText* t = row_text_get(data.data(), data.size());
+    if (row->text) row_text_release(row->text);
+    row->text = t;
+}
+
+// The text of `row`, made private to it so that it can be changed.
+// Its rendering is marked stale.
+RowText* row_text_mut(EditorRow* row) {
+    RowText* t = row_text(row);
+    if (t->refs > 1) {
+        t->refs--;
+        t = row->text = row_text_new(t->data.data(), t->data.size());
+    } else {
+        if (t->interned) {
+            E.interned.erase(t->hash);
+            t->interned = false;
+        }
+        cold_detach(t);
     }
-    std::string text = std::string(text_c);
-    free((void*)text_c);
+    t->layout_gen = 0;
+    return t;
+}
 
-    if (hist) push_undoinfo(PASTE_FROM_CLIPBOARD, text);
-    usize sz = text.size();
-    for (usize i = 0; i < sz; i++) {
-        do_insert_char(false, text[i]);
+// Rows sharing an interned text, and the bytes they would take
+// with a copy each beyond the first.
+void interned_savings(usize* rows, usize* saved) {
+    *rows = *saved = 0;
+    for (std::unordered_map<u64, RowText*>::iterator it = E.interned.begin(); it != E.interned.end(); it++) {
+        RowText* t = it->second;
+        *rows += t->refs;
+        *saved += (t->refs - 1) * (sizeof(RowText) + t->data_bytes + t->rdata_bytes);
     }
 }
 
-void do_open_line_below_cursor(bool hist) {
-    if (hist) push_undoinfo(OPEN_LINE_BELOW_CURSOR, "");
-    insert_row(E.cy+1, "");
-    E.set_cpos(0, E.cy+1);
-    autoindent_just_after_newline(hist);
-    do_change_mode_to_insert();
+// ============= COMPRESSION ==============
+
+// LZ4 block format, compatible with `LZ4_decompress_safe`: a run of
+// sequences, each a token (literal count << 4 | match length - 4),
+// the literals, a 2-byte little-endian offset back into the output
+// and the match. Counts of 15 or more continue in extra bytes. The
+// last sequence is literals only and covers at least the last 5
+// bytes. Compression is a single greedy pass with a table of 4-byte
+// hashes, which is what makes LZ4 fast.
+
+const int LZ4_HASH_BITS = 12;
+const usize LZ4_MIN_MATCH = 4;
+const usize LZ4_MAX_OFFSET = 65535;
+// No match may start within the last 12 bytes.
+const usize LZ4_MATCH_LIMIT = 12;
+const usize LZ4_LAST_LITERALS = 5;
+
+u32 lz4_hash(const char* p) {
+    u32 v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
 }
 
-void do_save_file() {
-    file_trim_trailing_ws();
+void lz4_put_count(std::string* out, usize n) {
+    while (n >= 255) {
+        out->push_back((char)255);
+        n -= 255;
+    }
+    out->push_back((char)n);
+}
 
-    if (E.path == "") {
-        set_cmdline_msg_error("no filename");
-        return;
+void lz4_put_sequence(std::string* out, const char* lit, usize nlit, usize offset, usize match) {
+    usize ml = match ? match - LZ4_MIN_MATCH : 0;
+    out->push_back((char)((std::min(nlit, (usize)15) << 4) | std::min(ml, (usize)15)));
+    if (nlit >= 15) lz4_put_count(out, nlit - 15);
+    out->append(lit, nlit);
+    if (!match) return;
+    out->push_back((char)(offset & 0xff));
+    out->push_back((char)(offset >> 8));
+    if (ml >= 15) lz4_put_count(out, ml - 15);
+}
+
+void lz4_compress(const char* src, usize n, std::string* out) {
+    // Positions + 1, so 0 means empty.
+    static u32 table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    usize anchor = 0, i = 0;
+    usize limit = n > LZ4_MATCH_LIMIT ? n - LZ4_MATCH_LIMIT : 0;
+    while (i < limit) {
+        u32 h = lz4_hash(src + i);
+        usize cand = table[h];
+        table[h] = i + 1;
+        if (cand == 0 || i - (cand-1) > LZ4_MAX_OFFSET || memcmp(src + cand-1, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        cand--;
+        usize len = LZ4_MIN_MATCH;
+        usize max = n - LZ4_LAST_LITERALS - i;
+        while (len < max && src[cand+len] == src[i+len]) len++;
+        lz4_put_sequence(out, src + anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
     }
-    std::string tmp_path = E.path + ".tmp";
-    std::ofstream f(tmp_path);
-    if (!f) set_cmdline_msg_error("cannot open file for saving");
+    lz4_put_sequence(out, src + anchor, n - anchor, 0, 0);
+}
 
-    std::string contents = rows_to_string();
-    f << contents;
-    f.close();
-    if (!f) set_cmdline_msg_error("cannot write to file for saving");
-    system(std::string("mv " + tmp_path + " " + E.path).c_str());
-    set_cmdline_msg_info("{} bytes written", contents.size());
-    E.dirty = false;
+bool lz4_get_count(const char* src, usize n, usize* ip, usize* count) {
+    u8 b;
+    do {
+        if (*ip >= n) return false;
+        b = src[(*ip)++];
+        *count += b;
+    } while (b == 255);
+    return true;
 }
 
-void do_exit_editor() {
-    if (E.dirty && E.quit_times > 0) {
-        set_cmdline_msg_error("File has unsaved changes: press [backtick] {} more times to quit or use 'exit --force'", E.quit_times);
-        E.quit_times--;
-    } else {
-        core::succ_exit();
+// Decompresses exactly `dst_len` bytes. False if `src` is malformed.
+bool lz4_decompress(const char* src, usize n, char* dst, usize dst_len) {
+    usize ip = 0, op = 0;
+    while (ip < n) {
+        u8 token = src[ip++];
+        usize nlit = token >> 4;
+        if (nlit == 15 && !lz4_get_count(src, n, &ip, &nlit)) return false;
+        if (nlit > n - ip || nlit > dst_len - op) return false;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break;
+
+        if (n - ip < 2) return false;
+        usize offset = (u8)src[ip] | (usize)(u8)src[ip+1] << 8;
+        ip += 2;
+        usize match = token & 15;
+        if (match == 15 && !lz4_get_count(src, n, &ip, &match)) return false;
+        match += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > op || match > dst_len - op) return false;
+        // Byte by byte: the match may overlap what it copies.
+        for (usize k = 0; k < match; k++) dst[op+k] = dst[op+k-offset];
+        op += match;
     }
+    return op == dst_len;
 }
 
-void do_force_exit_editor() {
-    core::succ_exit();
+// ============= COLD ROWS ==============
+
+// Once row text takes more than the `coldbudget` option, rows away
+// from the screen are compressed while the editor is idle. The
+// texts of up to COLD_BLOCK_ROWS consecutive rows are packed into a
+// ColdBlock and their strings freed. Reading a text through
+// `row_text` decompresses its whole block, which then stays until
+// the idle pass drops the least recently used blocks again. A
+// block's compressed copy is kept, so dropping it costs nothing;
+// changing a text takes it out of its block.
+//
+// Blocks are dropped from the idle pass, and by passes over the
+// whole file such as search and save, which read through a
+// ColdScan so that they don't leave every block they went through
+// decompressed. Otherwise nothing is dropped while texts are read,
+// so references into a text stay valid until the editor goes back
+// to waiting for input.
+
+const int COLD_BLOCK_ROWS = 256;
+// Rows around the screen that are never packed.
+const int COLD_HOT_ROWS = 1000;
+// Idle time before compressing, and the most time one idle pass
+// takes before it yields to input.
+const int COLD_IDLE_MS = 2000;
+const int COLD_SLICE_MS = 10;
+
+usize cold_block_bytes(ColdBlock* b) {
+    return sizeof(ColdBlock) + b->packed.size() + mem_of_vector(b->texts) + mem_of_vector(b->lens);
 }
 
-void cursor_page_up_down(bool down) {
-    if (down) {
-        E.cy = E.rowoff + E.screenrows - 1;
-        if (E.cy > E.lastrow_idx()) {
-            E.cy = E.lastrow_idx();
+void cold_free_block(ColdBlock* b) {
+    mem_free(MEM_COLD, cold_block_bytes(b));
+    std::vector<ColdBlock*>& blocks = E.cold.blocks;
+    for (usize i = 0; i < blocks.size(); i++) {
+        if (blocks[i] == b) {
+            blocks[i] = blocks.back();
+            blocks.pop_back();
+            break;
         }
-    } else {
-        E.cy = E.rowoff;
     }
-    update_cx_when_cy_changed();
+    delete b;
+}
 
-    int times = E.screenrows;
-    while (times--) {
-        if (down) do_cursor_down();
-        else do_cursor_up();
+void cold_detach(RowText* t) {
+    ColdBlock* b = t->block;
+    if (!b) return;
+    b->texts[t->block_idx] = NULL;
+    t->block = NULL;
+    if (--b->live == 0) cold_free_block(b);
+}
+
+void cold_load(ColdBlock* b) {
+    TRACE_SCOPE("cold_load");
+    std::string raw(b->raw_size, '\0');
+    if (!lz4_decompress(b->packed.data(), b->packed.size(), &raw[0], raw.size())) {
+        core::error_exit_with_msg("corrupt cold block");
+    }
+    usize off = 0;
+    for (usize i = 0; i < b->texts.size(); i++) {
+        RowText* t = b->texts[i];
+        if (t) {
+            t->data.assign(raw, off, b->lens[i]);
+            text_account(t);
+        }
+        off += b->lens[i];
     }
+    b->resident = true;
+    E.cold.loads++;
 }
 
-void do_cursor_page_up() {
-    cursor_page_up_down(false);
+// Frees the strings of `b`'s texts, leaving the compressed copy.
+void cold_drop(ColdBlock* b) {
+    for (usize i = 0; i < b->texts.size(); i++) {
+        RowText* t = b->texts[i];
+        if (!t) continue;
+        std::string().swap(t->data);
+        std::string().swap(t->rdata);
+        t->rlen = 0;
+        hl_line_release(t->hl_line);
+        t->hl_line = NULL;
+        t->hl = NULL;
+        t->layout_gen = 0;
+        text_account(t);
+    }
+    b->resident = false;
 }
 
-void do_cursor_page_down() {
-    cursor_page_up_down(true);
+// Packs the texts of rows `y0` up to `y1` that are not in a block
+// yet into a new block and drops it.
+ColdBlock* cold_pack(int y0, int y1) {
+    ColdBlock* b = new ColdBlock();
+    std::string raw;
+    for (int y = y0; y < y1; y++) {
+        RowText* t = E.rows[y]->text;
+        if (t->block) continue;
+        t->block = b;
+        t->block_idx = b->texts.size();
+        b->texts.push_back(t);
+        b->lens.push_back(t->data.size());
+        raw += t->data;
+    }
+    if (b->texts.empty()) {
+        delete b;
+        return NULL;
+    }
+    b->raw_size = raw.size();
+    lz4_compress(raw.data(), raw.size(), &b->packed);
+    b->live = b->texts.size();
+    mem_alloc(MEM_COLD, cold_block_bytes(b));
+    E.cold.blocks.push_back(b);
+    cold_drop(b);
+    return b;
 }
 
-void repeat_search(bool forward) {
-    if (E.search_default == "") {
-        set_cmdline_msg_error("empty prev search");
-    } else {
-        if (forward) search_text_forward(E.search_default, true);
-        else search_text_backward(E.search_default, true);
+// A pass reading rows one after another. A block that was
+// compressed when the pass reached it is dropped again once the
+// pass moves on to another block, so the pass holds at most one
+// extra block. A text read through it must not be used after the
+// next call.
+struct ColdScan {
+    ColdBlock* loaded;
+};
+
+RowText* cold_scan_text(ColdScan* s, EditorRow* row) {
+    ColdBlock* b = row->text->block;
+    if (s->loaded && s->loaded != b) {
+        cold_drop(s->loaded);
+        s->loaded = NULL;
     }
+    if (b && !b->resident) s->loaded = b;
+    return row_text(row);
 }
 
-void do_repeat_search_forward() {
-    repeat_search(true);
+bool cold_use_before(const ColdBlock* a, const ColdBlock* b) {
+    return a->last_use < b->last_use;
 }
 
-void do_repeat_search_backward() {
-    repeat_search(false);
+usize text_bytes() {
+    return MEM[MEM_TEXT].bytes + MEM[MEM_RENDER].bytes;
 }
 
-void do_undo_or_redo(bool undo) {
-    if (E.numundos() == 0 || (undo && E.undo_pos == -1)) {
-        set_cmdline_msg_error("already at oldest change");
-        return;
+bool cold_over_budget() {
+    return text_bytes() > (usize)E.global_opts.coldbudget << 20;
+}
+
+// One idle pass: drops the least recently used blocks, then packs
+// rows away from the screen, until under budget or out of time.
+void on_cold_idle() {
+    if (!E.global_opts.coldbudget || !cold_over_budget()) return;
+    TRACE_SCOPE("cold_idle");
+    i64 deadline = now_ms() + COLD_SLICE_MS;
+
+    std::vector<ColdBlock*> lru;
+    for (usize i = 0; i < E.cold.blocks.size(); i++) {
+        if (E.cold.blocks[i]->resident) lru.push_back(E.cold.blocks[i]);
     }
-    if (!undo && E.undo_pos == E.numundos()-1) {
-        set_cmdline_msg_error("already at newest change");
-        return;
+    std::sort(lru.begin(), lru.end(), cold_use_before);
+    for (usize i = 0; i < lru.size() && cold_over_budget(); i++) cold_drop(lru[i]);
+
+    int hot0 = std::min(E.rowoff, E.cy) - COLD_HOT_ROWS;
+    int hot1 = std::max(E.rowoff + E.textrows(), E.cy) + COLD_HOT_ROWS;
+    int seen = 0;
+    while (cold_over_budget() && seen < E.numrows() && now_ms() < deadline) {
+        if (E.cold.scan >= E.numrows()) E.cold.scan = 0;
+        int y0 = E.cold.scan;
+        int y1 = std::min(y0 + COLD_BLOCK_ROWS, E.numrows());
+        if (y1 <= hot0 || y0 >= hot1) cold_pack(y0, y1);
+        E.cold.scan = y1;
+        seen += y1 - y0;
     }
+    // Out of time rather than out of rows: yield to input, then
+    // carry on.
+    if (cold_over_budget() && seen < E.numrows()) ev_set_timer(on_cold_idle, 0);
+}
 
-    int uidx = undo ? E.undo_pos : E.undo_pos+1;
-    if (undo) E.undo_pos--;
-    else E.undo_pos++;
+// ============= CONTENT HASH ==============
 
-    UndoInfo u = E.undos[uidx];
+const u64 HASH_BASE = 0x9e3779b97f4a7c15ULL;
 
-    if ((u.type == INSERT_CHAR && undo)
-            || (u.type == INSERT_NEWLINE && undo)
-            || (u.type == DELETE_CURRENT_CHAR && !undo)
-            || (u.type == DELETE_LEFT_CHAR && !undo)) {
-        E.set_cpos(u.x, u.y);
-        do_delete_current_char(false);
-    } else if ((u.type == DELETE_CURRENT_CHAR && undo)
-            || (u.type == DELETE_LEFT_CHAR && undo)
+u64 hash_bytes(const char* data, usize len) {
+    // FNV-1a
+    u64 h = 0xcbf29ce484222325ULL;
+    for (usize i = 0; i < len; i++) {
+        h ^= (u8)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+u32 hash_tree_prio() {
+    static u32 state = 0x12345678;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+int hash_tree_size(EditorRow* t) {
+    return t ? t->hn.size : 0;
+}
+
+void hash_tree_pull(EditorRow* t) {
+    RowHashNode* n = &t->hn;
+    n->size = 1;
+    n->subhash = 0;
+    n->pw = 1;
+    if (n->left) {
+        n->left->hn.parent = t;
+        n->size += n->left->hn.size;
+        n->subhash = n->left->hn.subhash;
+        n->pw = n->left->hn.pw;
+    }
+    n->subhash += n->hash * n->pw;
+    n->pw *= HASH_BASE;
+    if (n->right) {
+        n->right->hn.parent = t;
+        n->size += n->right->hn.size;
+        n->subhash += n->right->hn.subhash * n->pw;
+        n->pw *= n->right->hn.pw;
+    }
+}
+
+// Splits `t` so that the first `k` rows end up in `a`.
+void hash_tree_split(EditorRow* t, int k, EditorRow** a, EditorRow** b) {
+    if (!t) {
+        *a = NULL;
+        *b = NULL;
+        return;
+    }
+    if (k <= hash_tree_size(t->hn.left)) {
+        hash_tree_split(t->hn.left, k, a, &t->hn.left);
+        *b = t;
+    } else {
+        hash_tree_split(t->hn.right, k - hash_tree_size(t->hn.left) - 1, &t->hn.right, b);
+        *a = t;
+    }
+    hash_tree_pull(t);
+}
+
+EditorRow* hash_tree_merge(EditorRow* a, EditorRow* b) {
+    if (!a) return b;
+    if (!b) return a;
+    if (a->hn.prio > b->hn.prio) {
+        a->hn.right = hash_tree_merge(a->hn.right, b);
+        hash_tree_pull(a);
+        return a;
+    } else {
+        b->hn.left = hash_tree_merge(a, b->hn.left);
+        hash_tree_pull(b);
+        return b;
+    }
+}
+
+void hash_tree_insert(int at, EditorRow* row) {
+    row->hn.left = NULL;
+    row->hn.right = NULL;
+    row->hn.parent = NULL;
+    row->hn.prio = hash_tree_prio();
+    hash_tree_pull(row);
+
+    EditorRow *a, *b;
+    hash_tree_split(E.hash_root, at, &a, &b);
+    E.hash_root = hash_tree_merge(hash_tree_merge(a, row), b);
+    E.hash_root->hn.parent = NULL;
+}
+
+void hash_tree_erase(int at) {
+    EditorRow *a, *mid, *b;
+    hash_tree_split(E.hash_root, at, &a, &b);
+    hash_tree_split(b, 1, &mid, &b);
+    E.hash_root = hash_tree_merge(a, b);
+    if (E.hash_root) E.hash_root->hn.parent = NULL;
+}
+
+void hash_tree_update(EditorRow* row) {
+    RowText* t = row_text(row);
+    row->hn.hash = t->interned ? t->hash : hash_bytes(t->data.data(), t->data.size());
+    for (EditorRow* t = row; t; t = t->hn.parent) {
+        hash_tree_pull(t);
+    }
+}
+
+// Position of `row` in the buffer, found from the treap.
+int row_index(EditorRow* row) {
+    int i = hash_tree_size(row->hn.left);
+    for (EditorRow* t = row; t->hn.parent; t = t->hn.parent) {
+        EditorRow* p = t->hn.parent;
+        if (p->hn.right == t) i += hash_tree_size(p->hn.left) + 1;
+    }
+    return i;
+}
+
+void remember_saved_hash() {
+    E.saved_hash_valid = true;
+    E.saved_hash = E.content_hash();
+    E.saved_numrows = E.numrows();
+}
+
+// Computes `rdata`, `hl` and `indent` from `data` with the current
+// options.
+void render_row(EditorRow* row) {
+    RowText* t = row_text(row);
+    int ts = E.opts.tabstop;
+    t->rdata.reserve(t->data.size());
+    t->rdata.clear();
+    t->indent = -1;
+    for (usize i = 0; i < t->data.size(); i++) {
+        if (t->indent == -1 && t->data[i] != ' ' && t->data[i] != '\t') {
+            t->indent = t->rdata.size();
+        }
+        if (t->data[i] == '\t') {
+            t->rdata.push_back(' ');
+            while (t->rdata.size() % ts != 0) {
+                t->rdata.push_back(' ');
+            }
+        } else {
+            t->rdata.push_back(t->data[i]);
+        }
+    }
+
+    // Compute size before adding '\0'
+    t->rlen = t->rdata.size();
+    t->rdata.push_back('\0');
+    t->layout_gen = E.layout_gen;
+    text_account(t);
+
+    if (!E.batch) update_row_syntax(row);
+}
+
+// Re-renders `row` if a layout option changed since it was last
+// rendered. Anything reading `rdata`, `hl` or `indent` goes through
+// this.
+EditorRow* row_layout(EditorRow* row) {
+    if (row_text(row)->layout_gen != E.layout_gen) render_row(row);
+    return row;
+}
+
+void update_row(EditorRow* row) {
+    row_layout(row);
+    hash_tree_update(row);
+
+    if (row->gen <= E.save_gen) {
+        row->modified_idx = E.modified_rows.size();
+        E.modified_rows.push_back(row);
+    }
+    row->gen = ++E.edit_gen;
+}
+
+EditorRow* insert_row(int at, const char* data, usize len) {
+    if (at < 0 || at > E.numrows()) return NULL;
+    EditorRow* row = new EditorRow();
+    mem_alloc(MEM_ROWS, sizeof(EditorRow));
+    row->text = row_text_get(data, len);
+    row->gen = 0;
+    row->eol = E.fmt.eol;
+    markers_insert_rows(at, 1);
+    E.rows.insert(E.rows.begin() + at, row);
+    hash_tree_insert(at, row);
+    update_row(row);
+    return row;
+}
+
+EditorRow* insert_row(int at, const std::string& data) {
+    return insert_row(at, data.data(), data.size());
+}
+
+void forget_modified_rows() {
+    E.modified_rows.clear();
+    E.save_gen = E.edit_gen;
+}
+
+void free_row(EditorRow* row) {
+    if (row->gen > E.save_gen) {
+        EditorRow* last = E.modified_rows.back();
+        E.modified_rows[row->modified_idx] = last;
+        last->modified_idx = row->modified_idx;
+        E.modified_rows.pop_back();
+    }
+    row_text_release(row->text);
+    mem_free(MEM_ROWS, sizeof(EditorRow));
+    delete row;
+}
+
+std::string delete_row(int at) {
+        if (at < 0 || at >= E.numrows()) return "";
+    EditorRow* row = E.get_row_at(at);
+    std::string rowdata = row_text(row)->data;
+    markers_delete_rows(at, 1);
+    hash_tree_erase(at);
+    free_row(row);
+    E.rows.erase(E.rows.begin() + at);
+    return rowdata;
+}
+
+void row_insert_char(EditorRow* row, int at, int c) {
+    if (at < 0 || at > row->len()) at = row->len();
+    markers_insert_cols(row_index(row), at, 1);
+    row_text_mut(row)->data.insert(at, 1, c);
+    update_row(row);
+}
+
+void row_insert_string(EditorRow* row, int at, const std::string& str) {
+    if (at < 0 || at > row->len()) at = row->len();
+    markers_insert_cols(row_index(row), at, str.size());
+    row_text_mut(row)->data.insert(at, str);
+    update_row(row);
+}
+
+std::string row_delete_range(EditorRow* row, int at, int len) {
+    if (at < 0 || at+len > row->len() || len == 0) return "";
+    std::string copy = row_text(row)->data.substr(at, len);
+    markers_delete_cols(row_index(row), at, len);
+    row_text_mut(row)->data.erase(at, len);
+    update_row(row);
+    return copy;
+}
+
+void row_append_string(EditorRow* row, const std::string& str) {
+    row_text_mut(row)->data += str;
+    update_row(row);
+}
+
+// Moves the text of row `y` from `x` on into a new row below it.
+void split_row(int y, int x) {
+    EditorRow* row = E.get_row_at(y);
+    insert_row(y+1, row_text(row)->data.substr(x));
+    shift_markers(y, x+1, y+1, 0, shift_by(1, -x));
+    row_text_mut(row)->data.resize(x);
+    update_row(row);
+}
+
+// Appends row `y+1` to row `y`.
+void join_rows(int y) {
+    EditorRow* row = E.get_row_at(y);
+    shift_markers(y+1, 0, y+2, 0, shift_by(-1, row->len()));
+    row_append_string(row, row_text(E.get_row_at(y+1))->data);
+    delete_row(y+1);
+}
+
+int row_indent(EditorRow* row) {
+    return row_text(row_layout(row))->indent;
+}
+
+template<typename... Args>
+void set_cmdline_msg_info(const std::string& fmt, Args... args) {
+    if (E.mode != COMMAND && E.mode != SEARCH) {
+        E.cmdline = fmt::format(fmt, args...);
+        E.cmdline_msg_time = time(NULL);
+        E.cmdline_style = NONE;
+    }
+}
+
+template<typename... Args>
+void set_cmdline_msg_error(const std::string& fmt, Args... args) {
+    if (E.mode != COMMAND && E.mode != SEARCH) {
+        E.cmdline = fmt::format(fmt, args...);
+        E.cmdline_msg_time = time(NULL);
+        E.cmdline_style = ERROR;
+    }
+}
+
+std::string rows_to_string() {
+    std::string res;
+    if (E.fmt.bom) res.append("\xef\xbb\xbf");
+    ColdScan scan = { NULL };
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = E.get_row_at(i);
+        res.append(cold_scan_text(&scan, row)->data);
+        if (i != E.lastrow_idx() || E.fmt.final_newline) {
+            res.append(eol_to_str(row->eol));
+        }
+    }
+    return res;
+}
+
+void _find_synhlt_with_ext() {
+    E.syn = NULL;
+    if (E.path == "") return;
+    usize idx = E.path.find('.');
+    if (idx == std::string::npos) return;
+    std::string ext = E.path.substr(idx+1);
+    if (ext == "") return;
+
+    for (usize i = 0; i < NUM_HLDBS; i++) {
+        EditorSyntax* s = &HLDB[i];
+        int e = 0;
+        std::string need = s->extmatch[e];
+        while (need != "") {
+            if (need == ext) {
+                E.syn = s;
+                return;
+            }
+            e++;
+            need = s->extmatch[e];
+        }
+    }
+}
+
+void update_synhlt_from_ext() {
+    TRACE_SCOPE("highlight_all");
+    TRACE_ARG(E.numrows());
+    _find_synhlt_with_ext();
+    if (E.batch) return;
+    for (int r = 0; r < E.numrows(); r++) {
+        // Stale rows, including compressed ones, are highlighted
+        // when next rendered.
+        EditorRow* row = E.get_row_at(r);
+        if (row->text->layout_gen == E.layout_gen) update_row_syntax(row);
+    }
+}
+
+void scroll_to(int x, int y) {
+    if (y < E.rowoff) {
+        E.rowoff = y;
+    }
+    if (y >= E.rowoff + (E.textrows()-5)) {
+        E.rowoff = y - (E.textrows()-5) + 1;
+    }
+    if (x < E.coloff) {
+        E.coloff = x;
+    }
+    if (x >= E.coloff + (E.screencols-5)) {
+        E.coloff = x - (E.screencols-5) + 1;
+    }
+}
+
+void scroll_cmdline() {
+    if (E.cmdx < E.cmdoff) {
+        E.cmdoff = E.cmdx;
+    }
+    if (E.cmdx >= E.cmdoff + (E.screencols-1)) {
+        E.cmdoff = E.cmdx - (E.screencols-1) + 1;
+    }
+}
+
+// Memory the undo tree may hold before it is pruned, and what it is
+// pruned down to, leaving room to grow before the next pruning.
+const usize UNDO_MAX_BYTES = 64 << 20;
+const usize UNDO_PRUNE_TO = 48 << 20;
+
+void prune_undo_tree();
+
+usize undo_change_bytes(const UndoInfo& u) {
+    usize n = sizeof(UndoNode) + u.data.size();
+    for (usize i = 0; i < u.before.size(); i++) n += sizeof(std::string) + u.before[i].size();
+    for (usize i = 0; i < u.after.size(); i++) n += sizeof(std::string) + u.after[i].size();
+    return n;
+}
+
+// Forgets all changes; the current state becomes the root.
+void reset_undo_tree() {
+    UndoNode root;
+    root.parent = -1;
+    root.redo_child = -1;
+    root.depth = 0;
+    root.seq = 0;
+    root.time = now_us();
+    root.bytes = 0;
+    E.undo_nodes.assign(1, root);
+    E.undo_cur = 0;
+    E.undo_seq = 0;
+    E.undo_bytes = 0;
+}
+
+// Adds `u` as a child of the current node. Changes undone before are
+// kept on their own branch.
+void push_undo(const UndoInfo& u) {
+    UndoNode n;
+    n.change = u;
+    n.parent = E.undo_cur;
+    n.redo_child = -1;
+    n.depth = E.undo_nodes[E.undo_cur].depth + 1;
+    n.seq = ++E.undo_seq;
+    n.time = now_us();
+    n.bytes = undo_change_bytes(u);
+    E.undo_nodes.push_back(n);
+    E.undo_cur = E.undo_nodes.size() - 1;
+    E.undo_nodes[n.parent].redo_child = E.undo_cur;
+    E.undo_bytes += n.bytes;
+    if (E.undo_bytes > UNDO_MAX_BYTES) prune_undo_tree();
+}
+
+// Replaces the change of the current node, for an edit that belongs
+// to the change just recorded.
+void replace_last_undo(const UndoInfo& u) {
+    UndoNode& n = E.undo_nodes[E.undo_cur];
+    E.undo_bytes -= n.bytes;
+    n.change = u;
+    n.bytes = undo_change_bytes(u);
+    E.undo_bytes += n.bytes;
+}
+
+void push_undoinfo(EditorAction type, std::string data) {
+    UndoInfo u;
+    u.type = type;
+    u.data = data;
+    u.x = E.cx;
+    u.y = E.cy;
+    push_undo(u);
+}
+
+// ============= SETTINGS ==============
+
+// Options are changed with `set name value` (also the default for
+// files opened later) or `setlocal name value` (this buffer only).
+// They can also be given in $XDG_CONFIG_HOME/hed/config, one
+// `name value` per line, and buffer options in a modeline.
+
+enum SettingType {
+    SETTING_BOOL,
+    SETTING_INT,
+};
+
+// Has a per-buffer value in `E.opts`; otherwise the value lives
+// only in `E.global_opts`.
+#define SETTING_BUFFER (1<<0)
+// Changes how rows are rendered into `rdata`.
+#define SETTING_LAYOUT (1<<1)
+
+struct Setting {
+    std::string name;
+    std::string alias;
+    SettingType type;
+    int flags;
+    // Where the value is stored in `Options`.
+    usize offset;
+    int min, max;
+};
+
+Setting SETTINGS[] = {
+    { "tabstop", "ts", SETTING_INT, SETTING_BUFFER | SETTING_LAYOUT, offsetof(Options, tabstop), 1, 32 },
+    { "shiftwidth", "sw", SETTING_INT, SETTING_BUFFER, offsetof(Options, shiftwidth), 0, 32 },
+    { "expandtab", "et", SETTING_BOOL, SETTING_BUFFER, offsetof(Options, expandtab), 0, 1 },
+    { "trimws", "", SETTING_BOOL, SETTING_BUFFER, offsetof(Options, trimws), 0, 1 },
+    { "modeline", "ml", SETTING_BOOL, 0, offsetof(Options, modeline), 0, 1 },
+    { "detectindent", "", SETTING_BOOL, 0, offsetof(Options, detectindent), 0, 1 },
+    { "intern", "", SETTING_BOOL, 0, offsetof(Options, intern), 0, 1 },
+    { "coldbudget", "", SETTING_INT, 0, offsetof(Options, coldbudget), 0, 1 << 20 },
+    { "memreport", "", SETTING_BOOL, 0, offsetof(Options, memreport), 0, 1 },
+};
+#define NUM_SETTINGS (sizeof(SETTINGS) / sizeof(SETTINGS[0]))
+
+// Rows at each end of a file searched for a modeline.
+const int MODELINE_ROWS = 5;
+
+void init_options(Options* o) {
+    o->tabstop = 4;
+    o->shiftwidth = 0;
+    o->expandtab = true;
+    o->trimws = true;
+    o->modeline = true;
+    o->detectindent = true;
+    o->intern = false;
+    o->coldbudget = 512;
+    o->memreport = false;
+}
+
+Setting* find_setting(const std::string& name) {
+    for (usize i = 0; i < NUM_SETTINGS; i++) {
+        if (SETTINGS[i].name == name || (SETTINGS[i].alias != "" && SETTINGS[i].alias == name)) {
+            return &SETTINGS[i];
+        }
+    }
+    return NULL;
+}
+
+int get_setting(Options* o, Setting* s) {
+    char* p = (char*)o + s->offset;
+    if (s->type == SETTING_BOOL) return *(bool*)p;
+    return *(int*)p;
+}
+
+void store_setting(Options* o, Setting* s, int value) {
+    char* p = (char*)o + s->offset;
+    if (s->type == SETTING_BOOL) *(bool*)p = value != 0;
+    else *(int*)p = value;
+}
+
+bool parse_setting_value(Setting* s, const std::string& str, int* value, std::string* err) {
+    if (s->type == SETTING_BOOL) {
+        if (str == "on" || str == "true" || str == "yes" || str == "1") *value = 1;
+        else if (str == "off" || str == "false" || str == "no" || str == "0") *value = 0;
+        else {
+            *err = fmt::format("{}: expected on or off, got '{}'", s->name, str);
+            return false;
+        }
+        return true;
+    }
+
+    char* end;
+    long v = strtol(str.c_str(), &end, 10);
+    if (str == "" || *end != '\0') {
+        *err = fmt::format("{}: expected a number, got '{}'", s->name, str);
+        return false;
+    }
+    if (v < s->min || v > s->max) {
+        *err = fmt::format("{}: must be between {} and {}", s->name, s->min, s->max);
+        return false;
+    }
+    *value = (int)v;
+    return true;
+}
+
+// Called when an option that affects `rdata` changed. Rows are
+// not touched here: each one is re-rendered by `row_layout` the
+// next time it is drawn or searched, so this costs the same on a
+// million-row file as on an empty one.
+void layout_changed() {
+    E.layout_gen++;
+    E.tx = row_cx_to_rx(E.get_row_at(E.cy), E.cx);
+    E.redraw = true;
+}
+
+bool set_option(const std::string& name, const std::string& str, bool global, std::string* err) {
+    Setting* s = find_setting(name);
+    if (!s) {
+        *err = fmt::format("unknown option '{}'", name);
+        return false;
+    }
+    int value;
+    if (!parse_setting_value(s, str, &value, err)) return false;
+
+    if (global || !(s->flags & SETTING_BUFFER)) store_setting(&E.global_opts, s, value);
+    if (s->flags & SETTING_BUFFER) {
+        int old = get_setting(&E.opts, s);
+        store_setting(&E.opts, s, value);
+        if ((s->flags & SETTING_LAYOUT) && old != value) layout_changed();
+    }
+    return true;
+}
+
+// Gives the buffer the global defaults, as when a file is opened.
+void reset_buffer_options() {
+    int old_tabstop = E.opts.tabstop;
+    E.opts = E.global_opts;
+    if (E.opts.tabstop != old_tabstop) layout_changed();
+}
+
+std::string config_file_path(const std::string& name) {
+    const char* xdg = getenv("XDG_CONFIG_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/hed/" + name;
+    const char* home = getenv("HOME");
+    if (home && *home) return std::string(home) + "/.config/hed/" + name;
+    return "";
+}
+
+// Reads the user's config file. Stops at the first bad line and
+// reports it on the command line.
+void load_config() {
+    std::string path = config_file_path("config");
+    if (path == "") return;
+    std::ifstream f(path);
+    if (!f) return;
+
+    std::string line;
+    for (int lineno = 1; std::getline(f, line); lineno++) {
+        str_trim_leading_ws(line);
+        str_trim_trailing_ws(line);
+        if (line == "" || line[0] == '#') continue;
+
+        std::istringstream words(line);
+        std::string name, value, extra;
+        words >> name >> value >> extra;
+        std::string err = "expected 'name value'";
+        if (value == "" || extra != "" || !set_option(name, value, true, &err)) {
+            set_cmdline_msg_error("{}:{}: {}", path, lineno, err);
+            return;
+        }
+    }
+    E.opts = E.global_opts;
+}
+
+// Applies a modeline such as `vim: set ts=8 noet:` or `hed: sw=2`
+// found in `line`. Options unknown to hed are skipped, since
+// modelines are usually written for other editors, and only buffer
+// options can be set from a file.
+void apply_modeline(const std::string& line) {
+    const char* prefixes[] = { "hed:", "vim:", "vi:", "ex:", NULL };
+    usize start = std::string::npos;
+    for (int i = 0; prefixes[i] && start == std::string::npos; i++) {
+        usize pos = line.find(prefixes[i]);
+        if (pos != std::string::npos && (pos == 0 || line[pos-1] == ' ' || line[pos-1] == '\t')) {
+            start = pos + strlen(prefixes[i]);
+        }
+    }
+    if (start == std::string::npos) return;
+
+    std::string rest = line.substr(start);
+    str_trim_leading_ws(rest);
+    // `set` form: options up to the next ':'.
+    bool set_form = str_startswith(rest, "set ") || str_startswith(rest, "se ");
+    if (set_form) {
+        rest = rest.substr(rest.find(' ') + 1);
+        usize colon = rest.find(':');
+        if (colon == std::string::npos) return;
+        rest.resize(colon);
+    }
+
+    for (usize i = 0; i < rest.size(); i++) {
+        if (rest[i] == ':' || rest[i] == '\t') rest[i] = ' ';
+    }
+    std::istringstream words(rest);
+    std::string word;
+    while (words >> word) {
+        std::string name = word, value;
+        usize eq = word.find('=');
+        if (eq != std::string::npos) {
+            name = word.substr(0, eq);
+            value = word.substr(eq+1);
+        }
+        Setting* s = find_setting(name);
+        if (!s && eq == std::string::npos && str_startswith(name, "no")) {
+            s = find_setting(name.substr(2));
+            value = "off";
+        } else if (s && eq == std::string::npos) {
+            value = "on";
+        }
+        if (!s || !(s->flags & SETTING_BUFFER)) continue;
+
+        std::string err;
+        if (!set_option(s->name, value, false, &err)) {
+            set_cmdline_msg_error("modeline: {}", err);
+        }
+    }
+}
+
+void apply_modelines() {
+    if (!E.global_opts.modeline) return;
+    for (int i = 0; i < E.numrows(); i++) {
+        if (i == MODELINE_ROWS && E.numrows() > 2*MODELINE_ROWS) i = E.numrows() - MODELINE_ROWS;
+        apply_modeline(row_text(E.rows[i])->data);
+    }
+}
+
+// Columns one level of indentation takes.
+int indent_width() {
+    return E.opts.shiftwidth ? E.opts.shiftwidth : E.opts.tabstop;
+}
+
+// Whitespace that indents to column `col`, using tabs where
+// `expandtab` is off.
+std::string make_indent(int col) {
+    if (E.opts.expandtab) return std::string(col, ' ');
+    return std::string(col / E.opts.tabstop, '\t') + std::string(col % E.opts.tabstop, ' ');
+}
+
+// ============= BULK EDITS ==============
+
+// Inserts `rows` at `at` with a single move of the row vector,
+// instead of one per row as repeated `insert_row` calls would do.
+void insert_rows(int at, const std::vector<std::string>& rows) {
+    if (at < 0 || at > E.numrows() || rows.size() == 0) return;
+    std::vector<EditorRow*> created;
+    for (usize i = 0; i < rows.size(); i++) {
+        EditorRow* row = new EditorRow();
+        mem_alloc(MEM_ROWS, sizeof(EditorRow));
+        row->text = row_text_get(rows[i].data(), rows[i].size());
+        row->gen = 0;
+        row->eol = E.fmt.eol;
+        created.push_back(row);
+    }
+    markers_insert_rows(at, rows.size());
+    E.rows.insert(E.rows.begin() + at, created.begin(), created.end());
+    for (usize i = 0; i < created.size(); i++) {
+        hash_tree_insert(at+i, created[i]);
+        update_row(created[i]);
+    }
+}
+
+void delete_rows(int at, int count) {
+    if (at < 0 || count <= 0 || at+count > E.numrows()) return;
+    markers_delete_rows(at, count);
+    for (int i = 0; i < count; i++) {
+        hash_tree_erase(at);
+        free_row(E.rows[at+i]);
+    }
+    E.rows.erase(E.rows.begin() + at, E.rows.begin() + at + count);
+}
+
+// Replaces `count` rows starting at `y` with `rows`, as a single
+// undoable change. Rows that end up with the same text are left
+// alone, so they don't count as modified.
+void replace_rows(int y, int count, const std::vector<std::string>& rows, bool hist) {
+    if (hist) {
+        UndoInfo u;
+        u.type = REPLACE_ROWS;
+        u.x = E.cx;
+        u.y = y;
+        for (int i = 0; i < count; i++) u.before.push_back(row_text(E.rows[y+i])->data);
+        u.after = rows;
+        push_undo(u);
+    }
+
+    int common = count < (int)rows.size() ? count : rows.size();
+    for (int i = 0; i < common; i++) {
+        EditorRow* row = E.rows[y+i];
+        if (row_text(row)->data != rows[i]) {
+            row_set_text(row, rows[i]);
+            update_row(row);
+        }
+    }
+    if (count > common) {
+        delete_rows(y+common, count-common);
+    } else if ((int)rows.size() > common) {
+        std::vector<std::string> extra(rows.begin() + common, rows.end());
+        insert_rows(y+common, extra);
+    }
+
+    if (E.cy > E.lastrow_idx()) E.cy = E.lastrow_idx() < 0 ? 0 : E.lastrow_idx();
+    EditorRow* row = E.get_row_at(E.cy);
+    if (E.cx > (row ? row->len() : 0)) E.cx = row ? row->len() : 0;
+}
+
+// Returns true and fills `out` if the row text should change.
+typedef bool (*RowTransform)(const std::string& in, std::string* out, void* ctx);
+
+// Runs `fn` over rows `y0..y1` (inclusive) and records the changed
+// span as one change. Returns the number of changed rows.
+int transform_rows(int y0, int y1, RowTransform fn, void* ctx, bool hist) {
+    TRACE_SCOPE("transform_rows");
+    TRACE_ARG(y1 - y0 + 1);
+    std::vector<int> changed_at;
+    std::vector<std::string> changed;
+    std::string out;
+    ColdScan scan = { NULL };
+    for (int y = y0; y <= y1; y++) {
+        out.clear();
+        if (fn(cold_scan_text(&scan, E.rows[y])->data, &out, ctx)) {
+            changed_at.push_back(y);
+            changed.push_back(out);
+        }
+    }
+    if (changed_at.size() == 0) return 0;
+
+    int first = changed_at.front();
+    int last = changed_at.back();
+    std::vector<std::string> span;
+    usize c = 0;
+    for (int y = first; y <= last; y++) {
+        if (c < changed_at.size() && changed_at[c] == y) span.push_back(changed[c++]);
+        else span.push_back(cold_scan_text(&scan, E.rows[y])->data);
+    }
+    replace_rows(first, last-first+1, span, hist);
+    return changed_at.size();
+}
+
+bool transform_trim(const std::string& in, std::string* out, void* ctx) {
+    usize end = in.find_last_not_of(WHITESPACE);
+    end = end == std::string::npos ? 0 : end+1;
+    if (end == in.size()) return false;
+    out->assign(in, 0, end);
+    return true;
+}
+
+struct ReplaceArgs {
+    std::string from, to;
+};
+
+bool transform_replace(const std::string& in, std::string* out, void* ctx) {
+    ReplaceArgs* r = (ReplaceArgs*)ctx;
+    usize pos = in.find(r->from);
+    if (r->from == "" || pos == std::string::npos) return false;
+    usize last = 0;
+    while (pos != std::string::npos) {
+        out->append(in, last, pos-last);
+        out->append(r->to);
+        last = pos + r->from.size();
+        pos = in.find(r->from, last);
+    }
+    out->append(in, last, std::string::npos);
+    return true;
+}
+
+// Shifts non-blank rows by `*(int*)ctx` indent levels.
+bool transform_indent(const std::string& in, std::string* out, void* ctx) {
+    int levels = *(int*)ctx;
+    usize ws = in.find_first_not_of(" \t");
+    if (ws == std::string::npos || levels == 0) return false;
+
+    int col = 0;
+    for (usize i = 0; i < ws; i++) {
+        if (in[i] == '\t') col += E.opts.tabstop - col%E.opts.tabstop;
+        else col++;
+    }
+    int target = col + levels*indent_width();
+    if (target < 0) target = 0;
+    if (target == col) return false;
+
+    out->append(make_indent(target));
+    out->append(in, ws, std::string::npos);
+    return true;
+}
+
+// A save hook transforms one row's `data` in place and returns
+// true if it changed it. Hooks only ever see rows modified since
+// the last load/save.
+typedef bool (*SaveHook)(EditorRow* row);
+
+bool save_hook_trim_trailing_ws(EditorRow* row) {
+    if (!E.opts.trimws) return false;
+    const std::string& data = row_text(row)->data;
+    if (data.find_last_not_of(WHITESPACE) + 1 == data.size()) return false;
+    str_trim_trailing_ws(row_text_mut(row)->data);
+    return true;
+}
+
+SaveHook SAVE_HOOKS[] = {
+    save_hook_trim_trailing_ws,
+};
+#define NUM_SAVE_HOOKS (sizeof(SAVE_HOOKS) / sizeof(SAVE_HOOKS[0]))
+
+void run_save_hooks() {
+    // `update_row` does not add rows that are already listed,
+    // so the list doesn't grow while we walk it.
+    for (usize i = 0; i < E.modified_rows.size(); i++) {
+        EditorRow* row = E.modified_rows[i];
+        bool changed = false;
+        for (usize h = 0; h < NUM_SAVE_HOOKS; h++) {
+            if (SAVE_HOOKS[h](row)) changed = true;
+        }
+        if (changed) update_row(row);
+    }
+}
+
+void set_path(const std::string& path) {
+    // The file at the new path may not match the buffer.
+    if (path != E.path) E.saved_hash_valid = false;
+    E.path = path;
+    update_synhlt_from_ext();
+}
+
+// ============= LOADER ==============
+
+// Only the start of the file is looked at to detect its format.
+const usize FORMAT_SCAN_BYTES = 64*1024;
+// Indentation is guessed from at most this many runs of this many
+// consecutive rows, spread evenly over the file.
+const int INDENT_SAMPLE_RUNS = 64;
+const int INDENT_SAMPLE_ROWS = 16;
+// Fewer indented rows than this in the sample is too little to go on.
+const int INDENT_MIN_ROWS = 4;
+const int INDENT_MAX_WIDTH = 8;
+
+bool is_valid_utf8(const u8* s, usize len) {
+    usize i = 0;
+    while (i < len) {
+        u8 c = s[i];
+        int n;
+        if (c < 0x80) n = 0;
+        else if ((c & 0xe0) == 0xc0 && c >= 0xc2) n = 1;
+        else if ((c & 0xf0) == 0xe0) n = 2;
+        else if ((c & 0xf8) == 0xf0 && c <= 0xf4) n = 3;
+        else return false;
+        // A sequence cut off by the end of the scan block is fine.
+        if (i+n >= len) return true;
+        for (int k = 1; k <= n; k++) {
+            if ((s[i+k] & 0xc0) != 0x80) return false;
+        }
+        i += n+1;
+    }
+    return true;
+}
+
+// Counts line terminators in the first block using `memchr`, which
+// libc implements with vector instructions, instead of testing
+// every byte ourselves.
+void detect_file_format(const char* data, usize len, FileFormat* fmt) {
+    fmt->bom = false;
+    fmt->encoding = "utf-8";
+    if (len >= 3 && !memcmp(data, "\xef\xbb\xbf", 3)) {
+        fmt->bom = true;
+        data += 3;
+        len -= 3;
+    }
+
+    usize scan = len < FORMAT_SCAN_BYTES ? len : FORMAT_SCAN_BYTES;
+    usize lf = 0, crlf = 0, cr = 0;
+    const char* p = data;
+    const char* end = data + scan;
+    while (p < end) {
+        const char* nl = (const char*)memchr(p, '\n', end-p);
+        const char* stop = nl ? nl : end;
+        // Lone CRs can only be between the previous LF and this one.
+        for (const char* q = (const char*)memchr(p, '\r', stop-p);
+             q;
+             q = (const char*)memchr(q+1, '\r', stop-(q+1))) {
+            if (q+1 == nl) crlf++;
+            else if (q+1 < stop) cr++;
+        }
+        if (!nl) break;
+        if (nl == data || nl[-1] != '\r') lf++;
+        p = nl+1;
+    }
+
+    if (lf == 0 && crlf == 0 && cr != 0) fmt->eol = EOL_CR;
+    else if (crlf > lf) fmt->eol = EOL_CRLF;
+    else fmt->eol = EOL_LF;
+
+    if (memchr(data, '\0', scan)) fmt->encoding = "binary";
+    else if (!is_valid_utf8((const u8*)data, scan)) fmt->encoding = "8-bit";
+}
+
+// Guesses whether the file is indented with tabs or spaces, and
+// how many spaces make a level, and sets the buffer options to
+// match. Only a fixed-size sample of rows is looked at, so this
+// costs the same on a huge file as on a small one.
+//
+// Tabs win if more sampled rows start with a tab than with spaces.
+// The width is the most common change in indentation between
+// neighbouring space-indented rows.
+void detect_indent_style() {
+    if (!E.global_opts.detectindent || E.numrows() == 0) return;
+    int n = E.numrows();
+    int runs = n / INDENT_SAMPLE_ROWS;
+    if (runs < 1) runs = 1;
+    if (runs > INDENT_SAMPLE_RUNS) runs = INDENT_SAMPLE_RUNS;
+
+    int tabs = 0, spaces = 0;
+    int votes[INDENT_MAX_WIDTH+1] = { 0 };
+    for (int r = 0; r < runs; r++) {
+        int start = (int)((i64)n * r / runs);
+        int end = std::min(start + INDENT_SAMPLE_ROWS, n);
+        // Indent of the previous space-indented row, -1 if none.
+        int prev = -1;
+        for (int y = start; y < end; y++) {
+            const std::string& d = row_text(E.rows[y])->data;
+            usize ws = d.find_first_not_of(" \t");
+            if (ws == std::string::npos) continue;
+            if (d[0] == '\t') {
+                tabs++;
+                prev = -1;
+                continue;
+            }
+            // Mixed indentation tells us nothing about the width.
+            if (d.find_first_not_of(' ') != ws) {
+                prev = -1;
+                continue;
+            }
+            // ` * ` continues a block comment; it's not a level.
+            if (ws % 2 == 1 && d[ws] == '*') continue;
+            if (ws > 0) spaces++;
+            if (prev != -1) {
+                int delta = abs((int)ws - prev);
+                if (delta >= 2 && delta <= INDENT_MAX_WIDTH) votes[delta]++;
+            }
+            prev = ws;
+        }
+    }
+
+    if (tabs + spaces < INDENT_MIN_ROWS) return;
+    if (tabs > spaces) {
+        E.opts.expandtab = false;
+        E.opts.shiftwidth = 0;
+        return;
+    }
+    int width = 0;
+    for (int w = 2; w <= INDENT_MAX_WIDTH; w++) {
+        if (votes[w] > votes[width]) width = w;
+    }
+    E.opts.expandtab = true;
+    if (width) E.opts.shiftwidth = width;
+}
+
+// Splits `data` into rows in place: each row is built straight from
+// the file buffer with its terminator left out.
+void load_rows(const char* data, usize len) {
+    if (E.fmt.bom) {
+        data += 3;
+        len -= 3;
+    }
+    E.fmt.final_newline = true;
+
+    char sep = E.fmt.eol == EOL_CR ? '\r' : '\n';
+    const char* p = data;
+    const char* end = data + len;
+    while (p < end) {
+        const char* nl = (const char*)memchr(p, sep, end-p);
+        if (!nl) {
+            insert_row(E.numrows(), p, end-p);
+            E.fmt.final_newline = false;
+            break;
+        }
+        usize linelen = nl-p;
+        LineEnding eol = EOL_CR;
+        if (sep == '\n') {
+            eol = EOL_LF;
+            if (linelen && p[linelen-1] == '\r') {
+                linelen--;
+                eol = EOL_CRLF;
+            }
+        }
+        EditorRow* row = insert_row(E.numrows(), p, linelen);
+        row->eol = eol;
+        p = nl+1;
+    }
+}
+
+// Returns an error message, or NULL if the file was loaded.
+const char* open_file(const std::string& path) {
+    TRACE_SCOPE("open_file");
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return "file not found";
+
+    f.seekg(0, std::ios::end);
+    std::streamoff size = f.tellg();
+    if (size < 0) return "cannot read file";
+    std::string buf;
+    buf.resize((usize)size);
+    f.seekg(0, std::ios::beg);
+    f.read(&buf[0], buf.size());
+    if (!f) return "cannot read file";
+    TRACE_ARG(buf.size());
+
+    if (buf.size() >= 2 && (!memcmp(buf.data(), "\xff\xfe", 2) || !memcmp(buf.data(), "\xfe\xff", 2))) {
+        return "UTF-16 files are not supported";
+    }
+
+    reset_buffer_options();
+    detect_file_format(buf.data(), buf.size(), &E.fmt);
+    load_rows(buf.data(), buf.size());
+    detect_indent_style();
+    apply_modelines();
+    set_path(path);
+    remember_saved_hash();
+    forget_modified_rows();
+    return NULL;
+}
+
+// Drops the current file and everything tied to it.
+void close_file() {
+    reset_markers();
+    reset_decorations();
+    while (E.numrows() != 0) delete_row(E.lastrow_idx());
+    reset_undo_tree();
+    E.cx = E.cy = E.rx = E.tx = 0;
+    E.rowoff = E.coloff = 0;
+    clear_search_match();
+    E.fmt.eol = EOL_LF;
+    E.fmt.bom = false;
+    E.fmt.final_newline = true;
+    E.fmt.encoding = "utf-8";
+    E.path = "";
+    reset_buffer_options();
+    forget_modified_rows();
+    remember_saved_hash();
+}
+
+void search_text_forward(const std::string& query, bool set_cursor_on_match) {
+    TRACE_SCOPE("search");
+    if (query == "") {
+        clear_search_match();
+        return;
+    }
+    bool found = false;
+
+    ColdScan scan = { NULL };
+    for (int i = E.cy; i < E.numrows(); i++) {
+        cold_scan_text(&scan, E.rows[i]);
+        EditorRow* row = row_layout(E.rows[i]);
+        usize match = row_text(row)->rdata.find(query, (i == E.cy) ? E.rx+1 : 0);
+        if (match != std::string::npos) {
+            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
+            set_search_match(i, match, match + query.size());
+            scroll_to(match + query.size(), i);
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        set_cmdline_msg_error("search reached EOF");
+        clear_search_match();
+    }
+}
+
+void search_text_backward(const std::string& query, bool set_cursor_on_match) {
+    TRACE_SCOPE("search");
+    if (query == "") {
+        clear_search_match();
+        return;
+    }
+    bool found = false;
+
+    ColdScan scan = { NULL };
+    for (int i = E.cy; i >= 0; i--) {
+        // If at beginning of line, then skip current line
+        if (i == E.cy && E.cx == 0) continue;
+        cold_scan_text(&scan, E.rows[i]);
+        EditorRow* row = row_layout(E.rows[i]);
+        usize match = row_text(row)->rdata.rfind(query, (i == E.cy) ? E.rx-1 : std::string::npos);
+        if (match != std::string::npos) {
+            if (set_cursor_on_match) E.set_cpos(row_rx_to_cx(row, match), i);
+            set_search_match(i, match, match + query.size());
+            scroll_to(match + query.size(), i);
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        set_cmdline_msg_error("search reached BOF");
+        clear_search_match();
+    }
+}
+
+// =========== high level ==============
+void ewrite(const std::string& str) {
+    E.abuf.append(str);
+}
+
+void ewrite_char(char c) {
+    E.abuf += c;
+}
+
+void ewrite_cstr_with_len(const char* str, usize len) {
+    E.abuf.append(str, len);
+}
+
+void ewrite_with_len(const std::string& str, usize len) {
+    E.abuf.append(str, 0, len);
+}
+
+void insert_empty_row_if_file_empty() {
+    if (E.numrows() == 0) {
+        insert_row(E.numrows(), "");
+    }
+}
+
+void delete_empty_row_if_file_empty() {
+    EditorRow* row = E.get_row_at(E.cy);
+    if (E.numrows() == 1 && row->len() == 0) {
+        delete_row(0);
+    }
+}
+
+void update_cx_when_cy_changed() {
+    if (E.numrows() != 0) {
+        // We calculate E.cx from E.rx and update it
+        // instead of directly updating E.rx
+        // because E.rx is calculated on
+        // every refresh (throwing the prev value away).
+        // So we "choose" a E.cx which
+        // will be converted to the needed E.rx in the
+        // refresh stage.
+        E.cx = row_rx_to_cx(E.get_row_at(E.cy), E.tx > E.rx ? E.tx : E.rx);
+    }
+}
+
+void copy_to_clipboard(const std::string& text) {
+    TRACE_SCOPE("clipboard_set");
+    TRACE_ARG(text.size());
+    if (!E.cb) return;
+    E.dbglog("[start]");
+    E.dbglog(text);
+    E.dbglog("[end]");
+
+    clipboard_set_text_ex(E.cb, text.c_str(), text.size(), LCB_CLIPBOARD);
+    // The clipboard keeps a copy while we own the selection.
+    mem_set(MEM_CLIPBOARD, text.size(), 1);
+}
+
+// ============= INDENT ==============
+
+// The indent of a row is worked out from the previous non-blank
+// row: the same, one level deeper if that row opens a block (ends
+// with one of the syntax's `indent_open` characters), and one level
+// shallower if this row closes one. Without a syntax, rows just
+// keep the previous row's indent.
+
+bool syn_opens_indent(const std::string& data) {
+    if (!E.syn) return false;
+    usize last = data.find_last_not_of(" \t");
+    return last != std::string::npos && E.syn->indent_open.find(data[last]) != std::string::npos;
+}
+
+bool syn_closes_indent(const std::string& data) {
+    if (!E.syn) return false;
+    usize first = data.find_first_not_of(" \t");
+    return first != std::string::npos && E.syn->indent_close.find(data[first]) != std::string::npos;
+}
+
+// Indent for `data` following a row with text `prev_data` indented
+// to `prev_indent`.
+int next_indent(int prev_indent, const std::string& prev_data, const std::string& data) {
+    int col = prev_indent;
+    if (syn_opens_indent(prev_data)) col += indent_width();
+    if (syn_closes_indent(data)) col -= indent_width();
+    return col < 0 ? 0 : col;
+}
+
+// Last non-blank row above `y`, or -1.
+int prev_nonblank_row(int y) {
+    for (int i = y-1; i >= 0; i--) {
+        if (row_indent(E.rows[i]) != -1) return i;
+    }
+    return -1;
+}
+
+int compute_indent(int y) {
+    int p = prev_nonblank_row(y);
+    if (p == -1) return 0;
+    return next_indent(row_indent(E.rows[p]), row_text(E.rows[p])->data, row_text(E.rows[y])->data);
+}
+
+struct ReindentState {
+    // Indent and text of the last non-blank row seen, -1 if none.
+    int prev_indent;
+    std::string prev_data;
+};
+
+bool transform_reindent(const std::string& in, std::string* out, void* ctx) {
+    ReindentState* st = (ReindentState*)ctx;
+    usize ws = in.find_first_not_of(" \t");
+    if (ws == std::string::npos) return false;
+
+    int target = st->prev_indent == -1 ? 0 : next_indent(st->prev_indent, st->prev_data, in);
+    st->prev_indent = target;
+    st->prev_data = in;
+
+    out->append(make_indent(target));
+    out->append(in, ws, std::string::npos);
+    return *out != in;
+}
+
+// Re-indents rows `y0..y1` by the rules above as one undoable
+// change, starting from the indent of the row before them.
+int reindent_rows(int y0, int y1, bool hist) {
+    ReindentState st;
+    st.prev_indent = -1;
+    int p = prev_nonblank_row(y0);
+    if (p != -1) {
+        st.prev_indent = row_indent(E.rows[p]);
+        st.prev_data = row_text(E.rows[p])->data;
+    }
+    return transform_rows(y0, y1, transform_reindent, &st, hist);
+}
+
+int shift_rows(int y0, int y1, int levels, bool hist) {
+    return transform_rows(y0, y1, transform_indent, &levels, hist);
+}
+
+// Rows from the mark to the cursor.
+void cursor_mark_rows(int* y0, int* y1) {
+    int mx, my;
+    get_region_mark(&mx, &my);
+    *y0 = std::min(my, E.cy);
+    *y1 = std::max(my, E.cy);
+    if (*y1 > E.lastrow_idx()) *y1 = E.lastrow_idx();
+}
+
+void do_indent_rows(int levels, bool region) {
+    if (E.numrows() == 0) return;
+    int y0 = E.cy, y1 = E.cy;
+    if (region) cursor_mark_rows(&y0, &y1);
+    if (levels) shift_rows(y0, y1, levels, true);
+    else if (!E.syn) set_cmdline_msg_error("no indent rules for this file type");
+    else reindent_rows(y0, y1, true);
+}
+
+// Called after `c` was typed in insert mode: a block closer typed
+// as the first thing on a row moves the row to its block's indent.
+// Typing it and the reindent are undone as one change.
+void reindent_after_close(int c) {
+    if (!E.syn || E.syn->indent_close.find(c) == std::string::npos) return;
+    EditorRow* row = E.get_row_at(E.cy);
+    if (!row || (int)row_text(row)->data.find_first_not_of(" \t") != E.cx-1) return;
+    std::string before = row_text(row)->data;
+    before.erase(E.cx-1, 1);
+    if (reindent_rows(E.cy, E.cy, false) == 0) return;
+    UndoInfo u;
+    u.type = REPLACE_ROWS;
+    u.x = E.cx-1;
+    u.y = E.cy;
+    u.before.push_back(before);
+    u.after.push_back(row_text(row)->data);
+    replace_last_undo(u);
+    E.set_cpos(row_text(row)->data.find_first_not_of(" \t") + 1, E.cy);
+}
+
+// ============= ACTIONS ==============
+
+void do_cursor_up() {
+    if (E.cy != 0) E.cy--;
+    update_cx_when_cy_changed();
+}
+
+void do_cursor_down() {
+    if (E.cy < E.lastrow_idx()) E.cy++;
+    update_cx_when_cy_changed();
+}
+
+void do_cursor_left() {
+    if (E.cx != 0) E.set_cpos(E.cx-1, E.cy);
+    else if (E.cy > 0) {
+        E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
+    }
+}
+
+void do_cursor_right() {
+    EditorRow* row = E.get_row_at(E.cy);
+    if (E.cx < row->len()) E.set_cpos(E.cx+1, E.cy);
+    else if (E.cy != (E.lastrow_idx()) && E.cx == row->len()) {
+        E.set_cpos(0, E.cy+1);
+    }
+}
+
+void do_cursor_line_begin() {
+    E.set_cpos(0, E.cy);
+}
+
+void do_cursor_line_end() {
+    EditorRow* row = E.get_row_at(E.cy);
+    if (row) E.set_cpos(row->len(), E.cy);
+}
+
+void change_mode(EditorMode mode) {
+    E.mode = mode;
+    E.cmd_history.pos = -1;
+    E.search_history.pos = -1;
+    E.compl_state.matches.clear();
+    E.cmdline = "";
+    E.cmdline_style = NONE;
+    E.cmdx = 0;
+    E.cmdoff = 0;
+}
+
+void do_change_mode_to_normal() {
+    change_mode(NORMAL);
+}
+
+void do_change_mode_to_insert() {
+    change_mode(INSERT);
+}
+
+void do_change_mode_to_command() {
+    change_mode(COMMAND);
+}
+
+void do_change_mode_to_search() {
+    change_mode(SEARCH);
+}
+
+void do_set_mark() {
+    set_named_mark(REGION_MARK, E.cx, E.cy);
+    E.region_shown = true;
+    E.region_gen = E.edit_gen;
+}
+
+// Most jump list entries kept.
+const int JUMPLIST_MAX = 100;
+
+// Remembers the cursor before a jump (search, `gg`, a range on its
+// own, an error or bookmark), so that jump-back returns to it.
+void push_jump() {
+    // Jumping from the middle of the list forgets the newer entries.
+    while ((int)E.jumps.size() > E.jump_pos + 1) {
+        marker_free(E.jumps.back());
+        E.jumps.pop_back();
+    }
+    int x, y;
+    if (E.jumps.size() != 0) {
+        marker_get(E.jumps.back(), &x, &y);
+        if (y == E.cy) {
+            marker_move(E.jumps.back(), E.cx, E.cy);
+            E.jump_pos = E.jumps.size();
+            return;
+        }
+    }
+    E.jumps.push_back(marker_new(MARKER_JUMP, E.cx, E.cy));
+    if ((int)E.jumps.size() > JUMPLIST_MAX) {
+        marker_free(E.jumps.front());
+        E.jumps.erase(E.jumps.begin());
+    }
+    E.jump_pos = E.jumps.size();
+}
+
+void go_to_jump(int idx) {
+    int x, y;
+    marker_get(E.jumps[idx], &x, &y);
+    E.jump_pos = idx;
+    E.set_cpos(x, y);
+}
+
+void do_jump_back() {
+    if (E.jump_pos == (int)E.jumps.size()) {
+        // Record where we are, so jump-forward can come back.
+        push_jump();
+        E.jump_pos = E.jumps.size() - 1;
+    }
+    if (E.jump_pos <= 0) {
+        set_cmdline_msg_error("at oldest jump");
+        return;
+    }
+    go_to_jump(E.jump_pos - 1);
+}
+
+void do_jump_forward() {
+    if (E.jump_pos + 1 >= (int)E.jumps.size()) {
+        set_cmdline_msg_error("at newest jump");
+        return;
+    }
+    go_to_jump(E.jump_pos + 1);
+}
+
+void do_toggle_bookmark() {
+    if (E.numrows() == 0) return;
+    Marker* m = marker_find_next(E.markers, MARKER_BOOKMARK, E.cy, 0);
+    if (m && m->y == E.cy) {
+        marker_free(m);
+        set_cmdline_msg_info("bookmark removed");
+    } else {
+        marker_new(MARKER_BOOKMARK, 0, E.cy);
+        set_cmdline_msg_info("bookmark set");
+    }
+}
+
+void goto_bookmark(bool next) {
+    Marker* m;
+    if (next) {
+        m = marker_find_next(E.markers, MARKER_BOOKMARK, E.cy+1, 0);
+        if (!m) m = marker_find_next(E.markers, MARKER_BOOKMARK, 0, 0);
+    } else {
+        m = marker_find_prev(E.markers, MARKER_BOOKMARK, E.cy, 0);
+        if (!m) m = marker_find_prev(E.markers, MARKER_BOOKMARK, INT_MAX, 0);
+    }
+    if (!m) {
+        set_cmdline_msg_error("no bookmarks");
+        return;
+    }
+    int x, y;
+    marker_get(m, &x, &y);
+    push_jump();
+    E.set_cpos(0, y);
+}
+
+void do_next_bookmark() {
+    goto_bookmark(true);
+}
+
+void do_prev_bookmark() {
+    goto_bookmark(false);
+}
+
+void do_cut_cursor_mark_region(bool hist) {
+    int mx, my;
+    get_region_mark(&mx, &my);
+    int startx, starty, endx, endy;
+    if (my < E.cy) {
+        starty = my;
+        endy = E.cy;
+        startx = mx;
+        endx = E.cx;
+    } else if (E.cy < my) {
+        starty = E.cy;
+        endy = my;
+        startx = E.cx;
+        endx = mx;
+    } else {
+        starty = E.cy;
+        endy = E.cy;
+        if (E.cx < mx) {
+            startx = E.cx;
+            endx = mx;
+        } else if (mx < E.cx) {
+            startx = mx;
+            endx = E.cx;
+        } else return;
+    }
+
+    std::string copy;
+    if (startx == 0 && starty == 0 && endy == E.lastrow_idx() && endx == E.get_row_at(E.lastrow_idx())->len()) {
+        for (int i = 0; i < E.numrows(); i++) {
+            if (i != 0) copy += '\n';
+            copy += row_text(E.get_row_at(i))->data;
+        }
+        delete_rows(0, E.numrows());
+    } else if (starty == endy) {
+        copy += row_delete_range(E.get_row_at(starty), startx, endx-startx);
+    } else {
+        // Cut down to the tail of the end row and join it on, so
+        // that markers after the region land where the text does.
+        EditorRow* startrow = E.get_row_at(starty);
+        copy += row_delete_range(startrow, startx, startrow->len()-startx);
+        for (int i = starty+1; i < endy; i++) {
+            copy += '\n';
+            copy += row_text(E.get_row_at(i))->data;
+        }
+        delete_rows(starty+1, endy-starty-1);
+        copy += '\n';
+        copy += row_delete_range(E.get_row_at(starty+1), 0, endx);
+        join_rows(starty);
+    }
+
+    E.set_cpos(startx, starty);
+    copy_to_clipboard(copy);
+    if (hist) push_undoinfo(CUT_CURSOR_MARK_REGION, copy);
+}
+
+void do_cursor_forward_word() {
+    while (!isalpha(E.get_char_at_cpos()) && !E.is_cpos_at_end())
+        do_cursor_right();
+    if (!E.is_cpos_at_end()) {
+        while (isalpha(E.get_char_at_cpos())) do_cursor_right();
+    }
+}
+
+void do_cursor_backward_word() {
+    if (E.cx == 0 && E.cy == 0) return;
+    while (!(isalpha(E.get_char_at_lpos()) || E.get_char_at_lpos() == '\0'))
+        do_cursor_left();
+    while (isalpha(E.get_char_at_lpos())) {
+        do_cursor_left();
+    }
+}
+
+void do_cursor_first_row() {
+    push_jump();
+    E.cy = 0;
+    update_cx_when_cy_changed();
+}
+
+void do_cursor_last_row() {
+    push_jump();
+    E.cy = E.lastrow_idx();
+    update_cx_when_cy_changed();
+}
+
+bool is_row_only_ws(EditorRow* row) {
+    if (row->len() == 0) return true;
+    for (int i = 0; i < row->len(); i++) {
+        char c = row_text(row)->data[i];
+        if (c != '\t' && c != ' ') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void do_cursor_next_para() {
+    if (E.cy == E.lastrow_idx()) return;
+    E.cy++;
+
+    while (E.cy != E.lastrow_idx() && is_row_only_ws(E.get_row_at(E.cy))) {
+        E.cy++;
+    }
+
+    while (E.cy != E.lastrow_idx() && !is_row_only_ws(E.get_row_at(E.cy))) {
+        E.cy++;
+    }
+    update_cx_when_cy_changed();
+}
+
+void do_cursor_prev_para() {
+    if (E.cy == 0) return;
+    E.cy--;
+
+    while (E.cy != 0 && is_row_only_ws(E.get_row_at(E.cy))) {
+        E.cy--;
+    }
+
+    while (E.cy != 0 && !is_row_only_ws(E.get_row_at(E.cy))) {
+        E.cy--;
+    }
+    update_cx_when_cy_changed();
+}
+
+void do_insert_char(bool hist, int c);
+
+void do_insert_indent(bool hist) {
+    if (E.opts.expandtab) {
+        int sw = indent_width();
+        int spaces = ((sw-1) - (E.rx%sw)) + 1;
+        for (int i = 0; i < spaces; i++) do_insert_char(hist, ' ');
+    } else {
+        do_insert_char(hist, '\t');
+    }
+}
+
+void autoindent_just_after_newline(bool hist) {
+    if (E.cx != 0) return;
+    int target_indent = compute_indent(E.cy);
+    if (target_indent == 0) return;
+
+    std::string indent = make_indent(target_indent);
+    row_insert_string(E.get_row_at(E.cy), 0, indent);
+    E.set_cpos(indent.size(), E.cy);
+    if (hist) push_undoinfo(AUTOINDENT_JUST_AFTER_NEWLINE, indent);
+}
+
+void do_insert_newline(bool hist, bool autoindent) {
+    if (hist) push_undoinfo(INSERT_NEWLINE, std::string(1, '\n'));
+    insert_empty_row_if_file_empty();
+
+    if (E.cx == 0) {
+        insert_row(E.cy, "");
+    } else {
+        split_row(E.cy, E.cx);
+    }
+    E.set_cpos(0, E.cy+1);
+    if (autoindent) autoindent_just_after_newline(hist);
+}
+
+void do_insert_char(bool hist, int c) {
+    if (hist) push_undoinfo(INSERT_CHAR, std::string(1, c));
+    if (c == '\n') {
+        // We do not autoindent because this code
+        // can be called by other functions such
+        // as the paste code.
+        do_insert_newline(hist, false);
+        return;
+    }
+
+    insert_empty_row_if_file_empty();
+
+    row_insert_char(E.get_row_at(E.cy), E.cx, c);
+    E.set_cpos(E.cx+1, E.cy);
+}
+
+void do_delete_left_char(bool hist) {
+    if (E.cx == 0 && E.cy == 0) return;
+    EditorRow* row = E.get_row_at(E.cy);
+
+    if (E.cx > 0) {
+        char c = row_text(row)->data[E.cx-1];
+        row_delete_range(row, E.cx-1, 1);
+        E.set_cpos(E.cx-1, E.cy);
+        if (hist) push_undoinfo(DELETE_LEFT_CHAR, std::string(1, c));
+    } else {
+        E.set_cpos(E.get_row_at(E.cy-1)->len(), E.cy-1);
+        if (hist) push_undoinfo(DELETE_LEFT_CHAR, std::string(1, '\n'));
+        join_rows(E.cy);
+    }
+
+    delete_empty_row_if_file_empty();
+}
+
+void do_delete_current_char(bool hist) {
+    EditorRow* row = E.get_row_at(E.cy);
+    if (!row) return;
+
+    if (E.cx == row->len()) {
+        if (E.cy < E.lastrow_idx()) {
+            if (hist) push_undoinfo(DELETE_CURRENT_CHAR, std::string(1, '\n'));
+            join_rows(E.cy);
+        }
+    } else {
+        if (hist) push_undoinfo(DELETE_CURRENT_CHAR, std::string(1, row_text(row)->data[E.cx]));
+        row_delete_range(row, E.cx, 1);
+    }
+
+    delete_empty_row_if_file_empty();
+}
+
+// Inserts `text` at the cursor as typed, but without autoindent.
+void paste_text(const std::string& text, bool hist) {
+    if (hist) push_undoinfo(PASTE_FROM_CLIPBOARD, text);
+    usize sz = text.size();
+    for (usize i = 0; i < sz; i++) {
+        do_insert_char(false, text[i]);
+    }
+}
+
+void do_paste_from_clipboard(bool hist) {
+    TRACE_SCOPE("clipboard_get");
+    const char* text_c = clipboard_text_ex(E.cb, NULL, LCB_CLIPBOARD);
+    if (!text_c) {
+        set_cmdline_msg_error("nothing to paste");
+        return;
+    }
+    std::string text = std::string(text_c);
+    free((void*)text_c);
+    paste_text(text, hist);
+}
+
+void do_open_line_below_cursor(bool hist) {
+    if (hist) push_undoinfo(OPEN_LINE_BELOW_CURSOR, "");
+    insert_row(E.cy+1, "");
+    E.set_cpos(0, E.cy+1);
+    autoindent_just_after_newline(hist);
+    do_change_mode_to_insert();
+}
+
+// Streams the rows to a temporary file next to `E.path` and renames
+// it over the original, keeping the original's permissions. Returns
+// an error message, or NULL with the size in `written`.
+const char* save_file(usize* written) {
+    TRACE_SCOPE("save_file");
+    std::string tmp_path = E.path + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if (!f) return "cannot open file for saving";
+    static char buf[64*1024];
+    setvbuf(f, buf, _IOFBF, sizeof(buf));
+
+    usize total = 0;
+    if (E.fmt.bom) total += fwrite("\xef\xbb\xbf", 1, 3, f);
+    ColdScan scan = { NULL };
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = E.get_row_at(i);
+        const std::string& data = cold_scan_text(&scan, row)->data;
+        total += fwrite(data.data(), 1, data.size(), f);
+        if (i != E.lastrow_idx() || E.fmt.final_newline) {
+            const char* eol = eol_to_str(row->eol);
+            total += fwrite(eol, 1, strlen(eol), f);
+        }
+    }
+
+    struct stat st;
+    if (stat(E.path.c_str(), &st) == 0) fchmod(fileno(f), st.st_mode & 07777);
+    if (ferror(f) | fclose(f)) {
+        unlink(tmp_path.c_str());
+        return "cannot write to file for saving";
+    }
+    if (rename(tmp_path.c_str(), E.path.c_str()) == -1) {
+        unlink(tmp_path.c_str());
+        return "cannot replace file";
+    }
+
+    *written = total;
+    TRACE_ARG(total);
+    remember_saved_hash();
+    forget_modified_rows();
+    return NULL;
+}
+
+void do_save_file() {
+    if (E.path == "") {
+        set_cmdline_msg_error("no filename");
+        return;
+    }
+    if (!E.is_dirty()) {
+        set_cmdline_msg_info("no changes, nothing written");
+        return;
+    }
+
+    run_save_hooks();
+    usize written;
+    const char* err = save_file(&written);
+    if (err) {
+        set_cmdline_msg_error("{}", err);
+        return;
+    }
+    set_cmdline_msg_info("{} bytes written", written);
+}
+
+void do_exit_editor() {
+    if (E.is_dirty() && E.quit_times > 0) {
+        set_cmdline_msg_error("File has unsaved changes: press [backtick] {} more times to quit or use 'exit --force'", E.quit_times);
+        E.quit_times--;
+    } else {
+        core::succ_exit();
+    }
+}
+
+void do_force_exit_editor() {
+    core::succ_exit();
+}
+
+void cursor_page_up_down(bool down) {
+    if (down) {
+        E.cy = E.rowoff + E.textrows() - 1;
+        if (E.cy > E.lastrow_idx()) {
+            E.cy = E.lastrow_idx();
+        }
+    } else {
+        E.cy = E.rowoff;
+    }
+    update_cx_when_cy_changed();
+
+    int times = E.textrows();
+    while (times--) {
+        if (down) do_cursor_down();
+        else do_cursor_up();
+    }
+}
+
+void do_cursor_page_up() {
+    cursor_page_up_down(false);
+}
+
+void do_cursor_page_down() {
+    cursor_page_up_down(true);
+}
+
+void repeat_search(bool forward) {
+    if (E.search_default == "") {
+        set_cmdline_msg_error("empty prev search");
+    } else {
+        push_jump();
+        if (forward) search_text_forward(E.search_default, true);
+        else search_text_backward(E.search_default, true);
+    }
+}
+
+void do_repeat_search_forward() {
+    repeat_search(true);
+}
+
+void do_repeat_search_backward() {
+    repeat_search(false);
+}
+
+// ============= UNDO ==============
+
+// Changes form a tree rooted at the state the file was opened in.
+// Undo moves to the parent of the current node and redo to its
+// `redo_child`, so making a change after undoing starts a new branch
+// instead of throwing the undone changes away. `earlier` and `later`
+// step through states in the order they were made, whatever branch
+// they are on, or by time (`earlier 5m`); the buffer gets there by
+// undoing up to the common ancestor and redoing down from it.
+//
+// Past UNDO_MAX_BYTES the tree is pruned: first the branches off the
+// path from the root to the current node, oldest first, then the
+// oldest changes on that path.
+
+// Applies `u`, or reverts it if `undo`.
+void apply_change(const UndoInfo& u, bool undo) {
+    if ((u.type == INSERT_CHAR && undo)
+            || (u.type == INSERT_NEWLINE && undo)
+            || (u.type == DELETE_CURRENT_CHAR && !undo)
+            || (u.type == DELETE_LEFT_CHAR && !undo)) {
+        E.set_cpos(u.x, u.y);
+        do_delete_current_char(false);
+    } else if ((u.type == DELETE_CURRENT_CHAR && undo)
+            || (u.type == DELETE_LEFT_CHAR && undo)
             || (u.type == INSERT_CHAR && !undo)
             || (u.type == INSERT_NEWLINE && !undo)) {
         E.set_cpos(u.x, u.y);
@@ -1382,275 +4820,2034 @@ void do_undo_or_redo(bool undo) {
         int x = u.x;
         int y = u.y;
 
-        if (u.type == INSERT_CHAR) x = u.x+1;
-        else if (u.type == INSERT_NEWLINE) x = 0;
-        if (u.type == INSERT_NEWLINE) y += 1;
+        if (u.type == INSERT_CHAR) x = u.x+1;
+        else if (u.type == INSERT_NEWLINE) x = 0;
+        if (u.type == INSERT_NEWLINE) y += 1;
+
+        if (u.type != DELETE_LEFT_CHAR) E.set_cpos(x, y);
+    } else if ((u.type == CUT_CURSOR_MARK_REGION && undo)
+            || (u.type == PASTE_FROM_CLIPBOARD && !undo)) {
+        E.set_cpos(u.x, u.y);
+        for (int i = 0; i < (int)u.data.size(); i++) {
+            do_insert_char(false, u.data[i]);
+        }
+    } else if ((u.type == PASTE_FROM_CLIPBOARD && undo)
+            || (u.type == CUT_CURSOR_MARK_REGION && !undo)) {
+        E.set_cpos(u.x, u.y);
+        for (int i = 0; i < (int)u.data.size(); i++) {
+            do_delete_current_char(false);
+        }
+    } else if (u.type == OPEN_LINE_BELOW_CURSOR) {
+        E.set_cpos(u.x, u.y);
+        if (undo) {
+            delete_row(u.y+1);
+        } else {
+            do_open_line_below_cursor(false);
+            do_change_mode_to_normal();
+        }
+    } else if (u.type == REPLACE_ROWS) {
+        if (undo) replace_rows(u.y, u.after.size(), u.before, false);
+        else replace_rows(u.y, u.before.size(), u.after, false);
+        int y = u.y < E.numrows() ? u.y : E.lastrow_idx();
+        E.set_cpos(0, y < 0 ? 0 : y);
+    } else if (u.type == AUTOINDENT_JUST_AFTER_NEWLINE) {
+        if (undo) {
+            E.set_cpos(u.x, u.y);
+            while (E.cx != 0) do_delete_left_char(false);
+        } else {
+            // The indent that was inserted, not a fresh one: options
+            // or the rows above may have changed since.
+            row_insert_string(E.get_row_at(u.y), 0, u.data);
+            E.set_cpos(u.data.size(), u.y);
+        }
+    } else {
+        set_cmdline_msg_error("[internal] don't know how to undo last change");
+    }
+}
+
+void undo_up() {
+    const UndoNode& n = E.undo_nodes[E.undo_cur];
+    apply_change(n.change, true);
+    E.undo_cur = n.parent;
+}
+
+void undo_down(int child) {
+    E.undo_nodes[E.undo_cur].redo_child = child;
+    apply_change(E.undo_nodes[child].change, false);
+    E.undo_cur = child;
+}
+
+// Moves the buffer to the state of node `target`.
+void undo_goto(int target) {
+    std::vector<int> down;
+    int b = target;
+    while (E.undo_nodes[b].depth > E.undo_nodes[E.undo_cur].depth) {
+        down.push_back(b);
+        b = E.undo_nodes[b].parent;
+    }
+    while (E.undo_nodes[E.undo_cur].depth > E.undo_nodes[b].depth) undo_up();
+    while (E.undo_cur != b) {
+        undo_up();
+        down.push_back(b);
+        b = E.undo_nodes[b].parent;
+    }
+    for (int i = (int)down.size()-1; i >= 0; i--) undo_down(down[i]);
+}
+
+void do_undo_or_redo(bool undo) {
+    const UndoNode& n = E.undo_nodes[E.undo_cur];
+    if (undo && n.parent == -1) {
+        set_cmdline_msg_error("already at oldest change");
+        return;
+    }
+    if (!undo && n.redo_child == -1) {
+        set_cmdline_msg_error("already at newest change");
+        return;
+    }
+    if (undo) undo_up();
+    else undo_down(n.redo_child);
+}
+
+// Last node made at or before `v`, a `seq` or, if `by_time`, a
+// `time`; the root if there is none.
+int undo_node_at(i64 v, bool by_time) {
+    int lo = 0, hi = E.undo_nodes.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        const UndoNode& n = E.undo_nodes[mid];
+        if ((by_time ? n.time : (i64)n.seq) <= v) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Parses the argument of `earlier`/`later`: a number of changes, or
+// a time such as 30s, 5m or 1h. Empty means one change.
+bool parse_undo_distance(const std::string& s, i64* steps, i64* us) {
+    *steps = 0;
+    *us = 0;
+    if (s == "") {
+        *steps = 1;
+        return true;
+    }
+    char* end;
+    long n = strtol(s.c_str(), &end, 10);
+    if (end == s.c_str() || n < 0) return false;
+    std::string unit = end;
+    if (unit == "") *steps = n;
+    else if (unit == "s") *us = n * 1000000LL;
+    else if (unit == "m") *us = n * 60000000LL;
+    else if (unit == "h") *us = n * 3600000000LL;
+    else return false;
+    return true;
+}
+
+std::string format_age(i64 us) {
+    i64 s = us / 1000000;
+    if (s < 120) return fmt::format("{}s ago", s);
+    if (s < 7200) return fmt::format("{}m ago", s / 60);
+    return fmt::format("{}h ago", s / 3600);
+}
+
+// `earlier`/`later`: moves `arg` changes or that much time back or
+// forward through the states the buffer has been in.
+void undo_travel(const std::string& arg, bool forward) {
+    i64 steps, us;
+    if (!parse_undo_distance(arg, &steps, &us)) {
+        set_cmdline_msg_error("expected a count or a time such as 30s, 5m or 1h");
+        return;
+    }
+    const UndoNode& cur = E.undo_nodes[E.undo_cur];
+    int target;
+    if (us) {
+        target = undo_node_at(forward ? cur.time + us : cur.time - us, true);
+    } else {
+        i64 seq = forward ? (i64)cur.seq + steps : (i64)cur.seq - steps;
+        target = undo_node_at(seq, false);
+    }
+    undo_goto(target);
+
+    const UndoNode& now = E.undo_nodes[E.undo_cur];
+    if (now.parent == -1) {
+        set_cmdline_msg_info("at the oldest change");
+    } else {
+        set_cmdline_msg_info("at change {} of {}, made {}",
+            now.seq, E.undo_seq, format_age(now_us() - now.time));
+    }
+}
+
+void prune_undo_tree() {
+    std::vector<UndoNode>& nodes = E.undo_nodes;
+    int n = nodes.size();
+    std::vector<int> path;
+    std::vector<bool> on_path(n, false);
+    for (int i = E.undo_cur; i != -1; i = nodes[i].parent) {
+        path.push_back(i);
+        on_path[i] = true;
+    }
+    std::reverse(path.begin(), path.end());
+
+    // Parents come before their children.
+    std::vector<usize> subtree(n, 0);
+    for (int i = n-1; i >= 0; i--) {
+        subtree[i] += nodes[i].bytes;
+        if (nodes[i].parent != -1) subtree[nodes[i].parent] += subtree[i];
+    }
+
+    std::vector<bool> drop(n, false);
+    usize bytes = E.undo_bytes;
+    for (int i = 1; i < n && bytes > UNDO_PRUNE_TO; i++) {
+        if (!on_path[i] && on_path[nodes[i].parent]) {
+            drop[i] = true;
+            bytes -= subtree[i];
+        }
+    }
+    // All branches are gone; move the root down the path.
+    usize root = 0;
+    while (bytes > UNDO_PRUNE_TO && root+1 < path.size()) {
+        drop[path[root]] = true;
+        root++;
+        bytes -= nodes[path[root]].bytes;
+    }
+    for (int i = 1; i < n; i++) {
+        if (nodes[i].parent != -1 && drop[nodes[i].parent] && !on_path[i]) drop[i] = true;
+    }
+
+    std::vector<int> index(n, -1);
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (!drop[i]) index[i] = kept++;
+    }
+    for (int i = 0; i < n; i++) {
+        if (drop[i]) continue;
+        UndoNode& node = nodes[index[i]];
+        node = nodes[i];
+        node.parent = node.parent == -1 ? -1 : index[node.parent];
+        node.redo_child = node.redo_child == -1 ? -1 : index[node.redo_child];
+    }
+    nodes.resize(kept);
+    E.undo_cur = index[E.undo_cur];
+
+    if (root > 0) {
+        // Nothing can be undone past the new root.
+        nodes[0].change = UndoInfo();
+        nodes[0].bytes = 0;
+    }
+    E.undo_bytes = 0;
+    for (int i = 0; i < kept; i++) E.undo_bytes += nodes[i].bytes;
+}
+
+// ============= BUILD ==============
+
+// Recognizes `path:line:col: ...` and `path:line: ...`, the
+// format used by gcc, clang and most other compilers.
+bool parse_diagnostic(const std::string& line, QuickfixEntry* qf) {
+    usize colon = line.find(':');
+    if (colon == std::string::npos || colon == 0) return false;
+    std::string path = line.substr(0, colon);
+    // Rules out "In file included from x.h:3:" and make's own
+    // "make: *** ..." lines.
+    if (path.find(' ') != std::string::npos) return false;
+
+    const char* p = line.c_str() + colon + 1;
+    if (!isdigit(*p)) return false;
+    int lineno = 0, col = 0;
+    while (isdigit(*p)) lineno = lineno*10 + (*p++ - '0');
+    if (*p != ':') return false;
+    p++;
+    if (isdigit(*p)) {
+        while (isdigit(*p)) col = col*10 + (*p++ - '0');
+        if (*p != ':') return false;
+    }
+
+    qf->path = path;
+    qf->line = lineno;
+    qf->col = col;
+    return true;
+}
+
+void build_add_line(std::string line) {
+    for (usize i = 0; i < line.size(); i++) {
+        if (line[i] == '\t') line[i] = ' ';
+        else if (iscntrl(line[i])) line[i] = '?';
+    }
+    QuickfixEntry qf;
+    if (parse_diagnostic(line, &qf)) {
+        qf.pane_line = E.build.lines.size();
+        E.build.qf.push_back(qf);
+        E.decos.diag_stale = true;
+    }
+    E.build.lines.push_back(line);
+}
+
+void build_finish() {
+    ev_unwatch(E.build.fd);
+    close(E.build.fd);
+    // The pipe is closed, so the child has exited or is about to.
+    waitpid(E.build.pid, &E.build.exit_status, 0);
+    E.build.pid = -1;
+    E.build.fd = -1;
+    if (E.build.partial.size() != 0) {
+        build_add_line(E.build.partial);
+        E.build.partial.clear();
+    }
+    E.redraw = true;
+}
+
+void on_build_output(int fd) {
+    TRACE_SCOPE("build_output");
+    char buf[64*1024];
+    usize total = 0;
+    while (total < BUILD_READ_BUDGET) {
+        isize nread = read(fd, buf, sizeof(buf));
+        if (nread == 0) {
+            build_finish();
+            return;
+        }
+        if (nread == -1) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            build_finish();
+            return;
+        }
+        total += nread;
+        TRACE_ARG(total);
+
+        const char* p = buf;
+        const char* end = buf + nread;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end-p);
+            if (!nl) {
+                E.build.partial.append(p, end-p);
+                break;
+            }
+            E.build.partial.append(p, nl-p);
+            if (E.build.partial.size() && E.build.partial.back() == '\r') {
+                E.build.partial.pop_back();
+            }
+            build_add_line(E.build.partial);
+            E.build.partial.clear();
+            p = nl+1;
+        }
+    }
+    E.redraw = true;
+}
+
+void build_kill() {
+    if (E.build.pid == -1) return;
+    kill(-E.build.pid, SIGTERM);
+    ev_unwatch(E.build.fd);
+    close(E.build.fd);
+    // A build that ignores SIGTERM must not hang the editor, and
+    // what is left of the group once make exits is not kept.
+    i64 deadline = now_ms() + BUILD_KILL_GRACE_MS;
+    bool reaped = false;
+    while (!(reaped = waitpid(E.build.pid, &E.build.exit_status, WNOHANG) != 0) && now_ms() < deadline) {
+        usleep(10*1000);
+    }
+    kill(-E.build.pid, SIGKILL);
+    if (!reaped) waitpid(E.build.pid, &E.build.exit_status, 0);
+    E.build.pid = -1;
+    E.build.fd = -1;
+}
+
+void build_start(const std::string& args) {
+    build_kill();
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        set_cmdline_msg_error("cannot create pipe: {}", strerror(errno));
+        return;
+    }
+
+    std::string cmd = "make";
+    if (args != "") cmd += " " + args;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        set_cmdline_msg_error("cannot fork: {}", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        // Own process group, so the whole build can be killed.
+        setpgid(0, 0);
+        int devnull = open("/dev/null", O_RDONLY);
+        dup2(devnull, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl("/bin/sh", "sh", "-c", cmd.c_str(), (char*)NULL);
+        _exit(127);
+    }
+
+    // Also here, so the group exists before build_kill can signal
+    // it, whichever of the two runs first.
+    setpgid(pid, pid);
+    close(fds[1]);
+    set_fd_nonblocking(fds[0]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    E.build.open = true;
+    E.build.pid = pid;
+    E.build.fd = fds[0];
+    E.build.exit_status = 0;
+    E.build.cmd = cmd;
+    E.build.lines.clear();
+    E.build.partial.clear();
+    E.build.qf.clear();
+    E.build.qf_idx = -1;
+    E.decos.diag_stale = true;
+    ev_watch(fds[0], on_build_output);
+}
+
+void build_close_pane() {
+    build_kill();
+    E.build.open = false;
+}
+
+bool same_file(const std::string& a, const std::string& b) {
+    if (a == b) return true;
+    char ra[PATH_MAX], rb[PATH_MAX];
+    if (!realpath(a.c_str(), ra) || !realpath(b.c_str(), rb)) return false;
+    return strcmp(ra, rb) == 0;
+}
+
+void jump_to_error(bool next) {
+    int n = E.build.qf.size();
+    if (n == 0) {
+        set_cmdline_msg_error("no errors");
+        return;
+    }
+    int idx = E.build.qf_idx;
+    if (idx == -1) idx = next ? 0 : n-1;
+    else if (next && idx < n-1) idx++;
+    else if (!next && idx > 0) idx--;
+    else {
+        set_cmdline_msg_error(next ? "no more errors" : "no previous errors");
+        return;
+    }
+
+    QuickfixEntry* qf = &E.build.qf[idx];
+    push_jump();
+    if (!same_file(qf->path, E.path)) {
+        if (E.is_dirty()) {
+            set_cmdline_msg_error("unsaved changes, cannot open '{}'", qf->path);
+            return;
+        }
+        close_file();
+        const char* err = open_file(qf->path);
+        if (err) {
+            set_cmdline_msg_error("{}: {}", qf->path, err);
+            return;
+        }
+    }
+
+    E.build.open = true;
+    E.build.qf_idx = idx;
+    int y = qf->line-1;
+    if (y > E.lastrow_idx()) y = E.lastrow_idx();
+    if (y < 0) y = 0;
+    EditorRow* row = E.get_row_at(y);
+    int x = qf->col > 0 ? qf->col-1 : 0;
+    if (!row) x = 0;
+    else if (x > row->len()) x = row->len();
+    E.set_cpos(x, y);
+    set_cmdline_msg_info("{}", E.build.lines[qf->pane_line]);
+}
+
+void do_jump_next_error() {
+    jump_to_error(true);
+}
+
+void do_jump_prev_error() {
+    jump_to_error(false);
+}
+
+// ============= PROFILER ==============
+
+// `profile start [hz]` samples where hed spends CPU time until
+// `profile stop [path]`, which writes the samples as folded stacks
+// (`main;ev_run_once;process_keypress 12`, outermost frame first),
+// the input of flamegraph.pl, inferno and speedscope.
+//
+// SIGPROF fires after every 1/hz s of CPU time used by the process.
+// Its handler copies the interrupted stack into a lock-free ring,
+// which the event loop drains every PROFILER_DRAIN_MS. Addresses
+// are turned into names only when the profile is written, using
+// dladdr; hed is linked with -rdynamic so its own functions resolve.
+
+const int PROFILER_MAX_FRAMES = 64;
+// Must be a power of two.
+const u32 PROFILER_RING_SIZE = 1024;
+// Prime, so sampling doesn't fall into step with periodic work.
+const int PROFILER_DEFAULT_HZ = 997;
+const int PROFILER_DRAIN_MS = 100;
+// Frames captured from inside the handler: the handler itself and
+// the signal trampoline.
+const int PROFILER_SKIP_FRAMES = 2;
+
+struct ProfilerSample {
+    // Bounded MPMC queue sequence number (Vyukov): `pos` when the
+    // slot is free for the producer claiming `pos`, `pos+1` once that
+    // producer has filled it.
+    std::atomic<u32> seq;
+    int depth;
+    void* pcs[PROFILER_MAX_FRAMES];
+};
+
+struct Profiler {
+    bool running;
+    i64 start_ms;
+    ProfilerSample ring[PROFILER_RING_SIZE];
+    // Claimed by handlers, which may run on any thread.
+    std::atomic<u32> head;
+    // Only touched by the event loop.
+    u32 tail;
+    // Samples lost because the ring was full.
+    std::atomic<u32> dropped;
+    // Drained samples per distinct stack, innermost frame first.
+    std::map<std::vector<void*>, u64> stacks;
+    u64 nsamples;
+};
+Profiler PROF;
+
+void profiler_sigprof(int sig) {
+    int saved_errno = errno;
+    u32 pos = PROF.head.load(std::memory_order_relaxed);
+    ProfilerSample* s;
+    while (true) {
+        s = &PROF.ring[pos & (PROFILER_RING_SIZE-1)];
+        i32 dif = (i32)(s->seq.load(std::memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (PROF.head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            PROF.dropped.fetch_add(1, std::memory_order_relaxed);
+            errno = saved_errno;
+            return;
+        } else {
+            pos = PROF.head.load(std::memory_order_relaxed);
+        }
+    }
+    s->depth = backtrace(s->pcs, PROFILER_MAX_FRAMES);
+    s->seq.store(pos+1, std::memory_order_release);
+    errno = saved_errno;
+}
+
+void profiler_drain() {
+    while (true) {
+        ProfilerSample* s = &PROF.ring[PROF.tail & (PROFILER_RING_SIZE-1)];
+        if (s->seq.load(std::memory_order_acquire) != PROF.tail+1) break;
+        if (s->depth > PROFILER_SKIP_FRAMES) {
+            PROF.stacks[std::vector<void*>(s->pcs + PROFILER_SKIP_FRAMES, s->pcs + s->depth)]++;
+            PROF.nsamples++;
+        }
+        s->seq.store(PROF.tail + PROFILER_RING_SIZE, std::memory_order_release);
+        PROF.tail++;
+    }
+}
+
+void on_profiler_drain() {
+    profiler_drain();
+    if (PROF.running) ev_set_timer(on_profiler_drain, PROFILER_DRAIN_MS);
+}
+
+void profiler_set_timer(int hz) {
+    itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = hz ? 1000000 / hz : 0;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+// Returns an error message, or NULL.
+const char* profiler_start(int hz) {
+    if (PROF.running) return "profiler already running";
+    if (hz < 1 || hz > 10000) return "rate must be between 1 and 10000 Hz";
+
+    // The first call loads the unwinder, which must not happen
+    // inside the signal handler.
+    void* warmup[1];
+    backtrace(warmup, 1);
+
+    for (u32 i = 0; i < PROFILER_RING_SIZE; i++) PROF.ring[i].seq.store(i);
+    PROF.head.store(0);
+    PROF.tail = 0;
+    PROF.dropped.store(0);
+    PROF.stacks.clear();
+    PROF.nsamples = 0;
+    PROF.start_ms = now_ms();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profiler_sigprof;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &sa, NULL) == -1) return strerror(errno);
+    profiler_set_timer(hz);
+
+    PROF.running = true;
+    ev_set_timer(on_profiler_drain, PROFILER_DRAIN_MS);
+    return NULL;
+}
+
+std::string profiler_frame_name(void* pc) {
+    Dl_info info;
+    // Return addresses point just past the call instruction; step
+    // back so the call is attributed to the function making it.
+    if (!dladdr((char*)pc - 1, &info)) return fmt::format("{}", pc);
+    if (info.dli_sname) {
+        int status;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+        std::string name = status == 0 ? demangled : info.dli_sname;
+        free(demangled);
+        // Drop the parameter list; overloads fold together.
+        usize paren = name.find('(');
+        if (paren != std::string::npos && paren != 0) name.resize(paren);
+        return name;
+    }
+    // Unexported functions only have an offset, which would split
+    // one function into many frames; name them after their library.
+    const char* file = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    file = file ? file+1 : (info.dli_fname ? info.dli_fname : "unknown");
+    return fmt::format("[{}]", file);
+}
+
+// Stops sampling and writes the folded stacks to `path`. Returns
+// an error message, or NULL.
+const char* profiler_stop(const std::string& path) {
+    if (!PROF.running) return "profiler not running";
+    profiler_set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    ev_cancel_timer(on_profiler_drain);
+    PROF.running = false;
+    profiler_drain();
+
+    std::unordered_map<void*, std::string> names;
+    std::map<std::string, u64> folded;
+    for (std::map<std::vector<void*>, u64>::iterator it = PROF.stacks.begin(); it != PROF.stacks.end(); it++) {
+        std::string line;
+        for (int i = (int)it->first.size()-1; i >= 0; i--) {
+            void* pc = it->first[i];
+            std::unordered_map<void*, std::string>::iterator n = names.find(pc);
+            if (n == names.end()) n = names.insert(std::make_pair(pc, profiler_frame_name(pc))).first;
+            if (line != "") line += ';';
+            line += n->second;
+        }
+        folded[line] += it->second;
+    }
+
+    std::ofstream f(path);
+    if (!f) return "cannot write profile";
+    for (std::map<std::string, u64>::iterator it = folded.begin(); it != folded.end(); it++) {
+        f << it->first << ' ' << it->second << '\n';
+    }
+    if (!f) return "cannot write profile";
+    return NULL;
+}
+
+void do_action(int action, ...) {
+    TRACE_SCOPE("do_action");
+    switch (action) {
+        case CURSOR_UP:                      do_cursor_up(); break;
+        case CURSOR_DOWN:                    do_cursor_down(); break;
+        case CURSOR_LEFT:                    do_cursor_left(); break;
+        case CURSOR_RIGHT:                   do_cursor_right(); break;
+        case CURSOR_LINE_BEGIN:              do_cursor_line_begin(); break;
+        case CURSOR_LINE_END:                do_cursor_line_end(); break;
+        case CHANGE_MODE_TO_NORMAL:          do_change_mode_to_normal(); break;
+        case CHANGE_MODE_TO_INSERT:          do_change_mode_to_insert(); break;
+        case CHANGE_MODE_TO_COMMAND:         do_change_mode_to_command(); break;
+        case CHANGE_MODE_TO_SEARCH:          do_change_mode_to_search(); break;
+        case SET_MARK:                       do_set_mark(); break;
+        case CUT_CURSOR_MARK_REGION:         do_cut_cursor_mark_region(true); break;
+        case CURSOR_FORWARD_WORD:            do_cursor_forward_word(); break;
+        case CURSOR_BACKWARD_WORD:           do_cursor_backward_word(); break;
+        case CURSOR_FIRST_ROW:               do_cursor_first_row(); break;
+        case CURSOR_LAST_ROW:                do_cursor_last_row(); break;
+        case INSERT_NEWLINE:                 do_insert_newline(true, true); break;
+        case DELETE_LEFT_CHAR:               do_delete_left_char(true); break;
+        case DELETE_CURRENT_CHAR:            do_delete_current_char(true); break;
+        case PASTE_FROM_CLIPBOARD:           do_paste_from_clipboard(true); break;
+        case OPEN_LINE_BELOW_CURSOR:         do_open_line_below_cursor(true); break;
+        case SAVE_FILE:                      do_save_file(); break;
+        case EXIT_EDITOR:                    do_exit_editor(); return;
+        case FORCE_EXIT_EDITOR:              do_force_exit_editor(); return;
+        case CURSOR_PAGE_UP:                 do_cursor_page_up(); break;
+        case CURSOR_PAGE_DOWN:               do_cursor_page_down(); break;
+        case CURSOR_PREV_PARA:               do_cursor_prev_para(); break;
+        case CURSOR_NEXT_PARA:               do_cursor_next_para(); break;
+        case REPEAT_SEARCH_FORWARD:          do_repeat_search_forward(); break;
+        case REPEAT_SEARCH_BACKWARD:         do_repeat_search_backward(); break;
+        case INSERT_INDENT:                  do_insert_indent(true); break;
+        case UNDO:                           do_undo_or_redo(true); break;
+        case REDO:                           do_undo_or_redo(false); break;
+        case JUMP_NEXT_ERROR:                do_jump_next_error(); break;
+        case JUMP_PREV_ERROR:                do_jump_prev_error(); break;
+        case JUMP_BACK:                      do_jump_back(); break;
+        case JUMP_FORWARD:                   do_jump_forward(); break;
+        case TOGGLE_BOOKMARK:                do_toggle_bookmark(); break;
+        case NEXT_BOOKMARK:                  do_next_bookmark(); break;
+        case PREV_BOOKMARK:                  do_prev_bookmark(); break;
+        case INDENT_ROW:                     do_indent_rows(1, false); break;
+        case OUTDENT_ROW:                    do_indent_rows(-1, false); break;
+        case REINDENT_ROW:                   do_indent_rows(0, false); break;
+        case INDENT_CURSOR_MARK_REGION:      do_indent_rows(1, true); break;
+        case OUTDENT_CURSOR_MARK_REGION:     do_indent_rows(-1, true); break;
+        case REINDENT_CURSOR_MARK_REGION:    do_indent_rows(0, true); break;
+        case INSERT_CHAR: {
+            va_list args;
+            va_start(args, action);
+            int c = va_arg(args, int);
+            va_end(args);
+            do_insert_char(true, c);
+            reindent_after_close(c);
+        } break;
+    }
+
+    EditorRow* row = E.get_row_at(E.cy);
+    int rowlen = row ? row->len() : 0;
+    if (E.cx > rowlen) {
+        E.cx = rowlen;
+    }
+
+    E.quit_times = NUM_FORCE_QUIT_PRESS;
+    clear_search_match();
+}
+
+// ============= COMMANDS ==============
+
+// A command line is
+//
+//     [range] name [args...]
+//
+// where range is `addr` or `addr,addr` (`%` for the whole file), and
+// an address is a line number, `.` (cursor row), `$` (last row) or
+// `'a`..`'z` (a named mark; `'m` is the mark regions run to),
+// optionally followed by `+N`/`-N`. Arguments are
+// separated by spaces; "double" or 'single' quotes group words, and
+// inside double quotes `\"`, `\\`, `\t` and `\n` are escapes.
+//
+// A range on its own jumps to its last line.
+
+struct CommandParser;
+typedef void (*CommandFn)(CommandParser* p);
+
+// Argument signature characters.
+#define ARG_STRING 's'
+#define ARG_INT 'i'
+#define ARG_PATH 'p'
+#define ARG_VAR 'v'
+// Arguments after this one may be left out.
+#define ARG_OPTIONAL '?'
+// Signature of commands that get everything after their name,
+// unparsed, as their only argument (which may be empty).
+#define CMD_RAW_ARGS "*"
+
+struct CommandInfo {
+    std::string name;
+    // One ARG_* character per argument, or CMD_RAW_ARGS.
+    const char* args;
+    std::string* flags;
+    // Usable in `--batch` scripts.
+    bool batch;
+    // Accepts a line range; the default range is the whole file.
+    bool range;
+    CommandFn run;
+    // Subcommands: what the first argument completes to.
+    std::string* subcommands;
+};
+
+// The argument kinds of signature `sig`, without ARG_OPTIONAL, and
+// how many of them are required.
+std::string arg_kinds(const char* sig, int* required) {
+    std::string kinds;
+    *required = -1;
+    for (const char* c = sig; *c; c++) {
+        if (*c == ARG_OPTIONAL) *required = kinds.size();
+        else kinds += *c;
+    }
+    if (*required == -1) *required = kinds.size();
+    return kinds;
+}
+
+struct CommandParser {
+    std::string name;
+    std::vector<std::string> args;
+    // Parsed value of each ARG_INT argument, 0 for other kinds.
+    std::vector<long> ints;
+    std::vector<std::string> flags;
+    CommandInfo* entry = NULL;
+    bool has_range = false;
+    // 0-based, inclusive.
+    int line1 = 0, line2 = 0;
+
+    bool parse(const std::string& cmd);
+
+    bool flag_set(const std::string& flag) {
+        for (usize i = 0; i < flags.size(); i++) {
+            if (flags[i] == flag) return true;
+        }
+        return false;
+    }
+};
+
+// Parses one address at `*p` into a 0-based row. Returns false
+// with an error message set if it is malformed.
+bool parse_address(const char** p, int* row, bool* found) {
+    const char* s = *p;
+    *found = true;
+    if (*s == '.') {
+        *row = E.cy;
+        s++;
+    } else if (*s == '$') {
+        *row = E.lastrow_idx();
+        s++;
+    } else if (*s == '\'' && valid_mark_name(s[1])) {
+        int x;
+        if (!get_named_mark(s[1], &x, row)) {
+            set_cmdline_msg_error("mark '{}' not set", s[1]);
+            return false;
+        }
+        s += 2;
+    } else if (isdigit(*s)) {
+        long n = strtol(s, (char**)&s, 10);
+        *row = n-1;
+    } else if (*s == '+' || *s == '-') {
+        *row = E.cy;
+    } else {
+        *found = false;
+        return true;
+    }
 
-        if (u.type != DELETE_LEFT_CHAR) E.set_cpos(x, y);
-    } else if ((u.type == CUT_CURSOR_MARK_REGION && undo)
-            || (u.type == PASTE_FROM_CLIPBOARD && !undo)) {
-        E.set_cpos(u.x, u.y);
-        for (int i = 0; i < (int)u.data.size(); i++) {
-            do_insert_char(false, u.data[i]);
+    while (*s == '+' || *s == '-') {
+        int sign = *s == '+' ? 1 : -1;
+        s++;
+        if (!isdigit(*s)) {
+            set_cmdline_msg_error("expected a number after '{}'", sign > 0 ? '+' : '-');
+            return false;
         }
-    } else if ((u.type == PASTE_FROM_CLIPBOARD && undo)
-            || (u.type == CUT_CURSOR_MARK_REGION && !undo)) {
-        E.set_cpos(u.x, u.y);
-        for (int i = 0; i < (int)u.data.size(); i++) {
-            do_delete_current_char(false);
+        *row += sign * strtol(s, (char**)&s, 10);
+    }
+    *p = s;
+    return true;
+}
+
+// Splits `s` into words, honoring quotes. `quoted[i]` tells whether
+// word `i` was quoted, so that it is never taken as a flag.
+bool split_command_args(const std::string& s, std::vector<std::string>* words, std::vector<bool>* quoted) {
+    usize i = 0;
+    while (i < s.size()) {
+        while (i < s.size() && s[i] == ' ') i++;
+        if (i == s.size()) break;
+
+        std::string word;
+        bool was_quoted = false;
+        while (i < s.size() && s[i] != ' ') {
+            char q = s[i];
+            if (q != '"' && q != '\'') {
+                word += s[i++];
+                continue;
+            }
+            was_quoted = true;
+            i++;
+            while (i < s.size() && s[i] != q) {
+                if (q == '"' && s[i] == '\\' && i+1 < s.size()) {
+                    i++;
+                    switch (s[i]) {
+                        case 't': word += '\t'; break;
+                        case 'n': word += '\n'; break;
+                        default: word += s[i]; break;
+                    }
+                    i++;
+                } else {
+                    word += s[i++];
+                }
+            }
+            if (i == s.size()) {
+                set_cmdline_msg_error("unterminated quote");
+                return false;
+            }
+            i++;
         }
-    } else if (u.type == OPEN_LINE_BELOW_CURSOR) {
-        E.set_cpos(u.x, u.y);
-        if (undo) {
-            delete_row(u.y+1);
-        } else {
-            do_open_line_below_cursor(false);
-            do_change_mode_to_normal();
+        words->push_back(word);
+        quoted->push_back(was_quoted);
+    }
+    return true;
+}
+
+std::string set_vars[] = { "path", "" };
+
+void cmd_exit(CommandParser* p) {
+    if (p->flag_set("--force")) {
+        do_action(FORCE_EXIT_EDITOR);
+    } else {
+        do_action(EXIT_EDITOR);
+    }
+}
+
+void set_variable(CommandParser* p, bool global) {
+    if (p->args[0] == "path") {
+        set_path(p->args[1]);
+        return;
+    }
+    std::string err;
+    if (!set_option(p->args[0], p->args[1], global, &err)) {
+        set_cmdline_msg_error("{}", err);
+    }
+}
+
+void cmd_set(CommandParser* p) {
+    set_variable(p, true);
+}
+
+void cmd_setlocal(CommandParser* p) {
+    set_variable(p, false);
+}
+
+void cmd_edit(CommandParser* p) {
+    if (E.is_dirty()) {
+        set_cmdline_msg_error("unsaved changes, cannot open '{}'", p->args[0]);
+        return;
+    }
+    close_file();
+    const char* err = open_file(p->args[0]);
+    if (err) set_cmdline_msg_error("{}: {}", p->args[0], err);
+}
+
+void cmd_make(CommandParser* p) {
+    build_start(p->args[0]);
+}
+
+void cmd_cnext(CommandParser* p) {
+    do_action(JUMP_NEXT_ERROR);
+}
+
+void cmd_cprev(CommandParser* p) {
+    do_action(JUMP_PREV_ERROR);
+}
+
+void cmd_cclose(CommandParser* p) {
+    build_close_pane();
+}
+
+void cmd_earlier(CommandParser* p) {
+    undo_travel(p->args[0], false);
+}
+
+void cmd_later(CommandParser* p) {
+    undo_travel(p->args[0], true);
+}
+
+void cmd_mark(CommandParser* p) {
+    const std::string& name = p->args[0];
+    if (name.size() != 1 || !valid_mark_name(name[0])) {
+        set_cmdline_msg_error("mark names are a to z");
+        return;
+    }
+    set_named_mark(name[0], E.cx, E.cy);
+}
+
+void cmd_marks(CommandParser* p) {
+    std::string list;
+    for (char c = 'a'; c <= 'z'; c++) {
+        int x, y;
+        if (!get_named_mark(c, &x, &y)) continue;
+        if (list != "") list += "  ";
+        list += fmt::format("{} {}:{}", c, y+1, x+1);
+    }
+    if (list == "") set_cmdline_msg_info("no marks set");
+    else set_cmdline_msg_info("{}", list);
+}
+
+std::string stats_subcommands[] = { "highlight", "intern", "cold", "output", "" };
+
+// `stats [section]`: one section per message, so each fits on the
+// command line.
+void cmd_stats(CommandParser* p) {
+    std::string arg = p->args.size() != 0 ? p->args[0] : "";
+    if (arg == "" || arg == "highlight") {
+        u64 lookups = HLC.hits + HLC.misses;
+        set_cmdline_msg_info("highlight cache: {} lines, {} hits, {} misses ({:.1f}% hit), {} evicted",
+            HLC.lines.size(), HLC.hits, HLC.misses,
+            lookups ? 100.0 * HLC.hits / lookups : 0.0, HLC.evictions);
+    } else if (arg == "intern") {
+        usize rows, saved;
+        interned_savings(&rows, &saved);
+        set_cmdline_msg_info("interning{}: {} rows share {} texts, {} KB saved",
+            E.global_opts.intern ? "" : " (off)", rows, E.interned.size(), saved / 1024);
+    } else if (arg == "cold") {
+        usize packed = 0, resident_blocks = 0;
+        for (usize i = 0; i < E.cold.blocks.size(); i++) {
+            packed += E.cold.blocks[i]->packed.size();
+            if (E.cold.blocks[i]->resident) resident_blocks++;
         }
-    } else if (u.type == AUTOINDENT_JUST_AFTER_NEWLINE) {
-        if (undo) {
-            E.set_cpos(u.x, u.y);
-            while (E.cx != 0) do_delete_left_char(false);
+        set_cmdline_msg_info("text: {} KB, {} cold blocks ({} loaded) in {} KB, {} loads",
+            text_bytes() / 1024, E.cold.blocks.size(), resident_blocks, packed / 1024, E.cold.loads);
+    } else if (arg == "output") {
+        set_cmdline_msg_info("output: {} frames, {} stalled writes, {} keys handled while behind",
+            OUT.frames, OUT.partial_writes, OUT.keys_behind);
+    } else {
+        set_cmdline_msg_error("usage: stats [highlight|intern|cold|output]");
+    }
+}
+
+// `mem` shows the largest categories, `mem path` writes the whole
+// report to `path`.
+void cmd_mem(CommandParser* p) {
+    if (p->args.size() != 0) {
+        const std::string& path = p->args[0];
+        std::ofstream f(path);
+        if (f) f << mem_report();
+        if (!f) set_cmdline_msg_error("cannot write {}", path);
+        else set_cmdline_msg_info("memory report written to {}", path);
+        return;
+    }
+    mem_measure();
+    int order[NUM_MEM_CATEGORIES];
+    i64 total = 0, allocs = 0;
+    for (int c = 0; c < NUM_MEM_CATEGORIES; c++) {
+        order[c] = c;
+        total += MEM[c].bytes;
+        allocs += MEM[c].allocs;
+    }
+    for (int i = 1; i < NUM_MEM_CATEGORIES; i++) {
+        for (int j = i; j > 0 && MEM[order[j]].bytes > MEM[order[j-1]].bytes; j--) std::swap(order[j], order[j-1]);
+    }
+    std::string msg = fmt::format("{} in {} allocations", mem_size(total), allocs);
+    for (int i = 0; i < NUM_MEM_CATEGORIES && MEM[order[i]].bytes > 0; i++) {
+        msg += fmt::format("{} {} {}", i ? "," : ":", MEM_NAMES[order[i]], mem_size(MEM[order[i]].bytes));
+    }
+    set_cmdline_msg_info("{}", msg);
+}
+
+std::string terminal_subcommands[] = { "detect", "" };
+
+// `terminal` shows what was detected, `terminal detect` detects
+// again.
+void cmd_terminal(CommandParser* p) {
+    std::string arg = p->args.size() != 0 ? p->args[0] : "";
+    if (arg == "detect") {
+        std::string path = term_cache_path();
+        if (path != "") unlink(path.c_str());
+        term_load();
+        term_query();
+        set_cmdline_msg_info("detecting terminal capabilities");
+        return;
+    } else if (arg != "") {
+        set_cmdline_msg_error("usage: terminal [detect]");
+        return;
+    }
+    std::string caps = fmt::format("{} colors", TC.colors);
+    if (TC.rep) caps += ", rep";
+    if (TC.cuf) caps += ", cuf";
+    if (TC.sync) caps += ", sync";
+    set_cmdline_msg_info("{}{}: {}{}", TC.key, TC.version != "" ? " (" + TC.version + ")" : "",
+        caps, TC.querying ? ", detecting" : TC.from_cache ? ", cached" : "");
+}
+
+std::string start_stop_subcommands[] = { "start", "stop", "" };
+
+// `profile start [hz]`, `profile stop [path]`.
+void cmd_profile(CommandParser* p) {
+    std::string what = p->args[0];
+    std::string arg = p->args.size() > 1 ? p->args[1] : "";
+    if (what == "start") {
+        long hz = PROFILER_DEFAULT_HZ;
+        if (arg != "") {
+            char* end;
+            hz = strtol(arg.c_str(), &end, 10);
+            if (*end != '\0') {
+                set_cmdline_msg_error("expected a number, got '{}'", arg);
+                return;
+            }
+        }
+        const char* err = profiler_start(hz);
+        if (err) set_cmdline_msg_error("{}", err);
+        else set_cmdline_msg_info("profiling at {} Hz", hz);
+    } else if (what == "stop") {
+        std::string path = arg != "" ? arg : fmt::format("hed-{}.folded", getpid());
+        const char* err = profiler_stop(path);
+        if (err) set_cmdline_msg_error("{}", err);
+        else set_cmdline_msg_info("{} samples over {:.1f}s ({} dropped) written to {}",
+                PROF.nsamples, (now_ms() - PROF.start_ms) / 1000.0, PROF.dropped.load(), path);
+    } else {
+        set_cmdline_msg_error("usage: profile start [hz] | profile stop [path]");
+    }
+}
+
+// `trace start`, `trace stop [path]`.
+void cmd_trace(CommandParser* p) {
+    std::string what = p->args[0];
+    std::string arg = p->args.size() > 1 ? p->args[1] : "";
+    if (what == "start" && p->args.size() == 1) {
+        const char* err = trace_start();
+        if (err) set_cmdline_msg_error("{}", err);
+        else set_cmdline_msg_info("tracing");
+    } else if (what == "stop") {
+        std::string path = arg != "" ? arg : fmt::format("hed-{}.trace.json", getpid());
+        u64 n;
+        const char* err = trace_stop(path, &n);
+        if (err) set_cmdline_msg_error("{}", err);
+        else set_cmdline_msg_info("{} events written to {}", n, path);
+    } else {
+        set_cmdline_msg_error("usage: trace start | trace stop [path]");
+    }
+}
+
+void cmd_trim(CommandParser* p) {
+    if (E.numrows() == 0) return;
+    int n = transform_rows(p->line1, p->line2, transform_trim, NULL, !E.batch);
+    set_cmdline_msg_info("{} rows trimmed", n);
+}
+
+void cmd_replace(CommandParser* p) {
+    if (E.numrows() == 0) return;
+    if (p->args[0] == "") {
+        set_cmdline_msg_error("empty search text");
+        return;
+    }
+    ReplaceArgs r = { p->args[0], p->args[1] };
+    int n = transform_rows(p->line1, p->line2, transform_replace, &r, !E.batch);
+    set_cmdline_msg_info("{} rows changed", n);
+}
+
+void cmd_sort(CommandParser* p) {
+    if (E.numrows() == 0) return;
+    std::vector<std::string> rows;
+    ColdScan scan = { NULL };
+    for (int i = p->line1; i <= p->line2; i++) rows.push_back(cold_scan_text(&scan, E.rows[i])->data);
+    std::sort(rows.begin(), rows.end());
+    replace_rows(p->line1, rows.size(), rows, !E.batch);
+}
+
+void cmd_indent(CommandParser* p) {
+    if (E.numrows() == 0) return;
+    int levels = p->ints[0];
+    int n = shift_rows(p->line1, p->line2, levels, !E.batch);
+    set_cmdline_msg_info("{} rows indented", n);
+}
+
+void cmd_reindent(CommandParser* p) {
+    if (E.numrows() == 0) return;
+    if (!E.syn) {
+        set_cmdline_msg_error("no indent rules for this file type");
+        return;
+    }
+    int n = reindent_rows(p->line1, p->line2, !E.batch);
+    set_cmdline_msg_info("{} rows reindented", n);
+}
+
+std::string exit_flags[] = { "--force", "" };
+
+CommandInfo CMDDB[] = {
+    { "exit", "", exit_flags, false, false, cmd_exit, NULL },
+    { "set", "vs", NULL, true, false, cmd_set, NULL },
+    { "setlocal", "vs", NULL, true, false, cmd_setlocal, NULL },
+    { "edit", "p", NULL, false, false, cmd_edit, NULL },
+    { "make", CMD_RAW_ARGS, NULL, false, false, cmd_make, NULL },
+    { "cnext", "", NULL, false, false, cmd_cnext, NULL },
+    { "cprev", "", NULL, false, false, cmd_cprev, NULL },
+    { "cclose", "", NULL, false, false, cmd_cclose, NULL },
+    { "earlier", CMD_RAW_ARGS, NULL, false, false, cmd_earlier, NULL },
+    { "later", CMD_RAW_ARGS, NULL, false, false, cmd_later, NULL },
+    { "mark", "s", NULL, false, false, cmd_mark, NULL },
+    { "marks", "", NULL, false, false, cmd_marks, NULL },
+    { "stats", "?s", NULL, false, false, cmd_stats, stats_subcommands },
+    { "mem", "?p", NULL, false, false, cmd_mem, NULL },
+    { "terminal", "?s", NULL, false, false, cmd_terminal, terminal_subcommands },
+    { "profile", "s?p", NULL, false, false, cmd_profile, start_stop_subcommands },
+    { "trace", "s?p", NULL, false, false, cmd_trace, start_stop_subcommands },
+    { "trim", "", NULL, true, true, cmd_trim, NULL },
+    { "replace", "ss", NULL, true, true, cmd_replace, NULL },
+    { "sort", "", NULL, true, true, cmd_sort, NULL },
+    { "indent", "i", NULL, true, true, cmd_indent, NULL },
+    { "reindent", "", NULL, true, true, cmd_reindent, NULL },
+};
+#define NUM_CMDDB (sizeof(CMDDB) / sizeof(CMDDB[0]))
+
+std::unordered_map<std::string, CommandInfo*> CMD_INDEX;
+
+CommandInfo* find_command(const std::string& name) {
+    if (CMD_INDEX.size() == 0) {
+        for (usize i = 0; i < NUM_CMDDB; i++) CMD_INDEX[CMDDB[i].name] = &CMDDB[i];
+    }
+    std::unordered_map<std::string, CommandInfo*>::iterator it = CMD_INDEX.find(name);
+    return it == CMD_INDEX.end() ? NULL : it->second;
+}
+
+bool CommandParser::parse(const std::string& cmd) {
+    std::string cmd_nows = cmd;
+    str_trim_leading_ws(cmd_nows);
+    str_trim_trailing_ws(cmd_nows);
+
+    if (cmd_nows == "") {
+        set_cmdline_msg_error("empty command");
+        return false;
+    };
+
+    const char* p = cmd_nows.c_str();
+    if (*p == '%') {
+        has_range = true;
+        line1 = 0;
+        line2 = E.lastrow_idx();
+        p++;
+    } else {
+        bool found;
+        if (!parse_address(&p, &line1, &found)) return false;
+        if (found) {
+            has_range = true;
+            line2 = line1;
+            if (*p == ',') {
+                p++;
+                if (!parse_address(&p, &line2, &found)) return false;
+                if (!found) {
+                    set_cmdline_msg_error("expected an address after ','");
+                    return false;
+                }
+            }
+        }
+    }
+    if (has_range) {
+        if (line1 > line2) std::swap(line1, line2);
+        if (line1 < 0 || line2 > E.lastrow_idx()) {
+            set_cmdline_msg_error("range out of bounds");
+            return false;
+        }
+    }
+    while (*p == ' ') p++;
+
+    const char* name_end = p;
+    while (*name_end && *name_end != ' ') name_end++;
+    name = std::string(p, name_end);
+    std::string rest = name_end;
+
+    if (name == "" && has_range) return true;
+
+    entry = find_command(name);
+    if (!entry) {
+        set_cmdline_msg_error("unknown command '{}'", name);
+        return false;
+    }
+
+    if (E.batch && !entry->batch) {
+        set_cmdline_msg_error("command '{}' not available in batch mode", name);
+        return false;
+    }
+
+    if (has_range && !entry->range) {
+        set_cmdline_msg_error("command '{}' takes no range", name);
+        return false;
+    }
+    if (!has_range) {
+        line1 = 0;
+        line2 = E.lastrow_idx();
+    }
+
+    if (!strcmp(entry->args, CMD_RAW_ARGS)) {
+        str_trim_leading_ws(rest);
+        args.push_back(rest);
+        return true;
+    }
+
+    std::vector<std::string> words;
+    std::vector<bool> quoted;
+    if (!split_command_args(rest, &words, &quoted)) return false;
+    for (usize i = 0; i < words.size(); i++) {
+        if (!quoted[i] && str_startswith(words[i], "--")) flags.push_back(words[i]);
+        else args.push_back(words[i]);
+    }
+
+    int required;
+    std::string kinds = arg_kinds(entry->args, &required);
+    if ((int)args.size() < required || args.size() > kinds.size()) {
+        if (required == (int)kinds.size()) set_cmdline_msg_error("expected {} args, got {}", required, args.size());
+        else set_cmdline_msg_error("expected {} to {} args, got {}", required, kinds.size(), args.size());
+        return false;
+    }
+
+    for (usize i = 0; i < args.size(); i++) {
+        long value = 0;
+        if (kinds[i] == ARG_INT) {
+            char* end;
+            value = strtol(args[i].c_str(), &end, 10);
+            if (args[i] == "" || *end != '\0') {
+                set_cmdline_msg_error("expected a number, got '{}'", args[i]);
+                return false;
+            }
+        }
+        ints.push_back(value);
+    }
+
+    if (!entry->flags && flags.size() != 0) {
+        set_cmdline_msg_error("unknown flag '{}'", flags[0]);
+        return false;
+    } else {
+        for (usize i = 0; i < flags.size(); i++) {
+            bool found = false;
+            for (usize j = 0; entry->flags[j] != ""; j++) {
+                if (flags[i] == entry->flags[j]) {
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                set_cmdline_msg_error("unknown flag '{}'", flags[i]);
+                // We don't check all flags and exit early, because we
+                // can only show one error at a time.
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void parse_and_run_command(const std::string& cmd) {
+    TRACE_SCOPE("command");
+    CommandParser parser;
+    if (!parser.parse(cmd)) return;
+
+    if (!parser.entry) {
+        push_jump();
+        E.set_cpos(0, parser.line2);
+        return;
+    }
+    parser.entry->run(&parser);
+}
+
+// ============= COMPLETION ==============
+
+void complete_from_list(std::string* list, const std::string& prefix, std::vector<std::string>* out) {
+    for (int i = 0; list[i] != ""; i++) {
+        if (str_startswith(list[i], prefix)) out->push_back(list[i]);
+    }
+}
+
+void complete_path(const std::string& prefix, std::vector<std::string>* out) {
+    usize slash = prefix.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : prefix.substr(0, slash+1);
+    std::string base = slash == std::string::npos ? prefix : prefix.substr(slash+1);
+
+    DIR* d = opendir(dir == "" ? "." : dir.c_str());
+    if (!d) return;
+    dirent* ent;
+    while ((ent = readdir(d))) {
+        std::string name = ent->d_name;
+        if (name == "." || name == "..") continue;
+        if (name[0] == '.' && (base == "" || base[0] != '.')) continue;
+        if (!str_startswith(name, base)) continue;
+        std::string full = dir + name;
+        struct stat st;
+        if (stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) full += '/';
+        out->push_back(full);
+    }
+    closedir(d);
+}
+
+// Computes what the word before the cursor could complete to.
+// Sets `*start` to where that word begins in the command line.
+void command_completions(const std::string& line, usize* start, std::vector<std::string>* out) {
+    const char* p = line.c_str();
+    if (*p == '%') p++;
+    else {
+        // Errors are not shown in command mode, so a malformed range
+        // just means no completions.
+        int row;
+        bool found;
+        parse_address(&p, &row, &found);
+        if (*p == ',') {
+            p++;
+            parse_address(&p, &row, &found);
+        }
+    }
+    while (*p == ' ') p++;
+
+    const char* name_end = p;
+    while (*name_end && *name_end != ' ') name_end++;
+    if (*name_end == '\0') {
+        *start = p - line.c_str();
+        std::string prefix = p;
+        for (usize i = 0; i < NUM_CMDDB; i++) {
+            if (str_startswith(CMDDB[i].name, prefix)) out->push_back(CMDDB[i].name);
+        }
+        std::sort(out->begin(), out->end());
+        return;
+    }
+
+    CommandInfo* entry = find_command(std::string(p, name_end));
+    if (!entry || !strcmp(entry->args, CMD_RAW_ARGS)) return;
+
+    // Index of the argument being typed, not counting flags.
+    int argi = 0;
+    const char* q = name_end;
+    const char* word = q;
+    while (*q) {
+        while (*q == ' ') q++;
+        word = q;
+        while (*q && *q != ' ') q++;
+        if (*q == ' ' && !str_startswith(std::string(word, q), "--")) argi++;
+    }
+    if (q != word && str_startswith(word, "--")) {
+        *start = word - line.c_str();
+        if (entry->flags) complete_from_list(entry->flags, word, out);
+        return;
+    }
+    int required;
+    std::string kinds = arg_kinds(entry->args, &required);
+    if (argi >= (int)kinds.size()) return;
+
+    *start = word - line.c_str();
+    if (argi == 0 && entry->subcommands) {
+        complete_from_list(entry->subcommands, word, out);
+        std::sort(out->begin(), out->end());
+        return;
+    }
+    switch (kinds[argi]) {
+        case ARG_PATH: complete_path(word, out); break;
+        case ARG_VAR:
+            complete_from_list(set_vars, word, out);
+            for (usize i = 0; i < NUM_SETTINGS; i++) {
+                if (str_startswith(SETTINGS[i].name, word)) out->push_back(SETTINGS[i].name);
+            }
+            break;
+        default: break;
+    }
+    std::sort(out->begin(), out->end());
+}
+
+// First Tab completes the word before the cursor to the first
+// match; further Tabs cycle through the rest.
+void do_complete_command() {
+    if (E.cmdx != E.cmdline_len()) return;
+    Completion* c = &E.compl_state;
+
+    if (c->matches.size() == 0 || E.cmdline != c->shown) {
+        c->matches.clear();
+        c->idx = -1;
+        c->start = 0;
+        command_completions(E.cmdline, &c->start, &c->matches);
+        if (c->matches.size() == 0) return;
+    }
+
+    c->idx = (c->idx + 1) % c->matches.size();
+    E.cmdline = E.cmdline.substr(0, c->start) + c->matches[c->idx];
+    E.cmdx = E.cmdline_len();
+    c->shown = E.cmdline;
+    if (c->matches.size() == 1) {
+        // Nothing to cycle through; the next Tab starts over, which
+        // descends into a completed directory.
+        if (E.cmdline.back() != '/') E.cmdline += ' ';
+        E.cmdx = E.cmdline_len();
+        c->matches.clear();
+    }
+}
+
+// ============= HISTORY ==============
+
+std::string history_path() {
+    const char* xdg = getenv("XDG_STATE_HOME");
+    if (xdg && *xdg) return std::string(xdg) + "/hed/history";
+    const char* home = getenv("HOME");
+    if (home && *home) return std::string(home) + "/.local/state/hed/history";
+    return "";
+}
+
+void mkdir_parents(const std::string& path) {
+    for (usize i = 1; i < path.size(); i++) {
+        if (path[i] == '/') mkdir(path.substr(0, i).c_str(), 0755);
+    }
+}
+
+void history_add(History* h, char kind, const std::string& entry) {
+    if (entry == "") return;
+    for (usize i = 0; i < h->entries.size(); i++) {
+        if (h->entries[i] == entry) {
+            h->entries.erase(h->entries.begin() + i);
+            break;
+        }
+    }
+    h->entries.push_back(entry);
+    if ((int)h->entries.size() > HISTORY_MAX) h->entries.erase(h->entries.begin());
+
+    if (E.batch) return;
+    std::string path = history_path();
+    if (path == "") return;
+    mkdir_parents(path);
+    std::ofstream f(path, std::ios_base::app);
+    f << kind << entry << '\n';
+}
+
+// Entries are stored one per line, prefixed with ':' or '/'. The
+// file is appended to as entries are added and compacted here once
+// it holds much more than we keep.
+void history_load() {
+    std::string path = history_path();
+    std::ifstream f(path);
+    if (path == "" || !f) return;
+    std::string line;
+    int lines = 0;
+    while (std::getline(f, line)) {
+        lines++;
+        if (line.size() < 2) continue;
+        History* h = line[0] == ':' ? &E.cmd_history : line[0] == '/' ? &E.search_history : NULL;
+        if (!h) continue;
+        std::string entry = line.substr(1);
+        for (usize i = 0; i < h->entries.size(); i++) {
+            if (h->entries[i] == entry) {
+                h->entries.erase(h->entries.begin() + i);
+                break;
+            }
+        }
+        h->entries.push_back(entry);
+        if ((int)h->entries.size() > HISTORY_MAX) h->entries.erase(h->entries.begin());
+    }
+    f.close();
+
+    if (lines > 4*HISTORY_MAX) {
+        std::ofstream out(path, std::ios_base::trunc);
+        for (usize i = 0; i < E.cmd_history.entries.size(); i++) out << ':' << E.cmd_history.entries[i] << '\n';
+        for (usize i = 0; i < E.search_history.entries.size(); i++) out << '/' << E.search_history.entries[i] << '\n';
+    }
+}
+
+void history_move(bool older) {
+    History* h = E.mode == COMMAND ? &E.cmd_history : &E.search_history;
+    int n = h->entries.size();
+    if (h->pos == -1) {
+        if (!older || n == 0) return;
+        h->pending = E.cmdline;
+        h->pos = n;
+    }
+    if (older) {
+        if (h->pos == 0) return;
+        h->pos--;
+        E.cmdline = h->entries[h->pos];
+    } else {
+        h->pos++;
+        if (h->pos >= n) {
+            E.cmdline = h->pending;
+            h->pos = -1;
         } else {
-            E.set_cpos(0, u.y);
-            autoindent_just_after_newline(false);
+            E.cmdline = h->entries[h->pos];
         }
-    } else {
-        set_cmdline_msg_error("[internal] don't know how to undo last change");
     }
+    E.cmdx = E.cmdline_len();
+    E.cmdoff = 0;
+}
 
-    if (undo && E.undo_pos == -1) E.dirty = false;
+// ============= MOUSE ==============
+
+// Clicking moves the cursor, dragging with the left button sets the
+// mark where the drag started and selects up to the pointer, and the
+// wheel scrolls. The reports read at once are handled as one input,
+// so a burst of wheel events from a trackpad scrolls once by their
+// sum and is drawn as one frame.
+
+const int MOUSE_WHEEL_ROWS = 3;
+const int MOUSE_BUTTON_MASK = 3;
+const int MOUSE_LEFT = 0;
+const int MOUSE_MOTION = 32;
+const int MOUSE_WHEEL = 64;
+
+// Buffer position of screen cell `x`, `y`. False outside the text.
+bool mouse_to_buffer(int x, int y, int* cx, int* cy) {
+    if (y < 0 || y >= E.textrows() || E.numrows() == 0) return false;
+    *cy = std::min(E.rowoff + y, E.lastrow_idx());
+    *cx = row_rx_to_cx(E.get_row_at(*cy), E.coloff + x);
+    return true;
 }
 
-void do_action(int action, ...) {
-    switch (action) {
-        case CURSOR_UP:                      do_cursor_up(); break;
-        case CURSOR_DOWN:                    do_cursor_down(); break;
-        case CURSOR_LEFT:                    do_cursor_left(); break;
-        case CURSOR_RIGHT:                   do_cursor_right(); break;
-        case CURSOR_LINE_BEGIN:              do_cursor_line_begin(); break;
-        case CURSOR_LINE_END:                do_cursor_line_end(); break;
-        case CHANGE_MODE_TO_NORMAL:          do_change_mode_to_normal(); break;
-        case CHANGE_MODE_TO_INSERT:          do_change_mode_to_insert(); break;
-        case CHANGE_MODE_TO_COMMAND:         do_change_mode_to_command(); break;
-        case CHANGE_MODE_TO_SEARCH:          do_change_mode_to_search(); break;
-        case SET_MARK:                       do_set_mark(); break;
-        case CUT_CURSOR_MARK_REGION:         do_cut_cursor_mark_region(true); break;
-        case CURSOR_FORWARD_WORD:            do_cursor_forward_word(); break;
-        case CURSOR_BACKWARD_WORD:           do_cursor_backward_word(); break;
-        case CURSOR_FIRST_ROW:               do_cursor_first_row(); break;
-        case CURSOR_LAST_ROW:                do_cursor_last_row(); break;
-        case INSERT_NEWLINE:                 do_insert_newline(true, true); break;
-        case DELETE_LEFT_CHAR:               do_delete_left_char(true); break;
-        case DELETE_CURRENT_CHAR:            do_delete_current_char(true); break;
-        case PASTE_FROM_CLIPBOARD:           do_paste_from_clipboard(true); break;
-        case OPEN_LINE_BELOW_CURSOR:         do_open_line_below_cursor(true); break;
-        case SAVE_FILE:                      do_save_file(); break;
-        case EXIT_EDITOR:                    do_exit_editor(); return;
-        case FORCE_EXIT_EDITOR:              do_force_exit_editor(); return;
-        case CURSOR_PAGE_UP:                 do_cursor_page_up(); break;
-        case CURSOR_PAGE_DOWN:               do_cursor_page_down(); break;
-        case CURSOR_PREV_PARA:               do_cursor_prev_para(); break;
-        case CURSOR_NEXT_PARA:               do_cursor_next_para(); break;
-        case REPEAT_SEARCH_FORWARD:          do_repeat_search_forward(); break;
-        case REPEAT_SEARCH_BACKWARD:         do_repeat_search_backward(); break;
-        case INSERT_CHAR: {
-            va_list args;
-            va_start(args, action);
-            int c = va_arg(args, int);
-            va_end(args);
-            do_insert_char(true, c);
-        } break;
+// Scrolls the view by `rows`, keeping the cursor on screen.
+void mouse_scroll(int rows) {
+    if (rows == 0 || E.numrows() == 0) return;
+    E.rowoff = std::max(0, std::min(E.rowoff + rows, E.lastrow_idx()));
+    // `scroll_to` keeps the cursor out of the last rows.
+    int last = E.rowoff + std::max(0, E.textrows() - 6);
+    int cy = std::max(E.rowoff, std::min(E.cy, std::min(last, E.lastrow_idx())));
+    if (cy != E.cy) {
+        E.cy = cy;
+        update_cx_when_cy_changed();
     }
+}
 
-    EditorRow* row = E.get_row_at(E.cy);
-    int rowlen = row ? row->len() : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+void mouse_event(const MouseEvent& ev) {
+    int cx, cy;
+    bool in_text = mouse_to_buffer(ev.x, ev.y, &cx, &cy);
+    if ((ev.b & MOUSE_BUTTON_MASK) != MOUSE_LEFT) return;
+    if (ev.release) {
+        MOUSE.pressed = MOUSE.dragging = false;
+    } else if (!(ev.b & MOUSE_MOTION)) {
+        MOUSE.pressed = in_text;
+        MOUSE.dragging = false;
+        if (!in_text) return;
+        MOUSE.press_cx = cx;
+        MOUSE.press_cy = cy;
+        E.set_cpos(cx, cy);
+    } else if (MOUSE.pressed && in_text) {
+        if (!MOUSE.dragging) {
+            E.set_cpos(MOUSE.press_cx, MOUSE.press_cy);
+            do_set_mark();
+            MOUSE.dragging = true;
+        }
+        E.set_cpos(cx, cy);
     }
+}
 
-    E.quit_times = NUM_FORCE_QUIT_PRESS;
-    E.reset_hlt();
+void process_mouse() {
+    if (E.mode != NORMAL && E.mode != INSERT) return;
+    int wheel = 0;
+    for (usize i = 0; i < MOUSE.events.size(); i++) {
+        const MouseEvent& ev = MOUSE.events[i];
+        if (ev.b & MOUSE_WHEEL) {
+            wheel += (ev.b & 1) ? MOUSE_WHEEL_ROWS : -MOUSE_WHEEL_ROWS;
+            continue;
+        }
+        // Keep the order of scrolling and clicks.
+        mouse_scroll(wheel);
+        wheel = 0;
+        mouse_event(ev);
+    }
+    mouse_scroll(wheel);
 }
 
-struct CommandInfo {
-    std::string name;
-    int args;
-    std::string* flags;
+// ============= KEYMAP ==============
+
+// Bindings are read from `DEFAULT_KEYMAP` and then the user's keymap
+// file, one per line:
+//
+//     <mode> <keys> <action>
+//
+// e.g. `normal gg cursor-first-row`. Special keys are written as
+// <esc>, <cr>, <bs>, <tab>, <space>, <lt>, <left>, <right>, <up>,
+// <down>, <c-x>, <a-m>, <a-s> and <a-left> etc. Binding to `none`
+// removes a binding. Later lines override earlier ones.
+//
+// At startup the bindings of each mode are compiled into a trie
+// stored as one flat transition table, so dispatching a key is a
+// single array lookup.
+
+const char* DEFAULT_KEYMAP =
+    "normal i change-mode-to-insert\n"
+    "normal w delete-current-char\n"
+    "normal ` exit-editor\n"
+    "normal U cursor-page-up\n"
+    "normal M cursor-page-down\n"
+    "normal a cursor-line-begin\n"
+    "normal ; cursor-line-end\n"
+    "normal <left> cursor-left\n"
+    "normal <down> cursor-down\n"
+    "normal <up> cursor-up\n"
+    "normal <right> cursor-right\n"
+    "normal h cursor-left\n"
+    "normal j cursor-down\n"
+    "normal k cursor-up\n"
+    "normal l cursor-right\n"
+    "normal o cursor-forward-word\n"
+    "normal n cursor-backward-word\n"
+    "normal u cursor-prev-para\n"
+    "normal m cursor-next-para\n"
+    "normal , open-line-below-cursor\n"
+    "normal d set-mark\n"
+    "normal f cut-cursor-mark-region\n"
+    "normal c paste-from-clipboard\n"
+    "normal b repeat-search-forward\n"
+    "normal B repeat-search-backward\n"
+    "normal ] jump-next-error\n"
+    "normal [ jump-prev-error\n"
+    "normal <c-o> jump-back\n"
+    "normal <tab> jump-forward\n"
+    "normal t toggle-bookmark\n"
+    "normal } next-bookmark\n"
+    "normal { prev-bookmark\n"
+    "normal <a-m> change-mode-to-command\n"
+    "normal <a-s> save-file\n"
+    "normal / change-mode-to-search\n"
+    "normal <bs> nop\n"
+    "normal <cr> nop\n"
+    "normal <esc> nop\n"
+    "normal G cursor-last-row\n"
+    "normal gg cursor-first-row\n"
+    "normal e undo\n"
+    "normal E redo\n"
+    "normal >> indent-row\n"
+    "normal <lt><lt> outdent-row\n"
+    "normal == reindent-row\n"
+    "normal >' indent-cursor-mark-region\n"
+    "normal <lt>' outdent-cursor-mark-region\n"
+    "normal =' reindent-cursor-mark-region\n"
+    "insert <bs> delete-left-char\n"
+    "insert <cr> insert-newline\n"
+    "insert <tab> insert-indent\n"
+    "insert <left> cursor-left\n"
+    "insert <down> cursor-down\n"
+    "insert <up> cursor-up\n"
+    "insert <right> cursor-right\n"
+    "insert <esc> change-mode-to-normal\n";
+
+struct ActionName {
+    const char* name;
+    int action;
 };
 
-std::string exit_flags[] = { "--force", "" };
+ActionName ACTION_NAMES[] = {
+    { "cursor-up", CURSOR_UP },
+    { "cursor-down", CURSOR_DOWN },
+    { "cursor-left", CURSOR_LEFT },
+    { "cursor-right", CURSOR_RIGHT },
+    { "cursor-line-begin", CURSOR_LINE_BEGIN },
+    { "cursor-line-end", CURSOR_LINE_END },
+    { "cursor-forward-word", CURSOR_FORWARD_WORD },
+    { "cursor-backward-word", CURSOR_BACKWARD_WORD },
+    { "cursor-first-row", CURSOR_FIRST_ROW },
+    { "cursor-last-row", CURSOR_LAST_ROW },
+    { "cursor-page-up", CURSOR_PAGE_UP },
+    { "cursor-page-down", CURSOR_PAGE_DOWN },
+    { "cursor-next-para", CURSOR_NEXT_PARA },
+    { "cursor-prev-para", CURSOR_PREV_PARA },
+    { "change-mode-to-normal", CHANGE_MODE_TO_NORMAL },
+    { "change-mode-to-insert", CHANGE_MODE_TO_INSERT },
+    { "change-mode-to-command", CHANGE_MODE_TO_COMMAND },
+    { "change-mode-to-search", CHANGE_MODE_TO_SEARCH },
+    { "set-mark", SET_MARK },
+    { "exit-editor", EXIT_EDITOR },
+    { "force-exit-editor", FORCE_EXIT_EDITOR },
+    { "save-file", SAVE_FILE },
+    { "repeat-search-forward", REPEAT_SEARCH_FORWARD },
+    { "repeat-search-backward", REPEAT_SEARCH_BACKWARD },
+    { "jump-next-error", JUMP_NEXT_ERROR },
+    { "jump-prev-error", JUMP_PREV_ERROR },
+    { "jump-back", JUMP_BACK },
+    { "jump-forward", JUMP_FORWARD },
+    { "toggle-bookmark", TOGGLE_BOOKMARK },
+    { "next-bookmark", NEXT_BOOKMARK },
+    { "prev-bookmark", PREV_BOOKMARK },
+    { "undo", UNDO },
+    { "redo", REDO },
+    { "cut-cursor-mark-region", CUT_CURSOR_MARK_REGION },
+    { "insert-newline", INSERT_NEWLINE },
+    { "insert-indent", INSERT_INDENT },
+    { "delete-current-char", DELETE_CURRENT_CHAR },
+    { "delete-left-char", DELETE_LEFT_CHAR },
+    { "paste-from-clipboard", PASTE_FROM_CLIPBOARD },
+    { "open-line-below-cursor", OPEN_LINE_BELOW_CURSOR },
+    { "indent-row", INDENT_ROW },
+    { "outdent-row", OUTDENT_ROW },
+    { "reindent-row", REINDENT_ROW },
+    { "indent-cursor-mark-region", INDENT_CURSOR_MARK_REGION },
+    { "outdent-cursor-mark-region", OUTDENT_CURSOR_MARK_REGION },
+    { "reindent-cursor-mark-region", REINDENT_CURSOR_MARK_REGION },
+    { "nop", NOP },
+    { "none", -1 },
+};
+#define NUM_ACTION_NAMES (sizeof(ACTION_NAMES) / sizeof(ACTION_NAMES[0]))
 
-CommandInfo CMDDB[] = {
-    { "exit", 0, exit_flags },
-    { "set", 2, NULL },
+struct KeyName {
+    const char* name;
+    int key;
 };
-#define NUM_CMDDB (sizeof(CMDDB) / sizeof(CMDDB[0]))
 
-struct CommandParser {
-    std::string name;
-    std::vector<std::string> args;
-    std::vector<std::string> flags;
-    CommandInfo* entry = NULL;
+KeyName KEY_NAMES[] = {
+    { "esc", '\x1b' },
+    { "cr", '\r' },
+    { "bs", BACKSPACE },
+    { "tab", '\t' },
+    { "space", ' ' },
+    { "lt", '<' },
+    { "left", ARROW_LEFT },
+    { "right", ARROW_RIGHT },
+    { "up", ARROW_UP },
+    { "down", ARROW_DOWN },
+    { "a-m", ALT_M },
+    { "a-s", ALT_S },
+    { "a-left", ALT_ARROW_LEFT },
+    { "a-right", ALT_ARROW_RIGHT },
+    { "a-up", ALT_ARROW_UP },
+    { "a-down", ALT_ARROW_DOWN },
+};
+#define NUM_KEY_NAMES (sizeof(KEY_NAMES) / sizeof(KEY_NAMES[0]))
 
-    bool parse(const std::string& cmd) {
-        std::string cmd_nows = cmd;
-        str_trim_leading_ws(cmd_nows);
-        str_trim_trailing_ws(cmd_nows);
+// Keys are mapped to a dense index: ASCII first, then special keys.
+#define KEYMAP_KEYS (128 + (SPECIAL_KEY_END - ARROW_LEFT))
+#define KEYMAP_NUM_MODES 2
 
-        if (cmd_nows == "") {
-            set_cmdline_msg_error("empty command");
-            return false;
-        };
-
-        std::istringstream ss(cmd_nows);
-        std::string s;
-        bool is_name = true;
-        while (std::getline(ss, s, ' ')) {
-            if (is_name) {
-                name = s;
-                is_name = false;
-            } else if (str_startswith(s, "-")) {
-                flags.push_back(s);
-            } else {
-                args.push_back(s);
-            }
-        }
+int keymap_key_index(int key) {
+    if (key >= 0 && key < 128) return key;
+    if (key >= ARROW_LEFT && key < SPECIAL_KEY_END) return 128 + (key - ARROW_LEFT);
+    return -1;
+}
 
-        for (usize i = 0; i < NUM_CMDDB; i++) {
-            if (CMDDB[i].name == name) {
-                entry = &CMDDB[i];    
+int keymap_mode_index(EditorMode mode) {
+    switch (mode) {
+        case NORMAL: return 0;
+        case INSERT: return 1;
+        default: return -1;
+    }
+}
+
+struct KeyBinding {
+    int mode;
+    std::vector<int> keys;
+    int action;
+};
+
+struct Keymap {
+    // Flat trie: `next[node*KEYMAP_KEYS + key]` is the child node, or
+    // 0 for none (node 0 is never a child).
+    std::vector<i32> next;
+    // Per node: the bound action or -1, and whether longer
+    // sequences continue from it.
+    std::vector<i32> action;
+    std::vector<bool> has_children;
+    i32 roots[KEYMAP_NUM_MODES];
+
+    // Node reached by the keys typed so far, 0 if none.
+    i32 pending;
+    std::vector<int> pending_keys;
+};
+Keymap KM;
+
+bool parse_key_sequence(const std::string& s, std::vector<int>* keys) {
+    usize i = 0;
+    while (i < s.size()) {
+        if (s[i] != '<') {
+            keys->push_back((u8)s[i]);
+            i++;
+            continue;
+        }
+        usize end = s.find('>', i);
+        if (end == std::string::npos) return false;
+        std::string name = s.substr(i+1, end-i-1);
+        i = end+1;
+
+        bool found = false;
+        for (usize k = 0; k < NUM_KEY_NAMES; k++) {
+            if (name == KEY_NAMES[k].name) {
+                keys->push_back(KEY_NAMES[k].key);
+                found = true;
                 break;
             }
         }
+        if (!found && name.size() == 3 && str_startswith(name, "c-")) {
+            keys->push_back(CTRL_KEY(name[2]));
+            found = true;
+        }
+        if (!found) return false;
+    }
+    return keys->size() != 0;
+}
 
-        if (!entry) {
-            set_cmdline_msg_error("unknown command '{}'", name);
+// Appends the bindings in `text` to `out`. Stops at the first bad
+// line and returns false with a message in `err`.
+bool parse_keymap(const std::string& text, const std::string& from, std::vector<KeyBinding>* out, std::string* err) {
+    std::istringstream ss(text);
+    std::string line;
+    int lineno = 0;
+    while (std::getline(ss, line)) {
+        lineno++;
+        str_trim_leading_ws(line);
+        str_trim_trailing_ws(line);
+        if (line == "" || line[0] == '#') continue;
+
+        std::istringstream ls(line);
+        std::string mode, keys, action;
+        ls >> mode >> keys >> action;
+
+        KeyBinding b;
+        if (mode == "normal") b.mode = keymap_mode_index(NORMAL);
+        else if (mode == "insert") b.mode = keymap_mode_index(INSERT);
+        else {
+            *err = fmt::format("{}:{}: unknown mode '{}'", from, lineno, mode);
             return false;
         }
-
-        if ((int)args.size() != entry->args) {
-            set_cmdline_msg_error("expected {} args, got {}", entry->args, args.size());
+        if (!parse_key_sequence(keys, &b.keys)) {
+            *err = fmt::format("{}:{}: bad key sequence '{}'", from, lineno, keys);
             return false;
         }
-
-        if (!entry->flags && flags.size() != 0) {
-            set_cmdline_msg_error("unknown flag '{}'", flags[0]);
+        bool found = false;
+        for (usize i = 0; i < NUM_ACTION_NAMES; i++) {
+            if (action == ACTION_NAMES[i].name) {
+                b.action = ACTION_NAMES[i].action;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            *err = fmt::format("{}:{}: unknown action '{}'", from, lineno, action);
             return false;
-        } else {
-            for (usize i = 0; i < flags.size(); i++) {
-                bool found = false;
-                for (usize j = 0; entry->flags[j] != ""; j++) {
-                    if (flags[i] == entry->flags[j]) {
-                        found = true;
-                        break;
-                    }
-                }
-                
-                if (!found) {
-                    set_cmdline_msg_error("unknown flag '{}'", flags[i]);
-                    // We don't check all flags and exit early, because we
-                    // can only show one error at a time.
-                    return false;
-                }
+        }
+        for (usize i = 0; i < b.keys.size(); i++) {
+            if (keymap_key_index(b.keys[i]) == -1) {
+                *err = fmt::format("{}:{}: key cannot be bound", from, lineno);
+                return false;
             }
         }
+        out->push_back(b);
+    }
+    return true;
+}
 
-        return true;
+i32 keymap_new_node() {
+    i32 node = KM.action.size();
+    KM.action.push_back(-1);
+    KM.has_children.push_back(false);
+    KM.next.resize(KM.next.size() + KEYMAP_KEYS, 0);
+    return node;
+}
+
+void keymap_compile(const std::vector<KeyBinding>& bindings) {
+    KM.next.clear();
+    KM.action.clear();
+    KM.has_children.clear();
+    // Node 0 is a placeholder so that 0 can mean "no child".
+    keymap_new_node();
+    for (int m = 0; m < KEYMAP_NUM_MODES; m++) KM.roots[m] = keymap_new_node();
+
+    for (usize i = 0; i < bindings.size(); i++) {
+        const KeyBinding& b = bindings[i];
+        i32 node = KM.roots[b.mode];
+        for (usize k = 0; k < b.keys.size(); k++) {
+            usize slot = node*KEYMAP_KEYS + keymap_key_index(b.keys[k]);
+            if (KM.next[slot] == 0) {
+                // Nothing to remove.
+                if (b.action == -1) break;
+                i32 child = keymap_new_node();
+                KM.next[slot] = child;
+            }
+            node = KM.next[slot];
+            if (k == b.keys.size()-1) KM.action[node] = b.action;
+        }
     }
 
-    bool flag_set(const std::string& flag) {
-        for (usize i = 0; i < flags.size(); i++) {
-            if (flags[i] == flag) return true;
+    // Nodes left without any action below them by removed bindings
+    // are harmless: they just act as unbound prefixes.
+    for (usize node = 1; node < KM.action.size(); node++) {
+        for (int k = 0; k < KEYMAP_KEYS; k++) {
+            if (KM.next[node*KEYMAP_KEYS + k] != 0) {
+                KM.has_children[node] = true;
+                break;
+            }
         }
-        return false;
     }
-};
+    KM.pending = 0;
+    KM.pending_keys.clear();
+}
 
-void parse_and_run_command(const std::string& cmd) {
-    CommandParser parser;
-    if (!parser.parse(cmd)) return;
+void keymap_init() {
+    std::vector<KeyBinding> bindings;
+    std::string err;
+    if (!parse_keymap(DEFAULT_KEYMAP, "[default keymap]", &bindings, &err)) {
+        core::error_exit_with_msg(err.c_str());
+    }
 
-    if (parser.name == "exit") {
-        if (parser.flag_set("--force")) {
-            do_action(FORCE_EXIT_EDITOR);
+    std::string path = config_file_path("keymap");
+    std::ifstream f(path);
+    if (path != "" && f) {
+        std::stringstream text;
+        text << f.rdbuf();
+        std::vector<KeyBinding> user;
+        if (parse_keymap(text.str(), path, &user, &err)) {
+            bindings.insert(bindings.end(), user.begin(), user.end());
         } else {
-            do_action(EXIT_EDITOR);
+            set_cmdline_msg_error("{}", err);
         }
-    } else if (parser.name == "set") {
-        if (parser.args[0] == "path") {
-            set_path(parser.args[1]);
-        } else {
-            set_cmdline_msg_error("unknown variable '{}'", parser.args[0]);
+    }
+    keymap_compile(bindings);
+}
+
+void on_keymap_timeout();
+
+void keymap_reset_pending() {
+    KM.pending = 0;
+    KM.pending_keys.clear();
+    ev_cancel_timer(on_keymap_timeout);
+}
+
+void keymap_run(int action) {
+    if (action != NOP) do_action(action);
+}
+
+void keymap_unbound_key(int c) {
+    if (E.mode == INSERT && is_char_printable(c)) {
+        do_action(INSERT_CHAR, c);
+    } else if (E.mode == INSERT) {
+        set_cmdline_msg_error("non-printable key '{}' in insert mode", (int)c);
+    } else {
+        set_cmdline_msg_error("invalid key '{}' in normal mode", (int)c);
+    }
+}
+
+// Fires when a prefix saw no further key in time: an ambiguous one
+// (`g` if both `g` and `gg` are bound) runs its own binding, and in
+// insert mode the keys of one without a binding (`j` of `jk`) are
+// typed.
+void on_keymap_timeout() {
+    i32 node = KM.pending;
+    std::vector<int> keys = KM.pending_keys;
+    keymap_reset_pending();
+    if (node != 0 && KM.action[node] != -1) {
+        keymap_run(KM.action[node]);
+    } else if (E.mode == INSERT) {
+        for (usize i = 0; i < keys.size(); i++) keymap_unbound_key(keys[i]);
+    }
+    E.redraw = true;
+}
+
+void keymap_dispatch(int c) {
+    int m = keymap_mode_index(E.mode);
+    if (m == -1) return;
+    int k = keymap_key_index(c);
+    i32 from = KM.pending != 0 ? KM.pending : KM.roots[m];
+    i32 node = k != -1 ? KM.next[from*KEYMAP_KEYS + k] : 0;
+
+    if (node != 0 && KM.action[node] == -1 && !KM.has_children[node]) node = 0;
+
+    if (node == 0) {
+        if (KM.pending == 0) {
+            keymap_unbound_key(c);
             return;
         }
+        std::vector<int> keys = KM.pending_keys;
+        keymap_reset_pending();
+        if (KM.action[from] != -1) {
+            // The prefix is a binding of its own: run it, then
+            // handle this key from scratch.
+            keymap_run(KM.action[from]);
+            keymap_dispatch(c);
+        } else if (E.mode == INSERT) {
+            // Not a binding after all: type what was held back.
+            for (usize i = 0; i < keys.size(); i++) keymap_unbound_key(keys[i]);
+            keymap_dispatch(c);
+        } else if (c != '\x1b') {
+            std::string seq;
+            for (usize i = 0; i < keys.size(); i++) seq += fmt::format("{} ", keys[i]);
+            set_cmdline_msg_error("invalid key '{}{}' in {} mode", seq, (int)c, E.mode == INSERT ? "insert" : "normal");
+        }
+        return;
+    }
+
+    if (!KM.has_children[node]) {
+        keymap_reset_pending();
+        keymap_run(KM.action[node]);
+        return;
     }
+    KM.pending = node;
+    KM.pending_keys.push_back(c);
+    ev_set_timer(on_keymap_timeout, KEYMAP_TIMEOUT_MS);
 }
 
 void process_keypress() {
+    TRACE_SCOPE("keypress");
     int c = read_key();
-    if (E.mode == NORMAL) {
-        switch (c) {
-            case 'i':                   do_action(CHANGE_MODE_TO_INSERT); break;
-            case 'w':                   do_action(DELETE_CURRENT_CHAR); break;
-            case '`':                   do_action(EXIT_EDITOR); break;
-            case 'U':                   do_action(CURSOR_PAGE_UP); break;
-            case 'M':                   do_action(CURSOR_PAGE_DOWN); break;
-            case 'a':                   do_action(CURSOR_LINE_BEGIN); break;
-            case ';':                   do_action(CURSOR_LINE_END); break;
-            case ARROW_LEFT:            do_action(CURSOR_LEFT); break;
-            case ARROW_DOWN:            do_action(CURSOR_DOWN); break;
-            case ARROW_UP:              do_action(CURSOR_UP); break;
-            case ARROW_RIGHT:           do_action(CURSOR_RIGHT); break;
-            case 'h':                   do_action(CURSOR_LEFT); break;
-            case 'j':                   do_action(CURSOR_DOWN); break;
-            case 'k':                   do_action(CURSOR_UP); break;
-            case 'l':                   do_action(CURSOR_RIGHT); break;
-            case 'o':                   do_action(CURSOR_FORWARD_WORD); break;
-            case 'n':                   do_action(CURSOR_BACKWARD_WORD); break;
-            case 'u':                   do_action(CURSOR_PREV_PARA); break;
-            case 'm':                   do_action(CURSOR_NEXT_PARA); break;
-            case ',':                   do_action(OPEN_LINE_BELOW_CURSOR); break;
-            case 'd':                   do_action(SET_MARK); break;
-            case 'f':                   do_action(CUT_CURSOR_MARK_REGION); break;
-            case 'c':                   do_action(PASTE_FROM_CLIPBOARD); break;
-            case 'b':                   do_action(REPEAT_SEARCH_FORWARD); break;
-            case 'B':                   do_action(REPEAT_SEARCH_BACKWARD); break;
-            case ALT_M:                 do_action(CHANGE_MODE_TO_COMMAND); break;
-            case ALT_S:                 do_action(SAVE_FILE); break;
-            case '/':                   do_action(CHANGE_MODE_TO_SEARCH); break;
-            case BACKSPACE:             break;
-            case '\r':                  break;
-            case '\x1b':                break;
-            case 'G':                   do_action(CURSOR_LAST_ROW); break;
-            case 'g': {
-                c = read_key();
-                switch (c) {
-                    case 'g':           do_action(CURSOR_FIRST_ROW); break;
-                    case '\x1b':        break;
-                    default: set_cmdline_msg_error("invalid key 'g {}' in normal mode", (int)c);
-                }
-            } break;
-            case 'e': do_undo_or_redo(true); break;
-            case 'E': do_undo_or_redo(false); break;
-            default: set_cmdline_msg_error("invalid key '{}' in normal mode", (int)c);
-        }
-
-    } else if (E.mode == INSERT) {
-        switch (c) {
-            case BACKSPACE:             do_action(DELETE_LEFT_CHAR); break;
-            case '\r':                  do_action(INSERT_NEWLINE); break;
-            case '\t':                  do_insert_indent(true); break;
-            case ARROW_LEFT:            do_action(CURSOR_LEFT); break;
-            case ARROW_DOWN:            do_action(CURSOR_DOWN); break;
-            case ARROW_UP:              do_action(CURSOR_UP); break;
-            case ARROW_RIGHT:           do_action(CURSOR_RIGHT); break;
-            case '\x1b':                do_action(CHANGE_MODE_TO_NORMAL); break;
-            default: {
-                if (is_char_printable(c)) do_action(INSERT_CHAR, c);
-                else set_cmdline_msg_error("non-printable key '{}' in insert mode", (int)c);
-            } break;
-        }
+    if (c == NO_KEY) return;
+    if (c == MOUSE_INPUT) {
+        process_mouse();
+        return;
+    }
+    if (E.mode == NORMAL || E.mode == INSERT) {
+        keymap_dispatch(c);
 
     } else if (E.mode == COMMAND || E.mode == SEARCH) {
         switch (c) {
@@ -1660,9 +6857,12 @@ void process_keypress() {
                 do_action(CHANGE_MODE_TO_NORMAL);
 
                 if (mode == COMMAND) {
+                    history_add(&E.cmd_history, ':', txt);
                     parse_and_run_command(txt);
                 } else if (mode == SEARCH) {
+                    history_add(&E.search_history, '/', txt);
                     E.search_default = txt;
+                    push_jump();
                     search_text_forward(txt, true);
                 }
             } break;
@@ -1695,6 +6895,18 @@ void process_keypress() {
                 do_action(CHANGE_MODE_TO_NORMAL);
             } break;
 
+            case '\t': {
+                if (E.mode == COMMAND) do_complete_command();
+            } break;
+
+            case ARROW_UP:
+            case ARROW_DOWN: {
+                history_move(c == ARROW_UP);
+                if (E.mode == SEARCH) {
+                    search_text_forward(E.cmdline, false);
+                }
+            } break;
+
             default: {
                 if (is_char_printable(c)) {
                     E.cmdline.insert(E.cmdx, 1, c);
@@ -1716,12 +6928,49 @@ void update_rx() {
     }
 }
 
+// SGR sequence for text highlighted as `hl` under the decoration
+// kinds in `mask`. It starts from a reset, so nothing from the
+// previous style carries over. Built once per style.
+const std::string& style_sgr(u8 hl, u32 mask) {
+    static std::string cache[HL_CONST+1][1 << NUM_DECO_KINDS];
+    // Colors depend on the terminal, which may be detected late.
+    static int cached_colors = 0;
+    if (cached_colors != TC.colors) {
+        for (int h = 0; h <= HL_CONST; h++) {
+            for (int m = 0; m < 1 << NUM_DECO_KINDS; m++) cache[h][m] = "";
+        }
+        cached_colors = TC.colors;
+    }
+    std::string& sgr = cache[hl][mask];
+    if (sgr != "") return sgr;
+    sgr = "\x1b[0";
+    if (hl != HL_NORMAL) {
+        int color = hl_to_color((EditorHighlight)hl);
+        if (hl == HL_KEYWORD || hl == HL_TYPE) sgr += ";1;" + sgr_color(color, false);
+        else if (hl == HL_COMMENT) sgr += ";" + sgr_color(color, false);
+        else sgr += fmt::format(";{}", color);
+    }
+    if (mask & (1 << DECO_SEARCH)) sgr += ";44";
+    else if (mask & (1 << DECO_BRACKET)) sgr += ";" + sgr_color(243, true);
+    else if (mask & (1 << DECO_REGION)) sgr += ";" + sgr_color(238, true);
+    if (mask & (1 << DECO_DIAGNOSTIC)) sgr += ";4";
+    sgr += 'm';
+    return sgr;
+}
+
+struct DecoSpan {
+    int x0, x1;
+};
+
 void draw_rows() {
-    for (int y = 0; y < E.screenrows; y++) {
+    std::vector<Decoration> decos;
+    std::vector<DecoSpan> spans;
+    std::vector<int> bounds;
+    for (int y = 0; y < E.textrows(); y++) {
         int filerow = y + E.rowoff;
-        ewrite("\x1b[K");
+        ewrite(TC.el);
         if (filerow >= E.numrows()) {
-            if (E.numrows() == 0 && y == E.screenrows / 3) {
+            if (E.numrows() == 0 && y == E.textrows() / 3) {
                 std::string welcome = "hed editor -- maintained by shkhuz";
                 usize len = welcome.size();
                 if (len > (usize)E.screencols) len = E.screencols;
@@ -1731,10 +6980,7 @@ void draw_rows() {
                     ewrite("~");
                     padding--;
                 }
-                while (padding) {
-                    ewrite(" ");
-                    padding--;
-                }
+                ewrite_repeat(' ', padding);
 
                 ewrite_with_len(welcome, len);
             } else {
@@ -1742,66 +6988,138 @@ void draw_rows() {
             }
 
         } else {
-            int rowlen = E.get_row_at(filerow)->rlen - E.coloff;
+            EditorRow* row = row_layout(E.get_row_at(filerow));
+            int rowlen = row_text(row)->rlen - E.coloff;
             if (rowlen < 0) rowlen = 0;
             if (rowlen > E.screencols) rowlen = E.screencols;
 
-            const char* c = &E.get_row_at(filerow)->rdata.data()[E.coloff];
-            u8* hl = &E.get_row_at(filerow)->hl[E.coloff];
-            int current_color = -1;
-
-            // We go till i == rowlen because hlt end is exclusive
-            // so we need to one after the last character to check if
-            // hlt is ended.
-            // But we exit early before printing because there is
-            // no character at i == rowlen.
-            for (int i = 0; i <= rowlen; i++) {
-                int filei = i + E.coloff;
-                if (filerow == E.hltsy && filei == E.hltsx) {
-                    ewrite("\x1b[44m");
+            const char* c = &row_text(row)->rdata.data()[E.coloff];
+            u8* hl = &row_text(row)->hl[E.coloff];
+
+            // Runs of the visible part of the row over which the
+            // same decorations apply: run `r` covers
+            // [bounds[r], bounds[r+1]) and is drawn with `masks[r]`.
+            decos.clear();
+            decorations_on_row(filerow, &decos);
+            spans.resize(decos.size());
+            bounds.assign(1, 0);
+            for (usize d = 0; d < decos.size(); d++) {
+                const Decoration& deco = decos[d];
+                // A span computed before the row was edited may
+                // run past its end.
+                int x0 = deco.y0 == filerow ? std::min(deco.x0, row->len()) : 0;
+                int x1 = deco.y1 == filerow ? std::min(deco.x1, row->len()) : row->len();
+                // Without tabs, columns render one to one.
+                if (row_text(row)->rlen != row->len()) {
+                    x0 = row_cx_to_rx(row, x0);
+                    x1 = row_cx_to_rx(row, x1);
                 }
-                if (filerow == E.hltey && filei == E.hltex) {
-                    ewrite("\x1b[49m");
+                spans[d].x0 = x0 - E.coloff;
+                spans[d].x1 = x1 - E.coloff;
+                bounds.push_back(std::max(0, std::min(rowlen, spans[d].x0)));
+                bounds.push_back(std::max(0, std::min(rowlen, spans[d].x1)));
+            }
+            bounds.push_back(rowlen);
+            std::sort(bounds.begin(), bounds.end());
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+            int cur_style = 0;
+            for (usize r = 0; r+1 < bounds.size(); r++) {
+                int start = bounds[r], end = bounds[r+1];
+                u32 mask = 0;
+                for (usize d = 0; d < decos.size(); d++) {
+                    if (spans[d].x0 <= start && spans[d].x1 >= end) mask |= 1 << decos[d].kind;
                 }
-                if (i == rowlen) break;
-
-                if (iscntrl(c[i])) {
-                    char sym = (c[i] <= 26) ? '@'+c[i] : '?';
-                    ewrite("\x1b[7m");
-                    ewrite_char(sym);
-                    ewrite("\x1b[m");
-                    if (current_color != -1) {
-                        ewrite(fmt::format("\x1b[{}m", current_color));
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        ewrite("\x1b[0m");
-                        current_color = -1;
+                for (int i = start; i < end; i++) {
+                    int style = hl[i] | mask << 8;
+                    if (style != cur_style) {
+                        ewrite(style_sgr(hl[i], mask));
+                        cur_style = style;
                     }
-                    ewrite_cstr_with_len(&c[i], 1);
-                } else {
-                    int color = hl_to_color((EditorHighlight)hl[i]);
-                    if (color != current_color) {
-                        current_color = color;
-                        if (hl[i] == HL_KEYWORD || hl[i] == HL_TYPE)
-                            ewrite(fmt::format("\x1b[1;38;5;{}m", color));
-                        else if (hl[i] == HL_COMMENT)
-                            ewrite(fmt::format("\x1b[38;5;{}m", color));
-                        else
-                            ewrite(fmt::format("\x1b[{}m", color));
+                    if (iscntrl(c[i])) {
+                        char sym = (c[i] <= 26) ? '@'+c[i] : '?';
+                        ewrite("\x1b[7m");
+                        ewrite_char(sym);
+                        ewrite("\x1b[27m");
+                    } else if ((u8)c[i] < 0x80 && i+1 < end && c[i+1] == c[i] && hl[i+1] == hl[i]) {
+                        // A run of one ASCII character (REP would
+                        // repeat a whole UTF-8 character, not a byte).
+                        int n = 2;
+                        while (i+n < end && c[i+n] == c[i] && hl[i+n] == hl[i]) n++;
+                        if (c[i] == ' ' && mask == 0 && TC.cuf && n >= TERM_MIN_RUN) {
+                            // The row was cleared: blanks only need skipping.
+                            ewrite(fmt::format("\x1b[{}C", n));
+                        } else {
+                            ewrite_repeat(c[i], n);
+                        }
+                        i += n-1;
+                    } else {
+                        ewrite_cstr_with_len(&c[i], 1);
                     }
-                    ewrite_cstr_with_len(&c[i], 1);
                 }
             }
-            ewrite("\x1b[39m");
+            if (cur_style != 0) ewrite("\x1b[0m");
         }
 
-        if (y < E.screenrows-1) {
+        if (y < E.textrows()-1) {
             ewrite("\r\n");
         }
     }
 }
 
+void draw_build_pane() {
+    int rows = E.pane_rows();
+    if (rows == 0) return;
+
+    std::string title;
+    if (E.build.pid != -1) {
+        title = fmt::format(" make: running '{}'", E.build.cmd);
+    } else if (WIFEXITED(E.build.exit_status)) {
+        title = fmt::format(" make: exited with {}", WEXITSTATUS(E.build.exit_status));
+    } else {
+        title = " make: killed";
+    }
+    if (E.build.qf_idx != -1) {
+        title += fmt::format(", error {}/{}", E.build.qf_idx+1, E.build.qf.size());
+    } else {
+        title += fmt::format(", {} errors", E.build.qf.size());
+    }
+
+    ewrite("\r\n");
+    ewrite("\x1b[7m");
+    int tlen = title.size();
+    if (tlen > E.screencols) tlen = E.screencols;
+    ewrite_with_len(title, tlen);
+    ewrite_repeat(' ', E.screencols - tlen);
+    ewrite("\x1b[m");
+
+    // Follow the output, unless an error is selected, in which case
+    // keep it in view.
+    int body = rows-1;
+    int nlines = E.build.lines.size();
+    int first = nlines - body;
+    int sel = -1;
+    if (E.build.qf_idx != -1) {
+        sel = E.build.qf[E.build.qf_idx].pane_line;
+        first = sel - body/2;
+        if (first > nlines - body) first = nlines - body;
+    }
+    if (first < 0) first = 0;
+
+    for (int y = 0; y < body; y++) {
+        int l = first + y;
+        ewrite("\r\n");
+        ewrite(TC.el);
+        if (l >= nlines) continue;
+        const std::string& line = E.build.lines[l];
+        int len = line.size();
+        if (len > E.screencols) len = E.screencols;
+        if (l == sel) ewrite("\x1b[44m");
+        ewrite_with_len(line, len);
+        if (l == sel) ewrite("\x1b[49m");
+    }
+}
+
 void draw_status_bar() {
     ewrite("\r\n");
     if (E.mode == INSERT) {
@@ -1812,28 +7130,32 @@ void draw_status_bar() {
 
     std::string lstatus = fmt::format(
             "[{}{}] {}",
-            E.dirty ? '*' : '-',
+            E.is_dirty() ? '*' : '-',
             E.mode == INSERT ? 'I' : 'N',
             E.path != "" ? E.path : "[No name]");
     int llen = lstatus.size();
     if (llen > E.screencols) llen = E.screencols;
 
     std::string rstatus = fmt::format(
-        "{} {}/{} ",
+        "{} {} {}{}{} {} {}/{} ",
         E.syn ? E.syn->filetype : "none",
+        E.opts.expandtab ? fmt::format("sp{}", indent_width()) : "tab",
+        E.fmt.encoding,
+        E.fmt.bom ? "-bom" : "",
+        E.fmt.final_newline ? "" : " noeol",
+        eol_name(E.fmt.eol),
         E.cy+1,
         E.numrows());
     int rlen = rstatus.size();
 
     ewrite_with_len(lstatus, llen);
-    while (llen < E.screencols) {
-        if (E.screencols-llen == rlen) {
-            ewrite_with_len(rstatus, rlen);
-            break;
-        } else {
-            ewrite(" ");
-            llen++;
-        }
+    // The right part only if it fits.
+    int pad = E.screencols - llen - rlen;
+    if (pad >= 0) {
+        ewrite_repeat(' ', pad);
+        ewrite_with_len(rstatus, rlen);
+    } else {
+        ewrite_repeat(' ', E.screencols - llen);
     }
 
     ewrite("\x1b[m");
@@ -1841,7 +7163,7 @@ void draw_status_bar() {
 
 void draw_cmdline() {
     ewrite("\r\n");
-    ewrite("\x1b[K");
+    ewrite(TC.el);
     if (E.mode == COMMAND || E.mode == SEARCH) {
         if (E.mode == COMMAND) ewrite(":");
         else if (E.mode == SEARCH) ewrite("/");
@@ -1866,8 +7188,8 @@ void draw_debug_info() {
     ewrite("\r\n");
     ewrite("\x1b[K");
     std::string debug_info = fmt::format(
-        "undo_pos: {}, cmdx: {}, cmdoff: {}, len(cmd): {}, rows: {}, cx = {}, cy: {}, cx (calc): {}, rx: {}, tx: {}",
-        E.undo_pos,
+        "undo_cur: {}, cmdx: {}, cmdoff: {}, len(cmd): {}, rows: {}, cx = {}, cy: {}, cx (calc): {}, rx: {}, tx: {}",
+        E.undo_cur,
         E.cmdx,
         E.cmdoff,
         E.cmdline.size(),
@@ -1883,6 +7205,7 @@ void draw_debug_info() {
 }
 
 void refresh_screen() {
+    TRACE_SCOPE("frame");
     if (E.mode != COMMAND && E.mode != SEARCH) {
         update_rx();
         scroll_to(E.rx, E.cy);
@@ -1890,10 +7213,14 @@ void refresh_screen() {
     scroll_cmdline();
 
     E.abuf.clear();
+    // Have the terminal show the frame at once, not as it arrives.
+    if (TC.sync) ewrite("\x1b[?2026h");
     ewrite("\x1b[?25l");
     ewrite("\x1b[H");
 
+    update_decorations();
     draw_rows();
+    draw_build_pane();
     draw_status_bar();
     draw_cmdline();
 #ifdef DBGLINE
@@ -1920,52 +7247,319 @@ void refresh_screen() {
     }
     ewrite(std::string(buf, 0, len));
     ewrite("\x1b[?25h");
+    if (TC.sync) ewrite("\x1b[?2026l");
 
-    write(STDOUT_FILENO, E.abuf.data(), E.abuf.size());
+    out_submit(&E.abuf);
+    E.redraw = false;
 }
 
-void init_editor() {
+// Only screen geometry depends on the terminal width; `rdata` and
+// `hl` are computed per row independently of it, so a resize just
+// re-reads the size and re-clamps the viewport.
+void relayout_screen() {
+    int rows, cols;
+    if (get_window_size(&rows, &cols) == -1) return;
+    if (rows == E.screenrows && cols == E.screencols) return;
+    E.screenrows = rows;
+    E.screencols = cols;
+    // `rowoff`, `coloff` and `cmdoff` are re-clamped by the
+    // scroll functions in `refresh_screen`.
+    E.redraw = true;
+}
+
+void on_resize_settled() {
+    relayout_screen();
+}
+
+void on_sigpipe_readable(int fd) {
+    char buf[64];
+    int winch = 0;
+    isize nread;
+    // Drain everything so a burst of signals costs one wakeup.
+    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+        for (isize i = 0; i < nread; i++) {
+            if (buf[i] == 'w') winch++;
+        }
+    }
+    if (winch) ev_set_timer(on_resize_settled, RESIZE_SETTLE_MS);
+}
+
+void sigwinch_handler(int sig) {
+    int saved_errno = errno;
+    write(EL.sigpipe[1], "w", 1);
+    errno = saved_errno;
+}
+
+void on_stdin_readable(int fd) {
+    if (out_busy()) OUT.keys_behind++;
+    process_keypress();
+    while (input_pending()) process_keypress();
+    E.redraw = true;
+    ev_set_timer(on_cold_idle, COLD_IDLE_MS);
+}
+
+// Editor state shared by the interactive and batch modes.
+void init_editor_state() {
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.tx = 0;
-    E.mx = 0;
-    E.my = 0;
+    reset_markers();
+    reset_decorations();
     E.rowoff = 0;
     E.coloff = 0;
     E.mode = NORMAL;
-    E.dirty = false;
     E.cmdx = 0;
     E.cmdoff = 0;
     E.syn = NULL;
-    E.indent_as_spaces = true;
-    E.reset_hlt();
+    E.fmt.eol = EOL_LF;
+    E.fmt.bom = false;
+    E.fmt.final_newline = true;
+    E.fmt.encoding = "utf-8";
+    init_options(&E.global_opts);
+    E.opts = E.global_opts;
+    E.layout_gen = 1;
+    clear_search_match();
+    E.screenrows = 24;
+    E.screencols = 80;
+    E.cmdline_msg_time = 0;
+    E.quit_times = NUM_FORCE_QUIT_PRESS;
+    reset_undo_tree();
+    E.edit_gen = 0;
+    E.save_gen = 0;
+    E.hash_root = NULL;
+    E.saved_hash_valid = false;
+    E.saved_hash = 0;
+    E.saved_numrows = 0;
+    // An unnamed empty buffer has nothing to lose.
+    remember_saved_hash();
+    E.cb = NULL;
+    E.build.open = false;
+    E.build.pid = -1;
+    E.build.fd = -1;
+    E.build.exit_status = 0;
+    E.build.qf_idx = -1;
+    E.cmd_history.pos = -1;
+    E.search_history.pos = -1;
+    E.compl_state.idx = -1;
+    load_config();
+}
+
+void init_editor() {
+    init_editor_state();
     if (get_window_size(&E.screenrows, &E.screencols) == -1)
         core::error_exit_from("get_window_size");
     E.abuf.reserve(5*1024);
-    E.cmdline_msg_time = 0;
-    E.quit_times = NUM_FORCE_QUIT_PRESS;
-    E.undo_pos = -1;
 #ifdef DBGLOG
     E.keylog = std::ofstream("key.txt", std::ios_base::app);
     E.keylog << "\n============= new stream ==========\n";
 #endif
     E.cb = clipboard_new(NULL);
+    E.redraw = true;
+    keymap_init();
+    history_load();
+
+    ev_init();
+    out_init();
+    term_query();
+    ev_watch(STDIN_FILENO, on_stdin_readable);
+    ev_watch(EL.sigpipe[0], on_sigpipe_readable);
+    // Large files may be over `coldbudget` before the first key.
+    ev_set_timer(on_cold_idle, COLD_IDLE_MS);
+    atexit(mem_report_at_exit);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigwinch_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        core::error_exit_from("sigaction");
+}
+
+// ============= BATCH ==============
+
+// `hed --batch script [--jobs N] file...` applies the commands in
+// `script`, one per line, to every file and saves the files that
+// changed. There is no terminal: no raw mode, no rendering and no
+// highlighting.
+//
+// The editor state is global, so files are processed by forked
+// worker processes rather than threads. Workers take the index of the
+// next file from a counter in shared memory and write their results
+// next to it.
+
+enum BatchStatus {
+    BATCH_PENDING,
+    BATCH_UNCHANGED,
+    BATCH_WRITTEN,
+    BATCH_FAILED,
+};
+
+struct BatchResult {
+    i64 bytes_in;
+    i64 bytes_out;
+    BatchStatus status;
+};
+
+struct BatchShared {
+    std::atomic<int> next;
+    // Followed by one `BatchResult` per file.
+};
+
+struct BatchLine {
+    int lineno;
+    std::string cmd;
+};
+
+double batch_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void batch_process_file(const char* path, const char* script_path, const std::vector<BatchLine>& script, BatchResult* res) {
+    res->status = BATCH_FAILED;
+    close_file();
+
+    struct stat st;
+    const char* err = stat(path, &st) == -1 ? "file not found" : open_file(path);
+    if (err) {
+        fputs(fmt::format("{}: {}\n", path, err).c_str(), stderr);
+        return;
+    }
+    res->bytes_in = st.st_size;
+
+    for (usize i = 0; i < script.size(); i++) {
+        E.cmdline.clear();
+        E.cmdline_style = NONE;
+        parse_and_run_command(script[i].cmd);
+        if (E.cmdline_style == ERROR) {
+            fputs(fmt::format("{}: {}:{}: {}\n", path, script_path, script[i].lineno, E.cmdline).c_str(), stderr);
+            return;
+        }
+    }
+
+    if (!E.is_dirty()) {
+        res->status = BATCH_UNCHANGED;
+        return;
+    }
+    usize written;
+    err = save_file(&written);
+    if (err) {
+        fputs(fmt::format("{}: {}\n", path, err).c_str(), stderr);
+        return;
+    }
+    res->bytes_out = written;
+    res->status = BATCH_WRITTEN;
 }
 
+int batch_main(int argc, char** argv) {
+    // Before anything can exit: there is no terminal state to restore.
+    E.batch = true;
+    const char* usage = "usage: hed --batch script [--jobs N] file...";
+    if (argc < 1) core::error_exit_with_msg(usage);
+
+    const char* script_path = argv[0];
+    int argi = 1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argi < argc && !strcmp(argv[argi], "--jobs")) {
+        if (argi+1 >= argc) core::error_exit_with_msg(usage);
+        jobs = strtol(argv[argi+1], NULL, 10);
+        argi += 2;
+    }
+    if (jobs < 1) jobs = 1;
+    int nfiles = argc - argi;
+    char** files = argv + argi;
+    if (nfiles == 0) core::error_exit_with_msg(usage);
+    if (jobs > nfiles) jobs = nfiles;
+
+    std::ifstream f(script_path);
+    if (!f) core::error_exit_with_msg("cannot open script");
+    std::vector<BatchLine> script;
+    std::string line;
+    for (int lineno = 1; std::getline(f, line); lineno++) {
+        str_trim_leading_ws(line);
+        str_trim_trailing_ws(line);
+        if (line == "" || line[0] == '#') continue;
+        script.push_back({ lineno, line });
+    }
+
+    usize shared_size = sizeof(BatchShared) + nfiles*sizeof(BatchResult);
+    void* mem = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) core::error_exit_from("mmap");
+    BatchShared* shared = new (mem) BatchShared();
+    shared->next = 0;
+    BatchResult* results = (BatchResult*)(shared + 1);
+    for (int i = 0; i < nfiles; i++) {
+        results[i].bytes_in = 0;
+        results[i].bytes_out = 0;
+        results[i].status = BATCH_PENDING;
+    }
+
+    init_editor_state();
+    if (E.cmdline_style == ERROR) core::error_exit_with_msg(E.cmdline.c_str());
+    fflush(stdout);
+    fflush(stderr);
+    double start = batch_seconds();
+
+    for (long j = 0; j < jobs; j++) {
+        pid_t pid = fork();
+        if (pid == -1) core::error_exit_from("fork");
+        if (pid == 0) {
+            int idx;
+            while ((idx = shared->next.fetch_add(1)) < nfiles) {
+                batch_process_file(files[idx], script_path, script, &results[idx]);
+            }
+            fflush(stderr);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0);
+
+    double secs = batch_seconds() - start;
+    if (secs < 1e-6) secs = 1e-6;
+    i64 bytes_in = 0, bytes_out = 0;
+    int written = 0, failed = 0;
+    for (int i = 0; i < nfiles; i++) {
+        bytes_in += results[i].bytes_in;
+        bytes_out += results[i].bytes_out;
+        if (results[i].status == BATCH_WRITTEN) written++;
+        // A worker that died leaves its file pending.
+        else if (results[i].status != BATCH_UNCHANGED) failed++;
+    }
+
+    fputs(fmt::format(
+        "{} files ({} written, {} failed), {} bytes in, {} bytes out, {:.3f}s, {:.1f} files/s, {:.1f} MB/s\n",
+        nfiles, written, failed, bytes_in, bytes_out, secs,
+        nfiles / secs, bytes_in / secs / (1024*1024)).c_str(), stdout);
+    return failed ? 1 : 0;
+}
+
+// bench/microbench.cpp includes this file with its own `main`.
+#ifndef HED_NO_MAIN
 int main(int argc, char** argv) {
+    if (argc >= 2 && !strcmp(argv[1], "--batch")) {
+        return batch_main(argc-2, argv+2);
+    }
+
     enable_raw_mode();
     init_editor();
     if (argc >= 2) {
-        open_file(argv[1]);
+        const char* err = open_file(argv[1]);
+        if (err) core::error_exit_with_msg(err);
     }
 
-    set_cmdline_msg_info("HELP: Alt-s save, ` quit");
+    // Don't hide errors from loading the file or keymap.
+    if (E.cmdline == "") set_cmdline_msg_info("HELP: Alt-s save, ` quit");
 
     while (1) {
-        refresh_screen();
-        process_keypress();
+        // While the terminal is still taking the last frame, keep
+        // handling input; the next frame shows where it got to.
+        if (E.redraw && !out_busy()) refresh_screen();
+        ev_run_once();
     }
 
     return 0;
 }
+#endif
@@ -0,0 +1,883 @@
+// Randomized differential test of the editing engine, run with
+// `make difftest`.
+//
+// Random edit sequences (typing, newline, delete, cut, paste, undo,
+// redo, earlier/later, cursor moves and tabstop changes) are applied
+// to the editor through `do_action`, and to `Model`, a deliberately
+// naive copy of the buffer kept as plain strings with a full
+// snapshot of every state it has been in. After every step the two
+// must agree on the text, the cursor, the mark, the rendered rows
+// and whether the buffer is dirty. A replacement storage, undo,
+// marker or rendering engine has to keep this passing. Half the
+// runs share row texts (`intern`), so edits of shared rows are
+// covered too. OP_COLD compresses a range of rows and drops every
+// decompressed block, as the idle pass does under memory pressure,
+// so reads and edits of compressed rows are covered as well.
+//
+// The model moves the mark by hand on every edit, the way markers
+// are specified to move (see MARKERS): text inserted at the mark
+// goes after it, and a deleted mark lands where the deletion began.
+//
+// After undo/redo/earlier/later only the validity of the cursor and
+// marks is checked: where undo leaves them is editor policy, not buffer
+// content, so the model adopts the editor's positions.
+//
+// Every step also draws the rows as `refresh_screen` would, plays the
+// output on an emulated screen and compares it, character and style,
+// with a frame built from the model, so stale highlighting or a
+// broken run encoding (REP, CUF) shows up. The buffer is highlighted
+// as C without its indent rules, which the model doesn't follow.
+// Decorations are taken from the editor: only how they are drawn is
+// checked, not where they are.
+//
+//     difftest [--seed N] [--runs N] [--ops N]
+//     difftest --stress N [--seed N]
+//
+// `--stress` runs N operations on one growing buffer without the
+// model, checks the editor's internal invariants at the end and
+// reports operations per second.
+
+#define HED_NO_MAIN
+#include "../src/main.cpp"
+
+enum DiffOp {
+    OP_INSERT,
+    OP_NEWLINE,
+    OP_DELETE_LEFT,
+    OP_DELETE_CURRENT,
+    OP_MOVE,
+    OP_MARK,
+    OP_ANCHOR,
+    OP_CUT,
+    OP_PASTE,
+    OP_UNDO,
+    OP_REDO,
+    OP_EARLIER,
+    OP_LATER,
+    OP_TABSTOP,
+    OP_COLD,
+};
+
+// Relative frequency of each DiffOp.
+const int OP_WEIGHTS[] = { 40, 8, 10, 6, 12, 4, 2, 4, 4, 7, 4, 2, 2, 1, 2 };
+// Most anchors added in one run.
+const int MAX_ANCHORS = 32;
+const int NUM_OPS = sizeof(OP_WEIGHTS) / sizeof(OP_WEIGHTS[0]);
+// Rows a move can jump, which bounds the size of cut regions so the
+// buffer in `--stress` grows like one being edited.
+const int MOVE_ROWS = 20;
+// Characters typed. Tabs exercise rendering, spaces autoindent,
+// the rest highlighting (`if`, numbers, strings, comments, control
+// characters).
+const char* TYPED_CHARS = "ab{} \tif1\"/\x01";
+// Size of the screen frames are drawn on.
+const int FRAME_ROWS = 12;
+const int FRAME_COLS = 16;
+
+u64 rng_state;
+u32 rng(u32 n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (u32)(rng_state >> 32) % n;
+}
+
+DiffOp random_op() {
+    int total = 0;
+    for (int i = 0; i < NUM_OPS; i++) total += OP_WEIGHTS[i];
+    int r = rng(total);
+    for (int i = 0; i < NUM_OPS; i++) {
+        if (r < OP_WEIGHTS[i]) return (DiffOp)i;
+        r -= OP_WEIGHTS[i];
+    }
+    return OP_INSERT;
+}
+
+typedef std::vector<std::string> Lines;
+
+struct ModelPos {
+    int x, y;
+};
+
+struct ModelState {
+    Lines lines;
+    int parent;
+    int redo_child;
+};
+
+struct Model {
+    Lines lines;
+    int cx, cy;
+    // Positions that move like markers: the mark, then one per
+    // entry of `anchors`.
+    std::vector<ModelPos> marks;
+    // Every state the buffer has been in, in the order they were
+    // made, as a tree like the editor's undo tree. `cur` is the
+    // current one.
+    std::vector<ModelState> states;
+    int cur;
+    int tabstop;
+    // The text an OP_PASTE inserts.
+    std::string clip;
+    Lines saved;
+
+    void push() {
+        ModelState st = { lines, cur, -1 };
+        states.push_back(st);
+        states[cur].redo_child = states.size() - 1;
+        cur = states.size() - 1;
+    }
+};
+
+Model M;
+// C without indent rules, see the top.
+EditorSyntax frame_syntax;
+// Markers added by OP_ANCHOR.
+std::vector<Marker*> anchors;
+
+// Position of marker `i` of `Model::marks` in the editor.
+void editor_marker(usize i, int* x, int* y) {
+    if (i == 0) get_region_mark(x, y);
+    else marker_get(anchors[i-1], x, y);
+}
+
+int model_indent(const std::string& s) {
+    int col = 0;
+    for (usize i = 0; i < s.size(); i++) {
+        if (s[i] == '\t') col += M.tabstop - col%M.tabstop;
+        else if (s[i] == ' ') col++;
+        else return col;
+    }
+    return -1;
+}
+
+std::string model_render(const std::string& s) {
+    std::string r;
+    for (usize i = 0; i < s.size(); i++) {
+        if (s[i] == '\t') {
+            r += ' ';
+            while (r.size() % M.tabstop) r += ' ';
+        } else r += s[i];
+    }
+    return r;
+}
+
+void model_split() {
+    if (M.lines.size() == 0) M.lines.push_back("");
+    // At the start of a row the editor inserts an empty row above,
+    // which moves the whole row down.
+    for (usize i = 0; i < M.marks.size(); i++) {
+        ModelPos& m = M.marks[i];
+        if (M.cx == 0 && m.y >= M.cy) {
+            m.y++;
+        } else if (m.y == M.cy && m.x > M.cx) {
+            m.y++;
+            m.x -= M.cx;
+        } else if (m.y > M.cy) {
+            m.y++;
+        }
+    }
+    std::string tail = M.lines[M.cy].substr(M.cx);
+    M.lines[M.cy].resize(M.cx);
+    M.lines.insert(M.lines.begin() + M.cy + 1, tail);
+    M.cx = 0;
+    M.cy++;
+}
+
+void model_insert(char c) {
+    if (M.lines.size() == 0) M.lines.push_back("");
+    for (usize i = 0; i < M.marks.size(); i++) {
+        if (M.marks[i].y == M.cy && M.marks[i].x > M.cx) M.marks[i].x++;
+    }
+    M.lines[M.cy].insert(M.cx, 1, c);
+    M.cx++;
+}
+
+void model_newline() {
+    model_split();
+    M.push();
+    // Autoindent: without a syntax, the previous non-blank row's indent.
+    for (int y = M.cy-1; y >= 0; y--) {
+        int indent = model_indent(M.lines[y]);
+        if (indent == -1) continue;
+        if (indent > 0) {
+            M.lines[M.cy].insert(0, std::string(indent, ' '));
+            for (usize i = 0; i < M.marks.size(); i++) {
+                if (M.marks[i].y == M.cy && M.marks[i].x > 0) M.marks[i].x += indent;
+            }
+            M.cx = indent;
+            M.push();
+        }
+        break;
+    }
+}
+
+void model_drop_empty_file() {
+    if (M.lines.size() == 1 && M.lines[0] == "") {
+        M.lines.clear();
+        for (usize i = 0; i < M.marks.size(); i++) M.marks[i].x = M.marks[i].y = 0;
+    }
+}
+
+// Row `y+1` is appended to row `y`.
+void model_join(int y) {
+    for (usize i = 0; i < M.marks.size(); i++) {
+        ModelPos& m = M.marks[i];
+        if (m.y == y+1) {
+            m.y = y;
+            m.x += M.lines[y].size();
+        } else if (m.y > y+1) {
+            m.y--;
+        }
+    }
+    M.lines[y] += M.lines[y+1];
+    M.lines.erase(M.lines.begin() + y + 1);
+}
+
+void model_delete_left() {
+    if (M.cx == 0 && M.cy == 0) return;
+    if (M.cx > 0) {
+        for (usize i = 0; i < M.marks.size(); i++) {
+            if (M.marks[i].y == M.cy && M.marks[i].x >= M.cx) M.marks[i].x--;
+        }
+        M.lines[M.cy].erase(M.cx-1, 1);
+        M.cx--;
+    } else {
+        M.cx = M.lines[M.cy-1].size();
+        model_join(M.cy-1);
+        M.cy--;
+    }
+    model_drop_empty_file();
+    M.push();
+}
+
+void model_delete_current() {
+    if (M.cy >= (int)M.lines.size()) return;
+    if (M.cx == (int)M.lines[M.cy].size()) {
+        if (M.cy == (int)M.lines.size()-1) return;
+        model_join(M.cy);
+    } else {
+        for (usize i = 0; i < M.marks.size(); i++) {
+            if (M.marks[i].y == M.cy && M.marks[i].x > M.cx) M.marks[i].x--;
+        }
+        M.lines[M.cy].erase(M.cx, 1);
+    }
+    model_drop_empty_file();
+    M.push();
+}
+
+void model_cut() {
+    int sx = M.marks[0].x, sy = M.marks[0].y, ex = M.cx, ey = M.cy;
+    if (sy > ey || (sy == ey && sx > ex)) {
+        std::swap(sx, ex);
+        std::swap(sy, ey);
+    }
+    if (sx == ex && sy == ey) return;
+
+    std::string copy;
+    for (int y = sy; y <= ey; y++) {
+        int from = y == sy ? sx : 0;
+        int to = y == ey ? ex : M.lines[y].size();
+        if (y != sy) copy += '\n';
+        copy += M.lines[y].substr(from, to-from);
+    }
+    for (usize i = 0; i < M.marks.size(); i++) {
+        ModelPos& m = M.marks[i];
+        if (m.y > ey) {
+            m.y -= ey - sy;
+        } else if (m.y == ey && m.x >= ex) {
+            m.y = sy;
+            m.x = sx + m.x - ex;
+        } else if (!pos_before(m.y, m.x, sy, sx)) {
+            m.y = sy;
+            m.x = sx;
+        }
+    }
+    if (sx == 0 && sy == 0 && ey == (int)M.lines.size()-1 && ex == (int)M.lines[ey].size()) {
+        M.lines.clear();
+    } else {
+        M.lines[sy] = M.lines[sy].substr(0, sx) + M.lines[ey].substr(ex);
+        M.lines.erase(M.lines.begin() + sy + 1, M.lines.begin() + ey + 1);
+    }
+    M.cx = sx;
+    M.cy = sy;
+    M.clip = copy;
+    M.push();
+}
+
+void model_paste() {
+    for (usize i = 0; i < M.clip.size(); i++) {
+        if (M.clip[i] == '\n') model_split();
+        else model_insert(M.clip[i]);
+    }
+    M.push();
+}
+
+void model_undo_redo(bool undo) {
+    ModelState& st = M.states[M.cur];
+    if (undo && st.parent != -1) M.cur = st.parent;
+    else if (!undo && st.redo_child != -1) M.cur = st.redo_child;
+    M.lines = M.states[M.cur].lines;
+}
+
+// Moves `steps` states back or forward in the order they were made.
+// Redo then follows the path taken to get there.
+void model_travel(int steps, bool forward) {
+    int target = forward ? M.cur + steps : M.cur - steps;
+    if (target < 0) target = 0;
+    if (target >= (int)M.states.size()) target = M.states.size() - 1;
+
+    std::vector<bool> above_cur(M.states.size(), false);
+    for (int i = M.cur; i != -1; i = M.states[i].parent) above_cur[i] = true;
+    for (int i = target; !above_cur[i]; i = M.states[i].parent) {
+        M.states[M.states[i].parent].redo_child = i;
+    }
+    M.cur = target;
+    M.lines = M.states[M.cur].lines;
+}
+
+std::string describe(DiffOp op, int a, int b) {
+    switch (op) {
+        case OP_INSERT: return fmt::format("insert {:?}", (char)a);
+        case OP_NEWLINE: return "newline";
+        case OP_DELETE_LEFT: return "delete-left";
+        case OP_DELETE_CURRENT: return "delete-current";
+        case OP_MOVE: return fmt::format("move {},{}", a, b);
+        case OP_MARK: return "mark";
+        case OP_ANCHOR: return "anchor";
+        case OP_CUT: return "cut";
+        case OP_PASTE: return "paste";
+        case OP_UNDO: return "undo";
+        case OP_REDO: return "redo";
+        case OP_EARLIER: return fmt::format("earlier {}", a);
+        case OP_LATER: return fmt::format("later {}", a);
+        case OP_TABSTOP: return fmt::format("tabstop {}", a);
+        case OP_COLD: return fmt::format("cold {},{}", a, b);
+    }
+    return "?";
+}
+
+// Applies one operation to the editor, and to the model unless
+// `with_model` is false.
+void apply(DiffOp op, int a, int b, bool with_model) {
+    switch (op) {
+        case OP_INSERT:
+            do_action(INSERT_CHAR, a);
+            if (with_model) {
+                model_insert(a);
+                M.push();
+            }
+            break;
+        case OP_NEWLINE:
+            do_action(INSERT_NEWLINE);
+            if (with_model) model_newline();
+            break;
+        case OP_DELETE_LEFT:
+            do_action(DELETE_LEFT_CHAR);
+            if (with_model) model_delete_left();
+            break;
+        case OP_DELETE_CURRENT:
+            do_action(DELETE_CURRENT_CHAR);
+            if (with_model) model_delete_current();
+            break;
+        case OP_MOVE:
+            E.set_cpos(a, b);
+            M.cx = a;
+            M.cy = b;
+            break;
+        case OP_MARK:
+            do_action(SET_MARK);
+            M.marks[0].x = M.cx;
+            M.marks[0].y = M.cy;
+            break;
+        case OP_ANCHOR: {
+            anchors.push_back(marker_new(MARKER_ANCHOR, E.cx, E.cy));
+            ModelPos m = { M.cx, M.cy };
+            M.marks.push_back(m);
+        } break;
+        case OP_CUT:
+            do_action(CUT_CURSOR_MARK_REGION);
+            if (with_model) model_cut();
+            break;
+        case OP_PASTE:
+            paste_text(M.clip, true);
+            do_action(NOP);
+            if (with_model) model_paste();
+            break;
+        case OP_UNDO:
+        case OP_REDO:
+        case OP_EARLIER:
+        case OP_LATER:
+            if (op == OP_UNDO || op == OP_REDO) {
+                do_action(op == OP_UNDO ? UNDO : REDO);
+                if (with_model) model_undo_redo(op == OP_UNDO);
+            } else {
+                undo_travel(std::to_string(a), op == OP_LATER);
+                if (with_model) model_travel(a, op == OP_LATER);
+            }
+            M.cx = E.cx;
+            M.cy = E.cy;
+            for (usize i = 0; i < M.marks.size(); i++) {
+                editor_marker(i, &M.marks[i].x, &M.marks[i].y);
+            }
+            break;
+        case OP_TABSTOP: {
+            std::string err;
+            set_option("tabstop", std::to_string(a), false, &err);
+            M.tabstop = a;
+        } break;
+        case OP_COLD:
+            cold_pack(a, b);
+            for (usize i = 0; i < E.cold.blocks.size(); i++) {
+                if (E.cold.blocks[i]->resident) cold_drop(E.cold.blocks[i]);
+            }
+            break;
+    }
+}
+
+// Picks the next operation and its arguments from the editor's
+// current state. Returns false if the operation can't apply.
+bool next_op(DiffOp* op, int* a, int* b) {
+    *op = random_op();
+    *a = *b = 0;
+    switch (*op) {
+        case OP_INSERT:
+            *a = TYPED_CHARS[rng(strlen(TYPED_CHARS))];
+            break;
+        case OP_MOVE:
+            if (E.numrows() == 0) return false;
+            *b = E.cy - MOVE_ROWS + (int)rng(2*MOVE_ROWS + 1);
+            if (*b < 0) *b = 0;
+            if (*b > E.lastrow_idx()) *b = E.lastrow_idx();
+            *a = rng(E.rows[*b]->len() + 1);
+            break;
+        case OP_ANCHOR:
+            if ((int)anchors.size() == MAX_ANCHORS) return false;
+            break;
+        case OP_PASTE:
+            if (M.clip == "") return false;
+            break;
+        case OP_EARLIER:
+        case OP_LATER:
+            *a = rng(8);
+            break;
+        case OP_TABSTOP:
+            *a = 1 + rng(8);
+            break;
+        case OP_COLD:
+            if (E.numrows() == 0) return false;
+            *a = rng(E.numrows());
+            *b = *a + 1 + rng(E.numrows() - *a);
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+u64 expected_hash(const Lines& lines) {
+    u64 h = 0, pw = 1;
+    for (usize i = 0; i < lines.size(); i++) {
+        h += hash_bytes(lines[i].data(), lines[i].size()) * pw;
+        pw *= HASH_BASE;
+    }
+    return h;
+}
+
+Lines editor_lines() {
+    Lines lines;
+    for (int i = 0; i < E.numrows(); i++) lines.push_back(row_text(E.rows[i])->data);
+    return lines;
+}
+
+// Every shared text must be counted once per row using it and be
+// listed under its hash; texts not in the table are never shared.
+std::string check_interned() {
+    std::unordered_map<RowText*, int> uses;
+    for (int i = 0; i < E.numrows(); i++) uses[E.rows[i]->text]++;
+    for (std::unordered_map<RowText*, int>::iterator it = uses.begin(); it != uses.end(); it++) {
+        RowText* t = text_resident(it->first);
+        if (t->refs != it->second) return fmt::format("text {:?} has {} refs, used by {} rows", t->data, t->refs, it->second);
+        std::unordered_map<u64, RowText*>::iterator in = E.interned.find(t->hash);
+        if (t->interned && (in == E.interned.end() || in->second != t)) {
+            return fmt::format("text {:?} missing from the table", t->data);
+        }
+        if (t->interned && t->hash != hash_bytes(t->data.data(), t->data.size())) {
+            return fmt::format("text {:?} listed under a stale hash", t->data);
+        }
+    }
+    if (E.interned.size() > uses.size()) return "unused texts left in the table";
+    return "";
+}
+
+// Texts in a block must be listed at their entry, blocks must count
+// their texts and the memory counters of rows and text must add up.
+std::string check_cold() {
+    std::unordered_map<RowText*, int> seen;
+    usize bytes = 0;
+    for (int i = 0; i < E.numrows(); i++) {
+        RowText* t = E.rows[i]->text;
+        if (seen[t]++) continue;
+        bytes += t->data.size() + t->rdata.size();
+        if (t->data_bytes != t->data.size() || t->rdata_bytes != t->rdata.size()) return fmt::format("row {} miscounted", i);
+        if (t->block && t->block->texts[t->block_idx] != t) return fmt::format("row {} not in its block", i);
+    }
+    if (bytes != text_bytes()) return fmt::format("{} bytes of text, counted {}", bytes, text_bytes());
+    usize rows = E.numrows() * sizeof(EditorRow) + seen.size() * sizeof(RowText);
+    if (MEM[MEM_ROWS].bytes != (i64)rows) return fmt::format("{} bytes of rows, counted {}", rows, MEM[MEM_ROWS].bytes);
+    for (usize i = 0; i < E.cold.blocks.size(); i++) {
+        ColdBlock* b = E.cold.blocks[i];
+        int live = 0;
+        for (usize j = 0; j < b->texts.size(); j++) {
+            if (!b->texts[j]) continue;
+            if (!seen.count(b->texts[j])) return "freed text left in a block";
+            live++;
+        }
+        if (live != b->live || live == 0) return fmt::format("block has {} texts, counts {}", live, b->live);
+    }
+    return "";
+}
+
+// Rows changed since the last save must be listed once, each at the
+// index it records.
+std::string check_modified() {
+    int changed = 0;
+    for (int i = 0; i < E.numrows(); i++) changed += E.rows[i]->gen > E.save_gen;
+    if (changed != (int)E.modified_rows.size()) {
+        return fmt::format("{} rows changed, {} listed", changed, E.modified_rows.size());
+    }
+    for (usize i = 0; i < E.modified_rows.size(); i++) {
+        if (E.modified_rows[i]->modified_idx != (int)i) return fmt::format("modified row {} records a wrong index", i);
+    }
+    return "";
+}
+
+// One screen cell: the byte shown, the SGR parameters it was drawn
+// with after their leading reset, and whether it is inverted. A
+// blank outside decorations may be drawn in any style, as only its
+// background would show.
+struct Cell {
+    char c;
+    std::string sgr;
+    bool inverse;
+    bool any_style;
+};
+typedef std::vector<std::vector<Cell> > Frame;
+
+std::string describe_cell(const Cell& cell) {
+    return fmt::format("{:?}{}{}", cell.c, cell.inverse ? " inverted" : "", cell.any_style ? "" : " sgr " + cell.sgr);
+}
+
+bool cell_matches(const Cell& got, const Cell& want) {
+    return got.c == want.c && got.inverse == want.inverse && (want.any_style || got.sgr == want.sgr);
+}
+
+// Plays `out` on a FRAME_ROWS x FRAME_COLS screen that starts out
+// full of `#`. Only what `draw_rows` may send is understood.
+std::string play_frame(const std::string& out, Frame* f) {
+    Cell garbage = { '#', "", false, false };
+    f->assign(FRAME_ROWS, std::vector<Cell>(FRAME_COLS, garbage));
+    Cell pen = { ' ', "", false, false };
+    int x = 0, y = 0;
+    char last = 0;
+    for (usize i = 0; i < out.size(); i++) {
+        int n = 1;
+        if (out[i] == '\x1b') {
+            usize j = i+1;
+            if (j == out.size() || out[j] != '[') return fmt::format("bare escape at byte {}", i);
+            while (++j < out.size() && (isdigit(out[j]) || out[j] == ';')) {}
+            if (j == out.size()) return "unterminated escape sequence";
+            std::string params = out.substr(i+2, j-i-2);
+            if (params != "") n = atoi(params.c_str());
+            char final = out[j];
+            i = j;
+            if (final == 'K') {
+                Cell blank = { ' ', "", false, false };
+                for (int k = x; k < FRAME_COLS; k++) (*f)[y][k] = blank;
+                continue;
+            } else if (final == 'C') {
+                x += n;
+                continue;
+            } else if (final == 'm' && (params == "7" || params == "27")) {
+                pen.inverse = params == "7";
+                continue;
+            } else if (final == 'm' && params[0] == '0') {
+                pen.sgr = params.substr(1);
+                pen.inverse = false;
+                continue;
+            } else if (final != 'b') {
+                return fmt::format("unexpected sequence {:?}", out.substr(i - params.size() - 2, params.size() + 3));
+            }
+        } else if (out[i] == '\r' && i+1 < out.size() && out[i+1] == '\n') {
+            i++;
+            x = 0;
+            if (++y == FRAME_ROWS) return "drawn past the last row";
+            continue;
+        } else {
+            last = out[i];
+        }
+        for (int k = 0; k < n; k++) {
+            if (x >= FRAME_COLS) return fmt::format("row {} drawn past the last column", y);
+            pen.c = last;
+            (*f)[y][x++] = pen;
+        }
+    }
+    return "";
+}
+
+// The frame the model's buffer should draw as, scrolled as the
+// editor is.
+void model_frame(Frame* f) {
+    Cell blank = { ' ', "", false, false };
+    f->assign(FRAME_ROWS, std::vector<Cell>(FRAME_COLS, blank));
+    for (int y = 0; y < FRAME_ROWS; y++) {
+        std::vector<Cell>& cells = (*f)[y];
+        usize filerow = y + E.rowoff;
+        if (filerow >= M.lines.size()) {
+            std::string s = "~";
+            if (M.lines.empty() && y == FRAME_ROWS / 3) {
+                std::string welcome = "hed editor -- maintained by shkhuz";
+                welcome.resize(std::min((int)welcome.size(), FRAME_COLS));
+                s = std::string((FRAME_COLS - welcome.size()) / 2, ' ') + welcome;
+                if (s[0] == ' ') s[0] = '~';
+            }
+            for (usize x = 0; x < s.size(); x++) cells[x].c = s[x];
+            continue;
+        }
+
+        const std::string& line = M.lines[filerow];
+        std::string r = model_render(line);
+        std::vector<u8> hl(r.size() + 1);
+        lex_row_syntax(r.data(), r.size(), hl.data());
+        // The character each rendered column belongs to.
+        std::vector<int> col_cx;
+        for (usize cx = 0; cx < line.size(); cx++) {
+            usize end = line[cx] == '\t' ? (col_cx.size() / M.tabstop + 1) * M.tabstop : col_cx.size() + 1;
+            while (col_cx.size() < end) col_cx.push_back(cx);
+        }
+        for (int x = 0; x < FRAME_COLS && E.coloff + x < (int)r.size(); x++) {
+            int rx = E.coloff + x, cx = col_cx[rx];
+            u32 mask = 0;
+            for (int k = 0; k < NUM_DECO_KINDS; k++) {
+                for (usize d = 0; d < E.decos.by_kind[k].size(); d++) {
+                    const Decoration& deco = E.decos.by_kind[k][d];
+                    if ((int)filerow < deco.y0 || (int)filerow > deco.y1) continue;
+                    int x0 = deco.y0 == (int)filerow ? std::min(deco.x0, (int)line.size()) : 0;
+                    int x1 = deco.y1 == (int)filerow ? std::min(deco.x1, (int)line.size()) : line.size();
+                    if (x0 <= cx && cx < x1) mask |= 1 << k;
+                }
+            }
+            const std::string& sgr = style_sgr(hl[rx], mask);
+            cells[x].c = r[rx];
+            cells[x].sgr = sgr.substr(3, sgr.size() - 4);
+            cells[x].any_style = r[rx] == ' ' && mask == 0;
+            if (iscntrl(r[rx])) {
+                cells[x].c = r[rx] <= 26 ? '@' + r[rx] : '?';
+                cells[x].inverse = true;
+            }
+        }
+    }
+}
+
+// Draws the rows as `refresh_screen` does and compares the frame
+// with the model's.
+std::string check_frame() {
+    update_rx();
+    scroll_to(E.rx, E.cy);
+    update_decorations();
+    E.abuf.clear();
+    draw_rows();
+    Frame got, want;
+    std::string err = play_frame(E.abuf, &got);
+    E.abuf.clear();
+    if (err != "") return "frame: " + err;
+    model_frame(&want);
+    for (int y = 0; y < FRAME_ROWS; y++) {
+        for (int x = 0; x < FRAME_COLS; x++) {
+            if (!cell_matches(got[y][x], want[y][x])) {
+                return fmt::format("frame cell {},{} (scrolled {},{}) is {}, expected {}", x, y,
+                    E.coloff, E.rowoff, describe_cell(got[y][x]), describe_cell(want[y][x]));
+            }
+        }
+    }
+    return "";
+}
+
+// Returns a description of the first difference, or "".
+std::string compare(bool check_cursor) {
+    if (E.numrows() != (int)M.lines.size()) {
+        return fmt::format("{} rows, expected {}", E.numrows(), M.lines.size());
+    }
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = row_layout(E.rows[i]);
+        if (row_text(row)->data != M.lines[i]) {
+            return fmt::format("row {} is {:?}, expected {:?}", i, row_text(row)->data, M.lines[i]);
+        }
+        std::string r = model_render(M.lines[i]);
+        if (row_text(row)->rlen != (int)r.size() || row_text(row)->rdata.compare(0, row_text(row)->rlen, r) != 0) {
+            return fmt::format("row {} renders as {:?}, expected {:?}", i, row_text(row)->rdata.substr(0, row_text(row)->rlen), r);
+        }
+        if (row_text(row)->indent != model_indent(M.lines[i])) {
+            return fmt::format("row {} has indent {}, expected {}", i, row_text(row)->indent, model_indent(M.lines[i]));
+        }
+    }
+    if (E.content_hash() != expected_hash(M.lines)) return "content hash out of date";
+    std::string err = check_interned();
+    if (err == "") err = check_cold();
+    if (err == "") err = check_modified();
+    if (err == "") err = check_frame();
+    if (err != "") return err;
+    if (E.is_dirty() != (M.lines != M.saved)) {
+        return fmt::format("dirty is {}, expected {}", E.is_dirty(), !E.is_dirty());
+    }
+
+    int maxy = E.numrows() == 0 ? 0 : E.lastrow_idx();
+    int maxx = E.numrows() == 0 ? 0 : E.rows[E.cy < E.numrows() ? E.cy : 0]->len();
+    if (E.cy < 0 || E.cy > maxy || E.cx < 0 || E.cx > maxx) {
+        return fmt::format("cursor {},{} out of bounds", E.cx, E.cy);
+    }
+    if (check_cursor && (E.cx != M.cx || E.cy != M.cy)) {
+        return fmt::format("cursor {},{}, expected {},{}", E.cx, E.cy, M.cx, M.cy);
+    }
+    for (usize i = 0; check_cursor && i < M.marks.size(); i++) {
+        int x, y;
+        editor_marker(i, &x, &y);
+        if (x != M.marks[i].x || y != M.marks[i].y) {
+            return fmt::format("marker {} at {},{}, expected {},{}", i, x, y, M.marks[i].x, M.marks[i].y);
+        }
+    }
+    return "";
+}
+
+void reset(int nlines) {
+    close_file();
+    E.syn = &frame_syntax;
+    E.global_opts.intern = rng(2);
+    // Both ways of drawing runs.
+    TC.rep = rng(2);
+    TC.cuf = rng(2);
+    Lines initial;
+    for (int i = 0; i < nlines; i++) {
+        std::string s;
+        int len = rng(12);
+        for (int j = 0; j < len; j++) s += TYPED_CHARS[rng(strlen(TYPED_CHARS))];
+        initial.push_back(s);
+    }
+    // The editor never keeps a lone empty row.
+    if (initial.size() == 1 && initial[0] == "") initial.clear();
+    insert_rows(0, initial);
+    remember_saved_hash();
+    forget_modified_rows();
+    E.set_cpos(0, 0);
+
+    M.lines = initial;
+    M.saved = initial;
+    M.cx = M.cy = 0;
+    M.marks.assign(1, ModelPos());
+    anchors.clear();
+    ModelState root = { initial, -1, -1 };
+    M.states.assign(1, root);
+    M.cur = 0;
+    M.tabstop = E.opts.tabstop;
+    M.clip = "";
+}
+
+// Runs one random sequence. Returns false after printing the
+// failing step.
+bool run(u64 seed, int nops) {
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    reset(rng(6));
+    std::vector<std::string> log;
+    for (int step = 0; step < nops; step++) {
+        DiffOp op;
+        int a, b;
+        if (!next_op(&op, &a, &b)) continue;
+        log.push_back(describe(op, a, b));
+        apply(op, a, b, true);
+
+        std::string diff = compare(op != OP_UNDO && op != OP_REDO);
+        if (diff != "") {
+            fputs(fmt::format("seed {} step {}: {}\n", seed, step, diff).c_str(), stderr);
+            usize from = log.size() > 30 ? log.size() - 30 : 0;
+            for (usize i = from; i < log.size(); i++) {
+                fputs(fmt::format("  {}\n", log[i]).c_str(), stderr);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+int stress(u64 seed, int nops) {
+    rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    reset(100);
+    i64 start = now_us();
+    int done = 0;
+    for (int step = 0; step < nops; step++) {
+        DiffOp op;
+        int a, b;
+        if (!next_op(&op, &a, &b)) continue;
+        apply(op, a, b, false);
+        if (op == OP_CUT) M.clip = E.lastundo()->data;
+        done++;
+    }
+    double secs = (now_us() - start) / 1e6;
+
+    M.lines = editor_lines();
+    if (E.content_hash() != expected_hash(M.lines)) {
+        fputs("content hash out of date\n", stderr);
+        return 1;
+    }
+    std::string err = check_interned();
+    if (err == "") err = check_cold();
+    if (err != "") {
+        fputs((err + "\n").c_str(), stderr);
+        return 1;
+    }
+    for (int i = 0; i < E.numrows(); i++) {
+        EditorRow* row = row_layout(E.rows[i]);
+        if (row_text(row)->rdata.compare(0, row_text(row)->rlen, model_render(row_text(row)->data)) != 0) {
+            fputs(fmt::format("row {} renders wrong\n", i).c_str(), stderr);
+            return 1;
+        }
+    }
+    fputs(fmt::format("{} ops in {:.3f}s, {:.0f} ops/s, {} rows, {} undo entries\n",
+        done, secs, done / secs, E.numrows(), E.numundos()).c_str(), stdout);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    u64 seed = 1;
+    int runs = 500, nops = 400, stress_ops = 0;
+    for (int i = 1; i+1 < argc; i += 2) {
+        long v = strtol(argv[i+1], NULL, 10);
+        if (!strcmp(argv[i], "--seed")) seed = v;
+        else if (!strcmp(argv[i], "--runs")) runs = v;
+        else if (!strcmp(argv[i], "--ops")) nops = v;
+        else if (!strcmp(argv[i], "--stress")) stress_ops = v;
+        else {
+            fputs("usage: difftest [--seed N] [--runs N] [--ops N] | --stress N [--seed N]\n", stderr);
+            return 2;
+        }
+    }
+
+    E.batch = true;
+    init_editor_state();
+    init_options(&E.global_opts);
+    E.opts = E.global_opts;
+    E.cmdline.clear();
+    // Rows are only highlighted outside batch mode.
+    E.batch = false;
+    E.screenrows = FRAME_ROWS;
+    E.screencols = FRAME_COLS;
+    frame_syntax = HLDB[0];
+    frame_syntax.indent_open = frame_syntax.indent_close = "";
+
+    if (stress_ops) return stress(seed, stress_ops);
+
+    for (int r = 0; r < runs; r++) {
+        if (!run(seed + r, nops)) return 1;
+    }
+    fputs(fmt::format("{} runs of {} ops passed (seeds {}..{})\n", runs, nops, seed, seed + runs - 1).c_str(), stdout);
+    return 0;
+}